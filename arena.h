@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bump allocator, allocations are only released all at once by arena_free.
+// Memory comes from a chain of blocks, a new block is added when the current one is full.
+
+typedef struct ArenaBlock_s
+{
+	struct ArenaBlock_s *next;
+	size_t size;
+	size_t used;
+} ArenaBlock;
+
+typedef struct
+{
+	ArenaBlock *head;
+	size_t block_size;
+} Arena;
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+// block_size is the size of the first block, 0 picks a default.
+static void arena_init(Arena *a, size_t block_size)
+{
+	a->head = NULL;
+	a->block_size = block_size ? block_size : ARENA_BLOCK_SIZE;
+}
+
+static size_t arena_align_offset_(ArenaBlock *b, size_t offset, size_t align)
+{
+	uintptr_t base = (uintptr_t)(b + 1);
+	return ((base + offset + align - 1) & ~(uintptr_t)(align - 1)) - base;
+}
+
+// align has to be a power of two.
+static void *arena_alloc_aligned(Arena *a, size_t size, size_t align)
+{
+	ArenaBlock *b = a->head;
+	size_t offset = b ? arena_align_offset_(b, b->used, align) : 0;
+	if(!b || offset > b->size || b->size - offset < size)
+	{
+		size_t block_size = a->block_size > size + align ? a->block_size : size + align;
+		b = malloc(sizeof(ArenaBlock) + block_size);
+		if(!b)
+			return NULL;
+		b->next = a->head;
+		b->size = block_size;
+		b->used = 0;
+		a->head = b;
+		// Blocks after the first one grow so the chain stays short.
+		a->block_size = block_size * 2;
+		offset = arena_align_offset_(b, 0, align);
+	}
+	b->used = offset + size;
+	return (char *)(b + 1) + offset;
+}
+
+static void *arena_alloc(Arena *a, size_t size)
+{
+	return arena_alloc_aligned(a, size, ARENA_ALIGN);
+}
+
+static char *arena_strndup(Arena *a, const char *s, size_t n)
+{
+	char *dst = arena_alloc_aligned(a, n + 1, 1);
+	if(!dst)
+		return NULL;
+	memcpy(dst, s, n);
+	dst[n] = 0;
+	return dst;
+}
+
+static void arena_free(Arena *a)
+{
+	ArenaBlock *b = a->head;
+	while(b)
+	{
+		ArenaBlock *next = b->next;
+		free(b);
+		b = next;
+	}
+	a->head = NULL;
+}
@@ -1,812 +1,69 @@
-#include <setjmp.h>
-#include <stdarg.h>
 #include <assert.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
-#include <malloc.h>
-#include <math.h>
-#include "type.h"
-#include "lump.h"
-#include "entity_parser.h"
+#include "bsp.h"
+#include "stream_file.h"
+#include "stream_buffered.h"
 #include <growable-buf/buf.h>
 
-#include "stream_file.h"
-#include "stream_buffer.h"
+#include "thread.h"
+#include "timer.h"
 
-#include <linmath.h/linmath.h>
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+enum
+{
+	EXPORT_MAP,
+	EXPORT_OBJ,
+	EXPORT_MESH
+};
 
-// #define STB_IMAGE_WRITE_IMPLEMENTATION
-// #include "stb_image_write.h"
+static const char *export_extensions[] = { "map", "obj", "bspmesh" };
 
 typedef struct
 {
 	bool print_info;
+	bool print_cells;
 	bool export_to_map;
-	const char *input_file;
-	const char *format;
+	const char **input_files;
+	const char *file_list;
 	const char *export_file;
+	const char *points_file;
+	const char *trace_file;
+	const char *vis_file;
+	vec3 hull_mins, hull_maxs;
 	bool try_fix_portals;
 	bool exclude_patches;
+	bool no_mmap;
+	bool preload;
+	bool cache;
+	bool print_stats;
+	int stats_format;
+	size_t thread_count;
+	int float_format;
+	int export_format;
 } ProgramOptions;
 
-LumpData lumpdata[LUMP_MAX];
-
-s64 filelen;
-
-Entity *entities;
-
-void info(dheader_t *hdr, int type, int *count)
-{
-	lump_t *l = &hdr->lumps[type];
-	char amount[256] = { 0 };
-	if(count)
-	{
-		snprintf(amount, sizeof(amount), "%6d", *count);
-	} else
-	{
-		if(lumpsizes[type] == 0)
-			snprintf(amount, sizeof(amount), "     ?");
-		else if(lumpsizes[type] == 1)
-		{
-			snprintf(amount, sizeof(amount), "      ");
-		}
-		else if(lumpsizes[type] > 1)
-		{
-			snprintf(amount, sizeof(amount), "%6d", l->filelen / lumpsizes[type]);
-		}
-	}
-	printf("%s %-19s %6d B\t%2d KB %5.1f%%\n",
-		amount,
-		lumpnames[type],
-		l->filelen,
-		(int)ceilf((float)l->filelen / 1000.f),
-		(float)l->filelen / (float)filelen * 100.f);
-}
-
 static void test(const char *type, size_t a, size_t b)
 {
 	if(a != b)
 	{
-		fprintf(stderr, "%d != %d, sizeof(%s) = %d\n", a, b, type, a);
+		fprintf(stderr, "%zu != %zu, sizeof(%s) = %zu\n", a, b, type, a);
 		exit(1);
 	}
 }
 #define TEST(a, b) test(#a, sizeof(a), b)
 
-void planes_from_aabb(vec3 mins, vec3 maxs, DiskPlane planes[6])
-{
-	planes[0].normal[0] = -1.0f;
-	planes[0].normal[1] = 0.0f;
-	planes[0].normal[2] = 0.0f;
-	planes[0].dist = -mins[0];
-
-	planes[1].normal[0] = 1.0f;
-	planes[1].normal[1] = 0.0f;
-	planes[1].normal[2] = 0.0f;
-	planes[1].dist = maxs[0];
-
-	planes[2].normal[0] = 0.0f;
-	planes[2].normal[1] = -1.0f;
-	planes[2].normal[2] = 0.0f;
-	planes[2].dist = -mins[1];
-
-	planes[3].normal[0] = 0.0f;
-	planes[3].normal[1] = 1.0f;
-	planes[3].normal[2] = 0.0f;
-	planes[3].dist = maxs[1];
-
-	planes[4].normal[0] = 0.0f;
-	planes[4].normal[1] = 0.0f;
-	planes[4].normal[2] = -1.0f;
-	planes[4].dist = -mins[2];
-
-	planes[5].normal[0] = 0.0f;
-	planes[5].normal[1] = 0.0f;
-	planes[5].normal[2] = 1.0f;
-	planes[5].dist = maxs[2];
-}
-
-static void write_plane(FILE *fp, const char *material, vec3 n, float dist, vec3 origin)
-{
-	vec3 tangent, bitangent;
-	vec3 up = { 0, 0, 1.f };
-	vec3 fw = { 0, 1.f, 0 };
-	float d = vec3_mul_inner(up, n);
-	if(fabs(d) < 0.01f)
-	{
-		vec3_mul_cross(tangent, n, up);
-	}
-	else
-	{
-		vec3_mul_cross(tangent, n, fw);
-	}
-	vec3_mul_cross(bitangent, n, tangent);
-
-	vec3 a, b, c;
-	vec3 t;
-	vec3_scale(a, n, dist);
-	vec3_scale(t, tangent, 100.f);
-	vec3_add(b, a, t);
-	vec3_scale(t, bitangent, 100.f);
-	vec3_add(c, a, t);
-
-	fprintf(fp,
-			" ( %f %f %f ) ( %f %f %f ) ( %f %f %f ) %s 128 128 0 0 0 0 lightmap_gray 16384 16384 0 "
-			"0 0 0\n",
-			c[0] + origin[0],
-			c[1] + origin[1],
-			c[2] + origin[2],
-			b[0] + origin[0],
-			b[1] + origin[1],
-			b[2] + origin[2],
-			a[0] + origin[0],
-			a[1] + origin[1],
-			a[2] + origin[2],
-			material ? material : "caulk");
-}
-
-const char *entity_key_by_value(Entity *ent, const char *key)
-{
-	for(size_t i = 0; i < buf_size(ent->keyvalues); ++i)
-	{
-		if(!strcmp(ent->keyvalues[i].key, key))
-			return ent->keyvalues[i].value;
-	}
-	return "";
-}
-
-typedef struct
-{
-	s32 vertex[3];
-} Triangle;
-
-typedef struct
-{
-	Triangle *triangles;
-	s32 materialIndex;
-} Patch;
-
-static int triangle_vertex_compare(const void *a, const void *b)
-{
-	return (*(int *)a - *(int *)b);
-}
-
-// vertices should be sorted
-bool patch_has_triangle(Patch *patch, int *vertices)
-{
-	for(size_t i = 0; i < buf_size(patch->triangles); ++i)
-	{
-		Triangle *tri = &patch->triangles[i];
-		if(tri->vertex[0] == vertices[0] && tri->vertex[1] == vertices[1] && tri->vertex[2] == vertices[2])
-			return true;
-	}
-	return false;
-}
-
-bool patches_has_triangle(Patch *patches, int *vertices)
-{
-	for(size_t i = 0; i < buf_size(patches); ++i)
-	{
-		if(patch_has_triangle(&patches[i], vertices))
-			return true;
-	}
-	return false;
-}
-
-static bool vec3_fuzzy_zero(float *v)
-{
-	float e = 0.0001f;
-	return fabs(v[0]) < e && fabs(v[1]) < e && fabs(v[2]) < e;
-}
-
-static void write_patches(FILE *fp)
-{
-	dmaterial_t *materials = (dmaterial_t*)lumpdata[LUMP_MATERIALS].data;
-	DiskCollisionVertex *vertices = lumpdata[LUMP_COLLISIONVERTS].data;
-	DiskCollisionTriangle *tris = lumpdata[LUMP_COLLISIONTRIS].data;
-	DiskCollisionAabbTree *collaabbtrees = lumpdata[LUMP_COLLISIONAABBS].data;
-	DiskCollisionPartition *collpartitions = lumpdata[LUMP_COLLISIONPARTITIONS].data;
-
-	Patch *patches = NULL;
-	Patch *patch = NULL;
-
-	for(size_t i = 0; i < lumpdata[LUMP_COLLISIONAABBS].count; ++i)
-	{
-		DiskCollisionAabbTree *tree = &collaabbtrees[i];
-		DiskCollisionPartition *part = &collpartitions[tree->u.partitionIndex];
-		if(tree->childCount > 0)
-			continue;
-		bool created_new_patch = false;
-		if(part->triCount > 0)
-		{
-			for(size_t j = 0; j < part->triCount; ++j)
-			{
-				DiskCollisionTriangle *tri = &tris[part->firstTriIndex + j];
-
-				Triangle triangle;
-				triangle.vertex[0] = tri->vertIndices[0];
-				triangle.vertex[1] = tri->vertIndices[1];
-				triangle.vertex[2] = tri->vertIndices[2];
-
-				if(vec3_fuzzy_zero(vertices[triangle.vertex[0]].xyz)
-				   || vec3_fuzzy_zero(vertices[triangle.vertex[1]].xyz)
-				   || vec3_fuzzy_zero(vertices[triangle.vertex[2]].xyz))
-				{
-					continue;
-				}
-
-				if(patch && buf_size(patch->triangles) >= 7)
-				{
-					buf_push(patches, ((Patch) { .triangles = NULL, .materialIndex = tree->materialIndex }));
-					patch = &patches[buf_size(patches) - 1];
-					created_new_patch = true;
-				}
-				qsort(triangle.vertex, 3, sizeof(int), triangle_vertex_compare);
-
-				if(!patches_has_triangle(patches, triangle.vertex))
-				{
-					if(!created_new_patch)
-					{
-						buf_push(patches, ((Patch) { .triangles = NULL, .materialIndex = tree->materialIndex }));
-						patch = &patches[buf_size(patches) - 1];
-						created_new_patch = true;
-					}
-					buf_push(patch->triangles, triangle);
-				}
-			}
-		}
-	}
-	
-	// TODO: better way of converting triangles into patches
-
-	for(size_t i = 0; i < buf_size(patches); ++i)
-	{
-		Patch *patch = &patches[i];
-		if(buf_size(patch->triangles) == 0)
-			continue;
-
-		fprintf(fp, "  {\n");
-		fprintf(fp, "   mesh\n");
-		fprintf(fp, "   {\n");
-		fprintf(fp, "   %s\n", materials[patch->materialIndex].material);
-		// TODO: write contentFlags and contentFlags info
-		fprintf(fp, "   lightmap_gray\n");
-		fprintf(fp, "   %d 2 16 8\n", buf_size(patch->triangles) * 2);
-
-		for(size_t j = 0; j < buf_size(patch->triangles); ++j)
-		{
-			Triangle *tri = &patch->triangles[j];
-			DiskCollisionVertex *v1 = &vertices[tri->vertex[0]];
-			DiskCollisionVertex *v2 = &vertices[tri->vertex[1]];
-			DiskCollisionVertex *v3 = &vertices[tri->vertex[2]];
-			fprintf(fp, "   (\n");
-			fprintf(fp, "	v %f %f %f t -1024 1024 -4 4\n", v1->xyz[0], v1->xyz[1], v1->xyz[2]);
-			fprintf(fp, "	v %f %f %f t -1024 1024 -4 4\n", v2->xyz[0], v2->xyz[1], v2->xyz[2]);
-			fprintf(fp, "   )\n");
-			fprintf(fp, "   (\n");
-			fprintf(fp, "	v %f %f %f t -1024 1024 -4 4\n", v3->xyz[0], v3->xyz[1], v3->xyz[2]);
-			fprintf(fp, "	v %f %f %f t -1024 1024 -4 4\n", v1->xyz[0], v1->xyz[1], v1->xyz[2]);
-			fprintf(fp,"   )\n");
-		}
-		fprintf(fp, "   }\n");
-		fprintf(fp, "  }\n");
-
-	}
-}
-
-void triangle_normal(vec3 n, const vec3 a, const vec3 b, const vec3 c)
-{
-    vec3 e1, e2;
-    vec3_sub(e1, b, a);
-    vec3_sub(e2, c, a);
-    vec3_mul_cross(n, e1, e2);
-    vec3_norm(n, n);
-}
-
-static bool vec3_fuzzy_eq(float *a, float *b)
-{
-	for(size_t k = 0; k < 3; ++k)
-	{
-		if(fabs(a[k] - b[k]) > 0.0001)
-			return false;
-	}
-	return true;
-}
-
-static void write_portals(FILE *fp)
-{
-	DiskGfxPortal *portals = lumpdata[LUMP_PORTALS].data;
-	DiskGfxPortalVertex *vertices = lumpdata[LUMP_PORTALVERTS].data;
-	DiskPlane *planes = (DiskPlane*)lumpdata[LUMP_PLANES].data;
-	
-	int *written = malloc(lumpdata[LUMP_PORTALS].count * sizeof(int));
-	memset(written, -1, lumpdata[LUMP_PORTALS].count * sizeof(int));
-	size_t written_count = 0;
-
-	for(size_t i = 0; i < lumpdata[LUMP_PORTALS].count; ++i)
-	{
-		DiskGfxPortal *portal = &portals[i];
-		bool found = false;
-		for(size_t k = 0; k < written_count; ++k)
-		{
-			DiskGfxPortal *other = &portals[written[k]];
-			if(other->portalVertexCount != portal->portalVertexCount)
-				continue;
-			size_t match_count = 0;
-			for(size_t g = 0; g < other->portalVertexCount; ++g)
-			{
-				for(size_t h = 0; h < portal->portalVertexCount; ++h)
-				{
-					if(vec3_fuzzy_eq(vertices[portal->firstPortalVertex + h].xyz, vertices[other->firstPortalVertex + g].xyz))
-						++match_count;
-				}
-			}
-			if(match_count == portal->portalVertexCount)
-			{
-				found = true;
-				break;
-			}
-		}
-		if(found)
-			continue;
-		fprintf(fp, "{\n");
-		written[written_count++] = i;
-
-		DiskPlane *plane = &planes[portal->planeIndex];
-
-		vec3 portal_normal;
-		triangle_normal(portal_normal, vertices[portal->firstPortalVertex].xyz, vertices[portal->firstPortalVertex + 1].xyz, vertices[portal->firstPortalVertex + 2].xyz);
-		float portal_distance = vec3_mul_inner(portal_normal, vertices[portal->firstPortalVertex].xyz);
-
-		write_plane(fp, "portal", portal_normal, portal_distance, (vec3) { 0.f, 0.f, 0.f });
-		for(int k = 0; k < 3; ++k)
-			portal_normal[k] = -portal_normal[k];
-		write_plane(fp, "portal_nodraw", portal_normal, -portal_distance + 8.f, (vec3) { 0.f, 0.f, 0.f });
-		for(size_t i = 0; i < portal->portalVertexCount; ++i)
-		{
-			DiskGfxPortalVertex *a = &vertices[portal->firstPortalVertex + i];
-			int next_idx = i + 1 >= portal->portalVertexCount ? 0 : i + 1;
-			DiskGfxPortalVertex *b = &vertices[portal->firstPortalVertex + next_idx];
-
-			vec3 ba;
-			vec3_sub(ba, b->xyz, a->xyz);
-			vec3_norm(ba, ba);
-			vec3 n;
-			vec3_mul_cross(n, ba, plane->normal);
-
-			float d = vec3_mul_inner(n, a->xyz);
-			for(int k = 0; k < 3; ++k)
-				n[k] = -n[k];
-			write_plane(fp, "portal_nodraw", n, -d, (vec3) { 0.f, 0.f, 0.f });
-		}
-		fprintf(fp, "}\n");
-	}
-}
-
-static bool ignore_material(const char *material)
-{
-	static const char *ignored[] = { "portal", "portal_nodraw", NULL };
-	for(size_t i = 0; ignored[i]; ++i)
-	{
-		if(!strcmp(material, ignored[i]))
-			return true;
-	}
-	return false;
-}
-
-typedef struct
-{
-	vec3 normal;
-	float distance;
-	char material[256];
-} MapPlane;
-
-typedef struct
-{
-	vec3 mins, maxs;
-	MapPlane *planes;
-} MapBrush;
-
-typedef struct
-{
-	vec3 *points;
-	uint32_t *indices;
-	vec2 *uvs;
-	MapPlane *plane;
-} Polygon;
-
-MapBrush *mapbrushes = NULL;
-
-void map_planes_from_aabb(vec3 mins, vec3 maxs, MapPlane planes[6])
-{
-	planes[0].normal[0] = -1.0f;
-	planes[0].normal[1] = 0.0f;
-	planes[0].normal[2] = 0.0f;
-	planes[0].distance = -mins[0];
-
-	planes[1].normal[0] = 1.0f;
-	planes[1].normal[1] = 0.0f;
-	planes[1].normal[2] = 0.0f;
-	planes[1].distance = maxs[0];
-
-	planes[2].normal[0] = 0.0f;
-	planes[2].normal[1] = -1.0f;
-	planes[2].normal[2] = 0.0f;
-	planes[2].distance = -mins[1];
-
-	planes[3].normal[0] = 0.0f;
-	planes[3].normal[1] = 1.0f;
-	planes[3].normal[2] = 0.0f;
-	planes[3].distance = maxs[1];
-
-	planes[4].normal[0] = 0.0f;
-	planes[4].normal[1] = 0.0f;
-	planes[4].normal[2] = -1.0f;
-	planes[4].distance = -mins[2];
-
-	planes[5].normal[0] = 0.0f;
-	planes[5].normal[1] = 0.0f;
-	planes[5].normal[2] = 1.0f;
-	planes[5].distance = maxs[2];
-}
-
-static void load_map_brushes()
-{
-	size_t side_offset = 0;
-	LumpData *brushes = &lumpdata[LUMP_BRUSHES];
-	cbrushside_t *brushsides = (cbrushside_t*)lumpdata[LUMP_BRUSHSIDES].data;
-	dmaterial_t *materials = (dmaterial_t*)lumpdata[LUMP_MATERIALS].data;
-	DiskPlane *diskplanes = (DiskPlane*)lumpdata[LUMP_PLANES].data;
-	
-	for(size_t i = 0; i < brushes->count; ++i)
-	{
-		MapBrush dst = { 0 };
-
-		DiskBrush *src = &((DiskBrush*)brushes->data)[i];
-		cbrushside_t *sides = &brushsides[side_offset];
-		size_t numsides = src->numSides - 6;
-		s32 axialMaterialNum[6] = {0};
-		for(size_t axis = 0; axis < 3; axis++)
-		{
-			for(size_t sign = 0; sign < 2; sign++)
-			{
-				union f2i
-				{
-					float f;
-					int i;
-				} u;
-				u.i = brushsides[side_offset].plane;
-				axialMaterialNum[sign + axis * 2] = brushsides[side_offset].materialNum;
-				float f = u.f;
-				if(sign)
-				{
-					dst.maxs[axis] = f;
-				}
-				else
-				{
-					dst.mins[axis] = f;
-				}
-				++side_offset;
-			}
-		}
-
-		MapPlane axial_planes[6];
-		map_planes_from_aabb(dst.mins, dst.maxs, axial_planes);
-		for(size_t h = 0; h < 6; ++h)
-		{
-			MapPlane *plane = &axial_planes[h];
-			snprintf(plane->material, sizeof(plane->material), "%s", materials[axialMaterialNum[h]].material);
-			buf_push(dst.planes, *plane);
-			}
-			for(size_t k = 0; k < numsides; ++k)
-			{
-				cbrushside_t *side = &brushsides[side_offset + k];
-			DiskPlane *diskplane = &diskplanes[side->plane];
-
-			MapPlane plane = {0};
-			plane.distance = diskplane->dist;
-			snprintf(plane.material, sizeof(plane.material), "%s", materials[side->materialNum].material);
-			vec3_dup(plane.normal, diskplane->normal);
-			buf_push(dst.planes, plane);
-		}
-		buf_push(mapbrushes, dst);
-		side_offset += numsides;
-	}
-}
-
-static float mat3_determinant(mat3 m)
-{
-	return m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
-		   + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
-}
-
-static bool mat3_inverse(mat3 result, mat3 m)
-{
-	float a, b, c, d, e, f, g, h, i;
-	a = m[0][0];
-	b = m[0][1];
-	c = m[0][2];
-	d = m[1][0];
-	e = m[1][1];
-	f = m[1][2];
-	g = m[2][0];
-	h = m[2][1];
-	i = m[2][2];
-
-	float det = a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
-
-	if(det == 0.0)
-		return false;
-
-	float inv_det = 1.f / det;
-
-	result[0][0] = (e * i - f * h) * inv_det;
-	result[0][1] = (c * h - b * i) * inv_det;
-	result[0][2] = (b * f - c * e) * inv_det;
-
-	result[1][0] = (f * g - d * i) * inv_det;
-	result[1][1] = (a * i - c * g) * inv_det;
-	result[1][2] = (c * d - a * f) * inv_det;
-
-	result[2][0] = (d * h - e * g) * inv_det;
-	result[2][1] = (b * g - a * h) * inv_det;
-	result[2][2] = (a * e - b * d) * inv_det;
-	return true;
-}
-
-static void mat3_vec3_mul(vec3 result, mat3 m, vec3 v)
-{
-	result[0] = result[1] = result[2] = 0.f;
-	for(size_t i = 0; i < 3; ++i)
-	{
-		for(size_t j = 0; j < 3; ++j)
-		{
-			result[i] = result[i] + m[i][j] * v[j];
-		}
-	}
-}
-
-bool polygon_has_pt(Polygon *polygon, vec3 pt)
-{
-	for(size_t i = 0; i < buf_size(polygon->points); ++i)
-	{
-		vec3 v;
-		vec3_sub(v, pt, polygon->points[i]);
-		if(vec3_len(v) < 0.001)
-			return true;
-	}
-	return false;
-		}
-
-#define buf_set_size(v, new_size)                                                                               \
-	do                                                                                                          \
-	{                                                                                                           \
-		if(v)                                                                                                   \
-		{                                                                                                       \
-			buf_ptr((v))->size = (size_t)new_size > buf_ptr((v))->capacity ? buf_ptr((v))->capacity : new_size; \
-		}                                                                                                       \
-	} while(0)
-
-bool polygonize_brush(MapBrush *brush, Polygon **polygons_out)
-{
-	Polygon *polygons = NULL;
-	size_t plane_count = buf_size(brush->planes);
-	for(size_t i = 0; i < plane_count; ++i)
-	{
-		MapPlane *p0 = &brush->planes[i];
-		Polygon polygon = { 0 };
-		polygon.plane = p0;
-		for(size_t j = 0; j < plane_count; ++j)
-		{
-			if(j == i)
-				continue;
-			for(size_t k = 0; k < plane_count; ++k)
-			{
-				MapPlane *p1 = &brush->planes[j];
-				MapPlane *p2 = &brush->planes[k];
-
-				if(j == k || i == k)
-					continue;
-				mat3 P = {
-					{ p0->normal[0], p0->normal[1], p0->normal[2] },
-					{ p1->normal[0], p1->normal[1], p1->normal[2] },
-					{ p2->normal[0], p2->normal[1], p2->normal[2] }
-				};
-				float det = mat3_determinant(P);
-				if(det == 0.0f)
-					continue;
-				vec3 b = { p0->distance, p1->distance, p2->distance };
-				// P * v = -b
-				// v = -inverse(P) * b
-				mat3 inv_P;
-				mat3_inverse(inv_P, P);
-				vec3 v;
-				mat3_vec3_mul(v, inv_P, b);
-				bool invalid = false;
-
-				for(size_t m = 0; m < plane_count; ++m)
-				{
-					float d = vec3_mul_inner(brush->planes[m].normal, v) - brush->planes[m].distance;
-					if(d > 0.008f)
-					{
-						invalid = true;
-						break;
-					}
-				}
-				if(!invalid && !polygon_has_pt(&polygon, v))
-				{
-					buf_grow(polygon.points, 1);
-					buf_set_size(polygon.points, buf_size(polygon.points) + 1);
-					memcpy(polygon.points[buf_size(polygon.points) - 1], v, sizeof(vec3));
-				}
-			}
-		}
-
-		if(buf_size(polygon.points) >= 3)
-		{
-			buf_push(polygons, polygon);
-		}
-		else
-		{
-			buf_free(polygon.indices);
-			buf_free(polygon.points);
-		}
-	}
-	*polygons_out = polygons;
-	return true;
-}
-
-static void write_brushes(FILE *fp, dmodel_t *model, vec3 origin)
-{
-	for(size_t i = 0; i < model->numBrushes; ++i)
-			{
-		fprintf(fp, "{\n");
-		MapBrush *brush = &mapbrushes[model->firstBrush + i];
-		// for(size_t j = 0; j < buf_size(brush->planes); ++j)
-		// {
-		// 	MapPlane *plane = &brush->planes[j];
-		// 	write_plane(fp, plane->material, plane->normal, plane->distance);
-		// }
-		Polygon *polys = NULL;
-		polygonize_brush(brush, &polys);
-		for(size_t j = 0; j < buf_size(polys); ++j)
-		{
-			Polygon *poly = &polys[j];
-			MapPlane *plane = poly->plane;
-			write_plane(fp, plane->material, plane->normal, plane->distance, origin);
-			}
-		fprintf(fp, "}\n");	
-	}
-}
-
-void export_to_map(ProgramOptions *opts, const char *path)
-{
-	FILE *mapfile = NULL;
-	mapfile = fopen(path, "w");
-	if(!mapfile)
-	{
-		printf("Failed to open '%s'\n", path);
-		return;
-	}
-	printf("Exporting to '%s'\n", path);
-	Entity *worldspawn = &entities[0];
-	fprintf(mapfile, "iwmap 4\n");
-	fprintf(mapfile, "// entity 0\n{\n");
-	for(size_t i = 0; i < buf_size(worldspawn->keyvalues); ++i)
-	{
-		KeyValuePair *kvp = &worldspawn->keyvalues[i];
-		fprintf(mapfile, "\"%s\" \"%s\"\n", kvp->key, kvp->value);
-	}
-	dmodel_t *models = lumpdata[LUMP_MODELS].data;
-
-	write_brushes(mapfile, &models[0], (vec3) { 0.f, 0.f, 0.f });
-
-	if(!opts->exclude_patches)
-	{
-		write_patches(mapfile);
-	}
-	fprintf(mapfile, "}\n");
-	for(size_t i = 1; i < buf_size(entities); ++i)
-	{
-		Entity *e = &entities[i];
-		const char *classname = entity_key_by_value(e, "classname");
-		fprintf(mapfile, "// entity %d\n{\n", i);
-
-		bool has_brushes = !strcmp(classname, "script_brushmodel") || strstr(classname, "trigger_");
-		for(size_t j = 0; j < buf_size(e->keyvalues); ++j)
-		{
-			KeyValuePair *kvp = &e->keyvalues[j];
-			if(has_brushes)
-			{
-				if(!strcmp(kvp->key, "origin") || !strcmp(kvp->key, "model"))
-					continue;
-			}
-			fprintf(mapfile, "\"%s\" \"%s\"\n", kvp->key, kvp->value);
-		}
-		if(has_brushes)
-		{
-			const char *modelstr = entity_key_by_value(e, "model");
-			vec3 origin = {0};
-			const char *originstr = entity_key_by_value(e, "origin");
-			if(originstr)
-			{
-				sscanf(originstr, "%f %f %f", &origin[0], &origin[1], &origin[2]);
-			}
-			int modelidx = 0;
-			sscanf(modelstr, "*%d", &modelidx);
-			write_brushes(mapfile, &models[modelidx], origin);
-		}
-		fprintf(mapfile, "}\n");
-	}
-	fclose(mapfile);
-}
-
-void print_info(dheader_t *hdr, const char *path)
-{
-	printf("bsp.c v0.1 (c) 2024\n");
-	printf("---------------------\n");
-	printf("%s: %d\n", path, filelen);
-	
-	info(hdr, LUMP_MODELS, NULL);
-	info(hdr, LUMP_MATERIALS, NULL);
-	info(hdr, LUMP_BRUSHES, NULL);
-	info(hdr, LUMP_BRUSHSIDES, NULL);
-	info(hdr, LUMP_PLANES, NULL);
-	int entity_count = buf_size(entities);
-	info(hdr, LUMP_ENTITIES, &entity_count);
-	printf("\n");
-	info(hdr, LUMP_NODES, NULL);
-	info(hdr, LUMP_LEAFS, NULL);
-	info(hdr, LUMP_LEAFBRUSHES, NULL);
-	info(hdr, LUMP_LEAFSURFACES, NULL);
-	info(hdr, LUMP_COLLISIONVERTS, NULL);
-	info(hdr, LUMP_COLLISIONEDGES, NULL);
-	info(hdr, LUMP_COLLISIONTRIS, NULL);
-	info(hdr, LUMP_COLLISIONBORDERS, NULL);
-	info(hdr, LUMP_COLLISIONAABBS, NULL);
-	info(hdr, LUMP_DRAWVERTS, NULL);
-	info(hdr, LUMP_DRAWINDICES, NULL);
-	info(hdr, LUMP_TRIANGLES, NULL);
-	
-	info(hdr, LUMP_OBSOLETE_1, NULL);
-	info(hdr, LUMP_OBSOLETE_2, NULL);
-	info(hdr, LUMP_OBSOLETE_3, NULL);
-	info(hdr, LUMP_OBSOLETE_4, NULL);
-	info(hdr, LUMP_OBSOLETE_5, NULL);
-
-	info(hdr, LUMP_LIGHTBYTES, NULL);
-	info(hdr, LUMP_LIGHTGRIDENTRIES, NULL);
-	info(hdr, LUMP_LIGHTGRIDCOLORS, NULL);
-	// Not sure if it's stored as a lump or just parsed from entdata with classname "light"
-	size_t light_entity_count = 0;
-	for(size_t i = 0; i < buf_size(entities); ++i)
-	{
-		Entity *e = &entities[i];
-		const char *classname = entity_key_by_value(e, "classname");
-		if(!strcmp(classname, "light"))
-			++light_entity_count;
-	}
-	printf("     %d lights                   0 B      0 KB   0.0%\n", light_entity_count);
-	info(hdr, LUMP_VISIBILITY, NULL);
-	info(hdr, LUMP_PORTALVERTS, NULL);
-	info(hdr, LUMP_OCCLUDERS, NULL);
-	info(hdr, LUMP_OCCLUDERPLANES, NULL);
-	info(hdr, LUMP_OCCLUDEREDGES, NULL);
-	info(hdr, LUMP_OCCLUDERINDICES, NULL);
-	info(hdr, LUMP_AABBTREES, NULL);
-	info(hdr, LUMP_CELLS, NULL);
-	info(hdr, LUMP_PORTALS, NULL);
-	info(hdr, LUMP_CULLGROUPS, NULL);
-	info(hdr, LUMP_CULLGROUPINDICES, NULL);
-	printf("\n");
-	info(hdr, LUMP_PATHCONNECTIONS, NULL);
-	printf("---------------------\n");
-}
-
 static void print_usage()
 {
-	printf("Usage: ./bsp [options] <input_file>\n");
+	printf("Usage: ./bsp [options] <input_file>...\n");
 	printf("\n");
 	printf("Options:\n");
 	printf("  -info                 	Print information about the input file.\n");
@@ -814,24 +71,46 @@ static void print_usage()
 	printf("                        	If no export path is provided, it will write to the input file with _exported appended.\n");
 	printf("                        	Example: /path/to/your/bsp.d3dbsp will write to /path/to/your/bsp_exported.map\n");
 	printf("  -original_brush_portals 	By default portals are converted to brushes instead of using the portals that are in brushes.\n");
+	printf("  -format <format> 		What -export writes, map (default) writes a .MAP, obj writes the render geometry to a Wavefront .OBJ\n");
+	printf("                        	and mesh writes it to a binary .bspmesh, both grouped by material.\n");
 	printf("  -exclude_patches 			Don't export patches.\n");
+	printf("  -no_mmap 				Read lumps into memory instead of mapping the input file.\n");
+	printf("  -preload 				Read all lumps up front with the reads issued concurrently (io_uring on Linux).\n");
+	printf("  -cache 				Keep decoded entities and brushes in a .bspcache file next to the input for faster reloads.\n");
+	printf("  -timings 				Print time, CPU time, bytes read and memory per phase and counts per model.\n");
+	printf("  -stats <format> 		Same as -timings, format is text or json. json writes one line per input file.\n");
+	printf("  -threads <count> 		Number of threads used for reading with -preload and exporting, defaults to the number of processors.\n");
+	printf("  -float_format <format> 	fixed (default) writes six decimals, shortest writes the shortest exact decimal.\n");
+	printf("  -cells 				Print the portals, connected component and cells seen in every direction from the center of every cell.\n");
+	printf("  -points <path> 		Print the leaf, cluster, area, cell and contents of points read from a file, one \"x y z\" per line.\n");
+	printf("  -vis <path> 			Print how many clusters, leafs and entities are potentially visible from points read from a file, one \"x y z\" per line.\n");
+	printf("  -trace <path> 		Print the first collision triangle or brush hit by segments read from a file, one \"x0 y0 z0 x1 y1 z1\" per line.\n");
+	printf("  -hull <bounds> 		Sweep a box instead of a point with -trace, bounds are \"minx,miny,minz,maxx,maxy,maxz\" around the segment.\n");
+	printf("                        	Use - to read from stdin.\n");
+	printf("  -file_list <path> 		Read input files from a text file, one per line. Use - to read from stdin.\n");
 	printf("\n");
 	printf("\n");
 	printf("  -export_path <path> 	Specify the path where the export should be saved. Requires an argument.\n");
+	printf("                        	Use - to write the .MAP to stdout, messages then go to stderr.\n");
 	printf("  -help              	Display this help message and exit.\n");
 	printf("\n");
 	printf("Arguments:\n");
 	printf("  <input_file>       	The input file to be processed.\n");
+	printf("                        	Several files or directories containing .d3dbsp files can be given to process them as a batch.\n");
+	printf("                        	In a batch -export_path is the directory the exports are written to.\n");
 	printf("\n");
 	printf("Examples:\n");
 	printf("./bsp -info input_file.d3dbsp\n");
 	printf("./bsp -export -export_path /path/to/exported_file.map input_file.d3dbsp\n");
+	printf("./bsp -export -format obj /path/to/maps\n");
+	printf("./bsp -info -threads 16 /path/to/maps\n");
 	exit(0);
 }
 
 static bool parse_arguments(int argc, char **argv, ProgramOptions *opts)
 {
 	opts->try_fix_portals = true;
+	opts->thread_count = thread_hardware_concurrency();
 
     for (int i = 1; i < argc; i++)
 	{
@@ -844,9 +123,45 @@ static bool parse_arguments(int argc, char **argv, ProgramOptions *opts)
 				} else if(!strcmp(argv[i], "-help") || !strcmp(argv[i], "-?") || !strcmp(argv[i], "-usage"))
 				{
 					print_usage();
+				} else if (!strcmp(argv[i], "-cells"))
+				{
+					opts->print_cells = true;
 				} else if (!strcmp(argv[i], "-exclude_patches"))
 				{
 					opts->exclude_patches = true;
+				} else if (!strcmp(argv[i], "-no_mmap"))
+				{
+					opts->no_mmap = true;
+				} else if (!strcmp(argv[i], "-preload"))
+				{
+					opts->preload = true;
+				} else if (!strcmp(argv[i], "-cache"))
+				{
+					opts->cache = true;
+				} else if (!strcmp(argv[i], "-timings"))
+				{
+					opts->print_stats = true;
+					opts->stats_format = BSP_STATS_TEXT;
+				} else if (!strcmp(argv[i], "-stats"))
+				{
+					if (i + 1 < argc)
+					{
+						++i;
+						if (!strcmp(argv[i], "text"))
+						{
+							opts->stats_format = BSP_STATS_TEXT;
+						} else if (!strcmp(argv[i], "json"))
+						{
+							opts->stats_format = BSP_STATS_JSON;
+						} else {
+							fprintf(stderr, "Error: unknown stats format '%s'.\n", argv[i]);
+							return false;
+						}
+						opts->print_stats = true;
+					} else {
+						fprintf(stderr, "Error: -stats requires a argument.\n");
+						return false;
+					}
 				} else if (!strcmp(argv[i], "-original_brush_portals"))
 				{
 					opts->try_fix_portals = false;
@@ -862,11 +177,104 @@ static bool parse_arguments(int argc, char **argv, ProgramOptions *opts)
 						fprintf(stderr, "Error: -export_path requires a argument.\n");
 						return false;
 					}
+				} else if (!strcmp(argv[i], "-threads"))
+				{
+					if (i + 1 < argc)
+					{
+						int n = atoi(argv[++i]);
+						opts->thread_count = n > 0 ? n : 1;
+					} else {
+						fprintf(stderr, "Error: -threads requires a argument.\n");
+						return false;
+					}
+				} else if (!strcmp(argv[i], "-float_format"))
+				{
+					if (i + 1 < argc)
+					{
+						++i;
+						if (!strcmp(argv[i], "fixed"))
+						{
+							opts->float_format = WRITER_FLOAT_FIXED;
+						} else if (!strcmp(argv[i], "shortest"))
+						{
+							opts->float_format = WRITER_FLOAT_SHORTEST;
+						} else {
+							fprintf(stderr, "Error: unknown float format '%s'.\n", argv[i]);
+							return false;
+						}
+					} else {
+						fprintf(stderr, "Error: -float_format requires a argument.\n");
+						return false;
+					}
+				} else if (!strcmp(argv[i], "-points"))
+				{
+					if (i + 1 < argc)
+					{
+						opts->points_file = argv[++i];
+					} else {
+						fprintf(stderr, "Error: -points requires a argument.\n");
+						return false;
+					}
+				} else if (!strcmp(argv[i], "-trace"))
+				{
+					if (i + 1 < argc)
+					{
+						opts->trace_file = argv[++i];
+					} else {
+						fprintf(stderr, "Error: -trace requires a argument.\n");
+						return false;
+					}
+				} else if (!strcmp(argv[i], "-vis"))
+				{
+					if (i + 1 < argc)
+					{
+						opts->vis_file = argv[++i];
+					} else {
+						fprintf(stderr, "Error: -vis requires a argument.\n");
+						return false;
+					}
+				} else if (!strcmp(argv[i], "-hull"))
+				{
+					if (i + 1 < argc)
+					{
+						++i;
+						float *m = opts->hull_mins, *x = opts->hull_maxs;
+						if (sscanf(argv[i], "%f,%f,%f,%f,%f,%f", &m[0], &m[1], &m[2], &x[0], &x[1], &x[2]) != 6)
+						{
+							fprintf(stderr, "Error: -hull expects six comma separated numbers.\n");
+							return false;
+						}
+					} else {
+						fprintf(stderr, "Error: -hull requires a argument.\n");
+						return false;
+					}
+				} else if (!strcmp(argv[i], "-file_list"))
+				{
+					if (i + 1 < argc)
+					{
+						opts->file_list = argv[++i];
+					} else {
+						fprintf(stderr, "Error: -file_list requires a argument.\n");
+						return false;
+					}
 				} else if (!strcmp(argv[i], "-format"))
 				{
 					if (i + 1 < argc)
 					{
-						opts->format = argv[++i];
+						++i;
+						if (!strcmp(argv[i], "map"))
+						{
+							opts->export_format = EXPORT_MAP;
+						} else if (!strcmp(argv[i], "obj"))
+						{
+							opts->export_format = EXPORT_OBJ;
+						} else if (!strcmp(argv[i], "mesh"))
+						{
+							opts->export_format = EXPORT_MESH;
+						} else {
+							fprintf(stderr, "Error: unknown format '%s'.\n", argv[i]);
+							return false;
+						}
 					} else {
 						fprintf(stderr, "Error: -format requires a argument.\n");
 						return false;
@@ -878,8 +286,7 @@ static bool parse_arguments(int argc, char **argv, ProgramOptions *opts)
 			break;
 
 			default:
-				// printf("%s\n", argv[i]);
-				opts->input_file = argv[i];
+				buf_push(opts->input_files, argv[i]);
 			break;
 		}
     }
@@ -905,7 +312,7 @@ static void pathinfo(const char *path,
 		++it;
 	}
 	directory[0] = 0;
-	snprintf(directory, directory_max_length, "%.*s", offset, path);
+	snprintf(directory, directory_max_length, "%.*s", (int)offset, path);
 	const char *filename = path + offset;
 	
 	if(*filename == '/' || *filename == '\\')
@@ -919,84 +326,489 @@ static void pathinfo(const char *path,
 		snprintf(basename, basename_max_length, "%s", filename);
 	} else
 	{
-		snprintf(basename, basename_max_length, "%.*s", delim - filename, filename);
+		snprintf(basename, basename_max_length, "%.*s", (int)(delim - filename), filename);
 		snprintf(extension, extension_max_length, "%s", delim + 1);
 	}
 }
 
-int main(int argc, char **argv)
+static bool is_directory(const char *path)
 {
-	ProgramOptions opts = {0};
-	if(!parse_arguments(argc, argv, &opts))
+#ifdef _WIN32
+	DWORD attributes = GetFileAttributesA(path);
+	return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+static bool has_bsp_extension(const char *filename)
+{
+	const char *ext = strrchr(filename, '.');
+	if(!ext)
+		return false;
+	const char *expected = ".d3dbsp";
+	for(; *ext && *expected; ++ext, ++expected)
 	{
+		char ch = *ext >= 'A' && *ext <= 'Z' ? *ext - 'A' + 'a' : *ext;
+		if(ch != *expected)
+			return false;
+	}
+	return !*ext && !*expected;
+}
+
+static void add_input_file(char ***files, const char *path)
+{
+	buf_push(*files, strdup(path));
+}
+
+static void add_directory(char ***files, const char *directory)
+{
+	char path[1024];
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	snprintf(path, sizeof(path), "%s\\*", directory);
+	HANDLE h = FindFirstFileA(path, &fd);
+	if(h == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		if(!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && has_bsp_extension(fd.cFileName))
+		{
+			snprintf(path, sizeof(path), "%s\\%s", directory, fd.cFileName);
+			add_input_file(files, path);
+		}
+	} while(FindNextFileA(h, &fd));
+	FindClose(h);
+#else
+	DIR *dir = opendir(directory);
+	if(!dir)
+		return;
+	struct dirent *de;
+	while((de = readdir(dir)))
+	{
+		if(!has_bsp_extension(de->d_name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", directory, de->d_name);
+		if(!is_directory(path))
+			add_input_file(files, path);
+	}
+	closedir(dir);
+#endif
+}
+
+// Text inputs are read through a buffered window, path is a file or - for stdin.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int open_lines(const char *path, Stream *file, StreamBuffered *lines)
+{
+	if(!strcmp(path, "-"))
+		stream_init_file(file, stdin, "stdin");
+	else if(stream_open_file(file, path, "r"))
+	{
+		fprintf(stderr, "Failed to open '%s'\n", path);
+		return 1;
+	}
+	if(stream_buffered_init(lines, file, 0))
+	{
+		stream_close_file(file);
 		return 1;
 	}
+	return 0;
+}
 
-	TEST(dmodel_t, 48);
+static void close_lines(Stream *file, StreamBuffered *lines)
+{
+	stream_buffered_free(lines);
+	stream_close_file(file);
+}
 
-	Stream s = {0};
-	assert(0 == stream_open_file(&s, opts.input_file, "rb"));
+static void add_file_list(char ***files, const char *list)
+{
+	Stream file;
+	StreamBuffered lines;
+	if(open_lines(list, &file, &lines))
+		return;
+	char line[1024];
+	while(stream_buffered_read_line(&lines, line, sizeof(line)))
+	{
+		size_t n = strlen(line);
+		while(n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r' || line[n - 1] == ' '))
+			line[--n] = 0;
+		if(n > 0)
+			add_input_file(files, line);
+	}
+	close_lines(&file, &lines);
+}
 
-	s.seek(&s, 0, SEEK_END);
-	filelen = s.tell(&s);
-	s.seek(&s, 0, SEEK_SET);
+// Reads n numbers per line, lines that don't start with n numbers are skipped, so comments can be used.
+static bool read_rows(const char *path, size_t n, float **values)
+{
+	Stream file;
+	StreamBuffered lines;
+	if(open_lines(path, &file, &lines))
+		return false;
+	char line[1024];
+	float row[6];
+	while(stream_buffered_read_line(&lines, line, sizeof(line)))
+	{
+		char *s = line;
+		char *end;
+		size_t k = 0;
+		for(; k < n; ++k)
+		{
+			row[k] = strtof(s, &end);
+			if(end == s)
+				break;
+			s = end;
+		}
+		if(k == n)
+		{
+			for(k = 0; k < n; ++k)
+				buf_push(*values, row[k]);
+		}
+	}
+	close_lines(&file, &lines);
+	return true;
+}
 
-	dheader_t hdr = { 0 };
-	stream_read(s, hdr);
-	
-	if(memcmp(hdr.ident, "IBSP", 4))
+static void write_points(Writer *w, BspMap *map, const float *points, size_t thread_count)
+{
+	size_t count = buf_size(points) / 3;
+	BspPointResult *results = malloc((count + 1) * sizeof(BspPointResult));
+	bsp_point_query(map, (const vec3 *)points, count, BSP_POINT_CONTENTS, thread_count, results);
+	writer_string(w, "// x y z leaf cluster area cell brush contents\n");
+	for(size_t i = 0; i < count; ++i)
 	{
-		fprintf(stderr, "Magic mismatch");
-		exit(1);
+		BspPointResult *r = &results[i];
+		for(int k = 0; k < 3; ++k)
+		{
+			writer_float(w, points[i * 3 + k]);
+			writer_string(w, " ");
+		}
+		s64 values[] = { r->leaf, r->cluster, r->area, r->cell, r->brush, r->contents };
+		for(size_t k = 0; k < 6; ++k)
+		{
+			writer_int(w, values[k]);
+			writer_string(w, k == 5 ? "\n" : " ");
+		}
 	}
-	if(hdr.version != 4)
+	free(results);
+}
+
+static void write_cells(Writer *w, BspMap *map, size_t thread_count)
+{
+	const BspCellGraph *graph = bsp_cell_graph(map);
+	size_t count;
+	const DiskGfxCell *cells = bsp_cells(map, &count);
+	s32 *components = malloc((count + 1) * sizeof(s32));
+	u32 component_count = bsp_cell_components(map, components);
+	u32 *sizes = calloc(component_count + 1, sizeof(u32));
+	u32 largest = 0;
+	for(size_t i = 0; i < count; ++i)
 	{
-		fprintf(stderr, "Version mismatch");
-		exit(1);
+		if(++sizes[components[i]] > largest)
+			largest = sizes[components[i]];
 	}
-	for(size_t i = 0; i < LUMP_MAX; ++i)
+	BspView *views = malloc((count + 1) * sizeof(BspView));
+	u32 *seen = malloc((count + 1) * sizeof(u32));
+	for(size_t i = 0; i < count; ++i)
 	{
-		lump_t *l = &hdr.lumps[i];
-		if(l->filelen != 0 && lumpsizes[i] != 0)
+		memset(&views[i], 0, sizeof(BspView));
+		for(int k = 0; k < 3; ++k)
+			views[i].origin[k] = (cells[i].mins[k] + cells[i].maxs[k]) * 0.5f;
+		views[i].cell = (s32)i;
+	}
+	bsp_view_cells(map, views, count, thread_count, seen, NULL);
+
+	writer_string(w, "// ");
+	writer_int(w, count);
+	writer_string(w, " cells, ");
+	writer_int(w, graph->edge_count);
+	writer_string(w, " portals, ");
+	writer_int(w, component_count);
+	writer_string(w, " components, the largest has ");
+	writer_int(w, largest);
+	writer_string(w, " cells\n// cell portals component seen\n");
+	for(size_t i = 0; i < count; ++i)
+	{
+		s64 values[] = { (s64)i, graph->offsets[i + 1] - graph->offsets[i], components[i], seen[i] };
+		for(size_t k = 0; k < 4; ++k)
 		{
-			LumpData *ld = &lumpdata[i];
-			assert(l->filelen % lumpsizes[i] == 0);
-			ld->count = l->filelen / lumpsizes[i];
-			ld->data = calloc(ld->count, lumpsizes[i]);
-			s.seek(&s, l->fileofs, SEEK_SET);
-			s.read(&s, ld->data, lumpsizes[i], ld->count);
+			writer_int(w, values[k]);
+			writer_string(w, k == 3 ? "\n" : " ");
 		}
 	}
-	
-	Entity *parse_entities();
-	entities = parse_entities();
-	
-	load_map_brushes();
+	free(seen);
+	free(views);
+	free(sizes);
+	free(components);
+}
+
+static void write_visibility(Writer *w, BspMap *map, const float *points, size_t thread_count)
+{
+	size_t count = buf_size(points) / 3;
+	BspVisResult *results = malloc((count + 1) * sizeof(BspVisResult));
+	bsp_point_visibility(map, (const vec3 *)points, count, thread_count, results, NULL, NULL);
+	writer_string(w, "// x y z cluster clusters leafs entities\n");
+	for(size_t i = 0; i < count; ++i)
+	{
+		BspVisResult *r = &results[i];
+		for(int k = 0; k < 3; ++k)
+		{
+			writer_float(w, points[i * 3 + k]);
+			writer_string(w, " ");
+		}
+		s64 values[] = { r->cluster, r->clusters, r->leafs, r->entities };
+		for(size_t k = 0; k < 4; ++k)
+		{
+			writer_int(w, values[k]);
+			writer_string(w, k == 3 ? "\n" : " ");
+		}
+	}
+	free(results);
+}
+
+static void write_traces(Writer *w, BspMap *map, const float *rays, const ProgramOptions *opts, size_t thread_count)
+{
+	size_t count = buf_size(rays) / 6;
+	BspTraceResult *results = malloc((count + 1) * sizeof(BspTraceResult));
+	bsp_trace_box(map, (const BspRay *)rays, count, opts->hull_mins, opts->hull_maxs, BSP_TRACE_TRIANGLES | BSP_TRACE_BRUSHES, thread_count, results);
+	writer_string(w, "// x0 y0 z0 x1 y1 z1 fraction nx ny nz triangle brush material start_solid\n");
+	for(size_t i = 0; i < count; ++i)
+	{
+		BspTraceResult *r = &results[i];
+		for(int k = 0; k < 6; ++k)
+		{
+			writer_float(w, rays[i * 6 + k]);
+			writer_string(w, " ");
+		}
+		writer_float(w, r->fraction);
+		for(int k = 0; k < 3; ++k)
+		{
+			writer_string(w, " ");
+			writer_float(w, r->normal[k]);
+		}
+		s64 values[] = { r->triangle, r->brush, r->material, r->start_solid };
+		for(size_t k = 0; k < 4; ++k)
+		{
+			writer_string(w, " ");
+			writer_int(w, values[k]);
+		}
+		writer_string(w, "\n");
+	}
+	free(results);
+}
 
-	if(opts.print_info)
-		print_info(&hdr, opts.input_file);
+static void export_path_for(ProgramOptions *opts, const char *input_file, bool batch, char *output_file, size_t size)
+{
+	char directory[256] = {0};
+	char basename[256] = {0};
+	char extension[256] = {0};
+	char sep = 0;
+	pathinfo(input_file,
+			 directory,
+			 sizeof(directory),
+			 basename,
+			 sizeof(basename),
+			 extension,
+			 sizeof(extension),
+			 &sep);
+
+	const char *ext = export_extensions[opts->export_format];
+	if(opts->export_file && !batch)
+		snprintf(output_file, size, "%s", opts->export_file);
+	else if(opts->export_file)
+		snprintf(output_file, size, "%s%c%s_exported.%s", opts->export_file, sep ? sep : '/', basename, ext);
+	else if(sep)
+		snprintf(output_file, size, "%s%c%s_exported.%s", directory, sep, basename, ext);
+	else
+		snprintf(output_file, size, "%s_exported.%s", basename, ext);
+}
+
+typedef struct
+{
+	ProgramOptions *opts;
+	char **files;
+	float *points; // x y z
+	float *rays; // x0 y0 z0 x1 y1 z1
+	float *vis_points; // x y z
+	bool batch;
+	bool export_to_stdout;
+	Stream stdout_stream;
+	Stream stderr_stream;
+	size_t map_thread_count; // threads each map may use for reading and exporting
+	size_t failed;
+	Mutex mutex;
+} Batch;
+
+static void process_file(void *ctx, size_t index)
+{
+	Batch *batch = ctx;
+	ProgramOptions *opts = batch->opts;
+	const char *path = batch->files[index];
+
+	// A single map reports straight to stdout, in a batch the output of each map is kept together.
+	Writer log;
+	Stream *log_stream = batch->export_to_stdout ? &batch->stderr_stream : &batch->stdout_stream;
+	writer_init(&log, batch->batch ? NULL : log_stream, WRITER_FLOAT_FIXED);
+
+	double start = timer_now();
+	char error[512] = {0}; // room for a message around an output path
+	int flags = (opts->no_mmap ? BSP_OPEN_NO_MMAP : 0) | (opts->preload ? BSP_OPEN_PRELOAD : 0) | (opts->cache ? BSP_OPEN_CACHE : 0);
+	BspMap *map = bsp_open_file(path, flags, batch->map_thread_count, error, sizeof(error));
+	int status = map ? 0 : 1;
+	if(map)
+	{
+		if(opts->print_info)
+			bsp_print_info(map, &log);
+
+		if(opts->points_file)
+			write_points(&log, map, batch->points, batch->map_thread_count);
+
+		if(opts->print_cells)
+			write_cells(&log, map, batch->map_thread_count);
+
+		if(opts->vis_file)
+			write_visibility(&log, map, batch->vis_points, batch->map_thread_count);
+
+		if(opts->trace_file)
+			write_traces(&log, map, batch->rays, opts, batch->map_thread_count);
+
+		if(opts->export_to_map)
+		{
+			char output_file[256] = {0};
+			export_path_for(opts, path, batch->batch, output_file, sizeof(output_file));
+			BspExportOptions export_opts = {
+				.exclude_patches = opts->exclude_patches,
+				.original_brush_portals = !opts->try_fix_portals,
+				.float_format = opts->float_format,
+				.thread_count = batch->map_thread_count
+			};
+			BspMeshOptions mesh_opts = {
+				.format = opts->export_format == EXPORT_MESH ? BSP_MESH_BINARY : BSP_MESH_OBJ,
+				.float_format = opts->float_format
+			};
+			if(batch->export_to_stdout)
+			{
+				snprintf(output_file, sizeof(output_file), "stdout");
+				writer_flush(&log);
+				if(opts->export_format == EXPORT_MAP)
+					status = bsp_export_map_stream(map, &batch->stdout_stream, &export_opts, &log);
+				else
+					status = bsp_export_mesh_stream(map, &batch->stdout_stream, &mesh_opts, &log);
+				if(fflush(stdout))
+					status = 1;
+			}
+			else if(opts->export_format == EXPORT_MAP)
+			{
+				status = bsp_export_map(map, output_file, &export_opts, &log);
+			}
+			else
+			{
+				status = bsp_export_mesh(map, output_file, &mesh_opts, &log);
+			}
+			if(status)
+				snprintf(error, sizeof(error), "Failed to export to '%s'", output_file);
+		}
+		if(opts->print_stats)
+			bsp_print_stats(map, &log, opts->stats_format);
+	}
+	double elapsed = timer_now() - start;
 
-	if(opts.export_to_map)
+	mutex_lock(&batch->mutex);
+	writer_flush(&log);
+	if(batch->batch)
 	{
-		char directory[256] = {0};
-		char basename[256] = {0};
-		char extension[256] = {0};
-		char sep = 0;
-		pathinfo(opts.input_file,
-				 directory,
-				 sizeof(directory),
-				 basename,
-				 sizeof(basename),
-				 extension,
-				 sizeof(extension),
-				 &sep);
-				 
-		char output_file[256] = {0};
-		snprintf(output_file, sizeof(output_file), "%s%c%s_exported.map", directory, sep, basename);
-		if(opts.export_file)
-			export_to_map(&opts, opts.export_file);
+		fwrite(log.data, 1, buf_size(log.data), stdout);
+		if(status)
+			printf("[failed] %s: %s (%.1f ms)\n", path, error, elapsed * 1000.0);
 		else
-			export_to_map(&opts, output_file);
+			printf("[ok] %s (%.1f ms)\n", path, elapsed * 1000.0);
+		fflush(stdout);
 	}
-	return 0;
+	else if(status)
+	{
+		fprintf(stderr, "%s\n", error);
+	}
+	if(status)
+		++batch->failed;
+	mutex_unlock(&batch->mutex);
+
+	writer_free(&log);
+	bsp_close(map);
+}
+
+int main(int argc, char **argv)
+{
+	ProgramOptions opts = {0};
+	if(!parse_arguments(argc, argv, &opts))
+	{
+		return 1;
+	}
+
+	TEST(dmodel_t, 48);
+
+	char **files = NULL;
+	bool batch = opts.file_list != NULL || buf_size(opts.input_files) > 1;
+	for(size_t i = 0; i < buf_size(opts.input_files); ++i)
+	{
+		if(is_directory(opts.input_files[i]))
+		{
+			add_directory(&files, opts.input_files[i]);
+			batch = true;
+		}
+		else
+		{
+			add_input_file(&files, opts.input_files[i]);
+		}
+	}
+	if(opts.file_list)
+		add_file_list(&files, opts.file_list);
+	if(buf_size(files) == 0)
+	{
+		fprintf(stderr, "No input files.\n");
+		return 1;
+	}
+
+	Batch b = { .opts = &opts, .files = files, .batch = batch };
+	if(opts.points_file && !read_rows(opts.points_file, 3, &b.points))
+		return 1;
+	if(opts.trace_file && !read_rows(opts.trace_file, 6, &b.rays))
+		return 1;
+	if(opts.vis_file && !read_rows(opts.vis_file, 3, &b.vis_points))
+		return 1;
+	b.export_to_stdout = opts.export_to_map && opts.export_file && !strcmp(opts.export_file, "-");
+	if(b.export_to_stdout && batch)
+	{
+		fprintf(stderr, "-export_path - can only be used with a single input file.\n");
+		return 1;
+	}
+	stream_init_file(&b.stdout_stream, stdout, "stdout");
+	stream_init_file(&b.stderr_stream, stderr, "stderr");
+	mutex_init(&b.mutex);
+
+	// Maps are processed in parallel first, whatever is left over goes to exporting within a map.
+	size_t file_thread_count = opts.thread_count < buf_size(files) ? opts.thread_count : buf_size(files);
+	b.map_thread_count = opts.thread_count / file_thread_count;
+	if(b.map_thread_count < 1)
+		b.map_thread_count = 1;
+
+	double start = timer_now();
+	parallel_for(buf_size(files), file_thread_count, process_file, &b);
+	if(batch)
+	{
+		printf("%d files, %d failed, %.1f ms\n", (int)buf_size(files), (int)b.failed, (timer_now() - start) * 1000.0);
+	}
+	mutex_destroy(&b.mutex);
+	stream_close_file(&b.stdout_stream);
+	stream_close_file(&b.stderr_stream);
+
+	for(size_t i = 0; i < buf_size(files); ++i)
+		free(files[i]);
+	buf_free(files);
+	buf_free(b.points);
+	buf_free(b.rays);
+	buf_free(b.vis_points);
+	buf_free(opts.input_files);
+	return b.failed ? 1 : 0;
 }
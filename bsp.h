@@ -0,0 +1,309 @@
+#pragma once
+#include "type.h"
+#include "lump.h"
+#include "stream.h"
+#include "entity_parser.h"
+#include "writer.h"
+
+#if defined(_WIN32) && defined(BSP_SHARED)
+#ifdef BSP_BUILDING
+#define BSP_API __declspec(dllexport)
+#else
+#define BSP_API __declspec(dllimport)
+#endif
+#else
+#define BSP_API
+#endif
+
+// A loaded .d3dbsp. Maps share no state, so different maps can be used from different threads,
+// but a single map must not be used from several threads at once.
+typedef struct BspMap BspMap;
+
+enum
+{
+	BSP_OPEN_NO_MMAP = 1, // read lumps into memory instead of mapping the file
+	BSP_OPEN_PRELOAD = 2, // read every lump while opening with all reads in flight at once, uses io_uring when available
+	BSP_OPEN_CACHE = 4 // load entities and brushes from path.bspcache, the cache is (re)written when it is missing or stale
+};
+
+// The open functions return NULL on failure and write the reason to error.
+// thread_count bounds the threads reading lumps for BSP_OPEN_PRELOAD when io_uring isn't available,
+// 0 or 1 reads on the calling thread.
+BSP_API BspMap *bsp_open_file(const char *path, int flags, size_t thread_count, char *error, size_t error_size);
+// data is not copied and has to stay valid until the map is closed.
+BSP_API BspMap *bsp_open_memory(const void *data, size_t size, char *error, size_t error_size);
+// The stream is read as lumps are requested and has to stay open until the map is closed.
+BSP_API BspMap *bsp_open_stream(Stream *stream, char *error, size_t error_size);
+BSP_API void bsp_close(BspMap *map);
+
+BSP_API const char *bsp_path(BspMap *map);
+BSP_API s64 bsp_file_size(BspMap *map);
+BSP_API const dheader_t *bsp_header(BspMap *map);
+
+// Returns the elements of a lump, count is set to the number of elements.
+BSP_API const void *bsp_lump(BspMap *map, int type, size_t *count);
+
+#define BSP_LUMP_ACCESSOR(name, type, lump)                   \
+	static inline const type *bsp_##name(BspMap *map, size_t *count) \
+	{                                                         \
+		return (const type *)bsp_lump(map, lump, count);      \
+	}
+
+BSP_LUMP_ACCESSOR(materials, dmaterial_t, LUMP_MATERIALS)
+BSP_LUMP_ACCESSOR(planes, DiskPlane, LUMP_PLANES)
+BSP_LUMP_ACCESSOR(brushsides, cbrushside_t, LUMP_BRUSHSIDES)
+BSP_LUMP_ACCESSOR(brushes, DiskBrush, LUMP_BRUSHES)
+BSP_LUMP_ACCESSOR(triangle_soups, DiskTriangleSoup, LUMP_TRIANGLES)
+BSP_LUMP_ACCESSOR(draw_vertices, DiskGfxVertex, LUMP_DRAWVERTS)
+BSP_LUMP_ACCESSOR(draw_indices, u16, LUMP_DRAWINDICES)
+BSP_LUMP_ACCESSOR(cull_groups, DiskGfxCullGroup, LUMP_CULLGROUPS)
+BSP_LUMP_ACCESSOR(portal_vertices, DiskGfxPortalVertex, LUMP_PORTALVERTS)
+BSP_LUMP_ACCESSOR(aabb_trees, DiskGfxAabbTree, LUMP_AABBTREES)
+BSP_LUMP_ACCESSOR(cells, DiskGfxCell, LUMP_CELLS)
+BSP_LUMP_ACCESSOR(portals, DiskGfxPortal, LUMP_PORTALS)
+BSP_LUMP_ACCESSOR(nodes, dnode_t, LUMP_NODES)
+BSP_LUMP_ACCESSOR(leafs, dleaf_t, LUMP_LEAFS)
+BSP_LUMP_ACCESSOR(leaf_brushes, dleafbrush_t, LUMP_LEAFBRUSHES)
+BSP_LUMP_ACCESSOR(leaf_surfaces, dleafface_t, LUMP_LEAFSURFACES)
+BSP_LUMP_ACCESSOR(collision_vertices, DiskCollisionVertex, LUMP_COLLISIONVERTS)
+BSP_LUMP_ACCESSOR(collision_edges, DiskCollisionEdge, LUMP_COLLISIONEDGES)
+BSP_LUMP_ACCESSOR(collision_triangles, DiskCollisionTriangle, LUMP_COLLISIONTRIS)
+BSP_LUMP_ACCESSOR(collision_borders, DiskCollisionBorder, LUMP_COLLISIONBORDERS)
+BSP_LUMP_ACCESSOR(collision_partitions, DiskCollisionPartition, LUMP_COLLISIONPARTITIONS)
+BSP_LUMP_ACCESSOR(collision_aabbs, DiskCollisionAabbTree, LUMP_COLLISIONAABBS)
+BSP_LUMP_ACCESSOR(models, dmodel_t, LUMP_MODELS)
+BSP_LUMP_ACCESSOR(visibility, u8, LUMP_VISIBILITY)
+
+BSP_API size_t bsp_entity_count(BspMap *map);
+BSP_API Entity *bsp_entity(BspMap *map, size_t index);
+// Return the indices of the entities with the given classname or targetname in file order,
+// count is set to the number of entities.
+BSP_API const u32 *bsp_entities_by_classname(BspMap *map, const char *classname, size_t *count);
+BSP_API const u32 *bsp_entities_by_targetname(BspMap *map, const char *targetname, size_t *count);
+
+typedef struct
+{
+	bool exclude_patches;
+	bool original_brush_portals; // keep the portal brushes instead of writing the portals of the portal lump as brushes
+	int float_format; // WRITER_FLOAT_*
+	size_t thread_count; // threads used for formatting brushes, 0 or 1 formats on the calling thread
+} BspExportOptions;
+
+// Progress and errors are written to log, which may be NULL.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+BSP_API int bsp_export_map(BspMap *map, const char *path, const BspExportOptions *opts, Writer *log);
+// Same as bsp_export_map but writes the .map to any writable stream, e.g. one from stream_open_memory.
+BSP_API int bsp_export_map_stream(BspMap *map, Stream *out, const BspExportOptions *opts, Writer *log);
+
+BSP_API void bsp_print_info(BspMap *map, Writer *log);
+
+enum
+{
+	BSP_MESH_OBJ, // Wavefront OBJ with positions, normals and texture coordinates
+	BSP_MESH_BINARY // BspMeshHeader followed by the groups, the vertices and the indices
+};
+
+#define BSP_MESH_VERSION 1
+
+typedef struct
+{
+	int format; // BSP_MESH_*
+	int float_format; // WRITER_FLOAT_*, only used by OBJ
+} BspMeshOptions;
+
+#pragma pack(push, 1)
+
+// Little endian, the indices are u32 into the vertices with three per triangle.
+typedef struct
+{
+	char ident[4]; // BSPM
+	u32 version;
+	u32 group_count;
+	u32 vertex_count;
+	u32 index_count;
+} BspMeshHeader;
+
+// The soups of one material.
+typedef struct
+{
+	char material[64];
+	u32 first_vertex;
+	u32 vertex_count;
+	u32 first_index;
+	u32 index_count;
+} BspMeshGroup;
+
+typedef struct
+{
+	vec3 xyz;
+	vec3 normal;
+	vec2 uv;
+	vec2 lightmap_uv;
+} BspMeshVertex;
+
+#pragma pack(pop)
+
+// Writes the render geometry of LUMP_TRIANGLES, LUMP_DRAWVERTS and LUMP_DRAWINDICES with a group per material.
+// Soups are written one at a time, a map that isn't in memory only reads the vertices and indices of the current soup.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+BSP_API int bsp_export_mesh(BspMap *map, const char *path, const BspMeshOptions *opts, Writer *log);
+BSP_API int bsp_export_mesh_stream(BspMap *map, Stream *out, const BspMeshOptions *opts, Writer *log);
+
+typedef struct
+{
+	s32 leaf; // -1 when the map has no node tree
+	s32 cluster;
+	s32 area;
+	s32 cell;
+	s32 brush; // first brush of the leaf that contains the point or -1, only set with BSP_POINT_CONTENTS
+	u32 contents; // contentFlags of every brush of the leaf that contains the point, only set with BSP_POINT_CONTENTS
+} BspPointResult;
+
+enum
+{
+	BSP_POINT_CONTENTS = 1 // test the point against the brushes of its leaf
+};
+
+// Finds the leaf of every point by walking the node tree, results has room for count entries.
+// Large batches are split over up to thread_count threads.
+BSP_API void bsp_point_query(BspMap *map, const vec3 *points, size_t count, int flags, size_t thread_count, BspPointResult *results);
+
+typedef struct
+{
+	vec3 start, end;
+} BspRay;
+
+typedef struct
+{
+	float fraction; // along the segment, 1 when nothing was hit
+	vec3 normal; // facing the start of the segment
+	s32 triangle; // into LUMP_COLLISIONTRIS, or -1
+	s32 brush; // into LUMP_BRUSHES, or -1
+	s32 material; // into LUMP_MATERIALS, or -1
+	bool start_solid; // the segment starts inside a brush
+} BspTraceResult;
+
+enum
+{
+	BSP_TRACE_TRIANGLES = 1, // collision triangles through the collision AABB tree
+	BSP_TRACE_BRUSHES = 2 // brushes through the node tree
+};
+
+// Finds the first hit along every segment, results has room for count entries.
+// Large batches are split over up to thread_count threads.
+BSP_API void bsp_trace(BspMap *map, const BspRay *rays, size_t count, int flags, size_t thread_count, BspTraceResult *results);
+
+// Same as bsp_trace for a box mins..maxs around each segment, such as a player hull.
+// Brush planes are pushed out by the box, triangles are tested with separating axes.
+BSP_API void bsp_trace_box(BspMap *map, const BspRay *rays, size_t count, const vec3 mins, const vec3 maxs, int flags, size_t thread_count, BspTraceResult *results);
+
+typedef struct
+{
+	s32 cluster; // of the point, -1 outside the map
+	u32 clusters; // potentially visible clusters
+	u32 leafs; // potentially visible leafs
+	u32 entities; // potentially visible entities, an entity is placed by its origin
+} BspVisResult;
+
+typedef struct
+{
+	s32 from, to;
+} BspClusterPair;
+
+// Number of clusters in the visibility lump, 0 when the map has none and every cluster sees every other one.
+BSP_API s32 bsp_cluster_count(BspMap *map);
+// Sets visible[i] when cluster pairs[i].from can potentially see pairs[i].to.
+BSP_API void bsp_cluster_visibility(BspMap *map, const BspClusterPair *pairs, size_t count, size_t thread_count, u8 *visible);
+// Finds what is potentially visible from every point, results has room for count entries.
+// leaf_bits and entity_bits may be NULL, otherwise they receive a row of (n + 63) / 64 words per point
+// for the n leafs or entities, with bit i set when leaf or entity i is visible.
+BSP_API void bsp_point_visibility(BspMap *map, const vec3 *points, size_t count, size_t thread_count, BspVisResult *results, u64 *leaf_bits, u64 *entity_bits);
+
+// Cells joined by their portals in compressed sparse row form, the edges of cell i are offsets[i] up to offsets[i + 1].
+typedef struct
+{
+	u32 cell_count;
+	u32 edge_count;
+	u32 *offsets;
+	u32 *targets; // the cell on the other side of the portal
+	u32 *portals; // into LUMP_PORTALS
+} BspCellGraph;
+
+// Built on first use, portals that point outside the lumps or have fewer than three vertices are left out.
+BSP_API const BspCellGraph *bsp_cell_graph(BspMap *map);
+// Floods from all starts at once, distances receives the number of portals to the nearest start for every cell,
+// or -1 when it can't be reached within max_depth portals. A max_depth of 0 has no limit.
+BSP_API void bsp_cell_flood(BspMap *map, const s32 *starts, size_t start_count, u32 max_depth, s32 *distances);
+// Floods from every start on its own, reached[i] receives the number of cells reachable from starts[i].
+BSP_API void bsp_cell_reach(BspMap *map, const s32 *starts, size_t count, u32 max_depth, size_t thread_count, u32 *reached);
+// Labels every cell with its connected component and returns the number of components.
+BSP_API u32 bsp_cell_components(BspMap *map, s32 *components);
+
+typedef struct
+{
+	vec3 origin;
+	vec3 forward;
+	float fov_x, fov_y; // degrees, 0 sees in every direction
+	s32 cell; // the cell the origin is in, -1 to look it up through the node tree
+} BspView;
+
+// Walks from the cell of every view through the portals inside its frustum, narrowing the frustum to each portal
+// it passes. cell_counts receives the number of cells seen, cell_bits may be NULL or receives a row of
+// (cell_count + 63) / 64 words per view with bit i set when cell i is seen.
+BSP_API void bsp_view_cells(BspMap *map, const BspView *views, size_t count, size_t thread_count, u32 *cell_counts, u64 *cell_bits);
+
+// Phases of work on a map. Time spent in a phase that starts inside another one, such as lumps being read
+// while parsing entities, only counts towards the inner phase.
+enum
+{
+	BSP_PHASE_LOAD, // opening the file, reading lumps and the cache
+	BSP_PHASE_ENTITIES, // parsing the entity lump
+	BSP_PHASE_BRUSHES, // building brushes from the brush, brushside and plane lumps
+	BSP_PHASE_POLYGONIZE, // turning brushes into polygons and formatting them for export
+	BSP_PHASE_PATCHES, // extracting and writing patches from the collision lumps
+	BSP_PHASE_WRITE, // writing everything else of the .map
+	BSP_PHASE_MAX
+};
+
+// CPU time is measured on the thread running the phase plus the threads it starts, so a phase has to be
+// entered and left on the same thread. Heap and peak RSS are sampled for the whole process.
+typedef struct
+{
+	u32 calls; // number of times the phase was entered
+	double wall; // seconds
+	double cpu; // seconds
+	u64 bytes_read;
+	s64 heap; // change in heap bytes in use, always 0 where the C library doesn't report it
+	u64 peak_rss; // bytes, as of the end of the phase
+} BspPhaseStats;
+
+// Counts for a model written by the last export, model 0 is the world and belongs to entity 0.
+typedef struct
+{
+	u32 model;
+	u32 entity;
+	u32 brushes;
+	u32 sides;
+	u32 surfaces;
+	u32 patches;
+	u32 patch_triangles;
+} BspModelStats;
+
+typedef struct
+{
+	BspPhaseStats phases[BSP_PHASE_MAX];
+	BspModelStats *models;
+	size_t model_count;
+	bool process_wide_memory; // other maps were open while this one was timed, so heap and peak_rss include theirs
+} BspStats;
+
+enum
+{
+	BSP_STATS_TEXT,
+	BSP_STATS_JSON // a single line
+};
+
+BSP_API const char *bsp_phase_name(int phase);
+// Measurements are always taken, they cost a few system calls per phase.
+BSP_API const BspStats *bsp_stats(BspMap *map);
+BSP_API void bsp_print_stats(BspMap *map, Writer *log, int format);
@@ -0,0 +1,928 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "bsp.h"
+#include "stream_file.h"
+#include "stream_memory.h"
+#include <growable-buf/buf.h>
+#include <linmath.h/linmath.h>
+
+#include "thread.h"
+#include "timer.h"
+
+// Generates synthetic .d3dbsp files of growing size and times loading, -info, -export and point queries on them.
+
+typedef struct
+{
+	size_t brushes;
+	size_t sides; // per brush, at least the 6 axial ones
+	size_t triangles; // collision triangles, exported as patches
+	size_t portals;
+	size_t entities;
+} BenchSize;
+
+typedef struct
+{
+	BenchSize base;
+	size_t *scales;
+	size_t iterations;
+	size_t points;
+	size_t rays;
+	size_t views;
+	size_t thread_count;
+	int flags;
+	const char *directory;
+	bool keep;
+} BenchOptions;
+
+#define BENCH_MATERIALS 16
+#define BENCH_BRUSH_SPACING 128.f
+#define BENCH_TRIANGLES_PER_PARTITION 4
+#define BENCH_TREE_FANOUT 8
+#define BENCH_CELL_SIZE 256.f
+#define BENCH_CLUSTER_CELLS 4 // brush cells per cluster along each axis
+#define BENCH_SOUP_QUADS 64
+
+static void append(u8 **lump, const void *ptr, size_t n)
+{
+	size_t size = buf_size(*lump);
+	if(buf_capacity(*lump) - size < n)
+		buf_grow(*lump, n > size ? n : size);
+	memcpy(*lump + size, ptr, n);
+	buf_ptr(*lump)->size = size + n;
+}
+
+#define append_struct(lump, s) append(&(lump), &(s), sizeof(s))
+
+static void normalize(vec3 v)
+{
+	float length = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+	for(int i = 0; i < 3; ++i)
+		v[i] /= length;
+}
+
+static void generate_materials(u8 **lumps)
+{
+	for(int i = 0; i < BENCH_MATERIALS; ++i)
+	{
+		dmaterial_t m = { 0 };
+		snprintf(m.material, sizeof(m.material), "bench/material_%02d", i);
+		m.contentFlags = 1;
+		append_struct(lumps[LUMP_MATERIALS], m);
+	}
+}
+
+// Boxes on a grid, the sides past the axial ones cut off edges and corners so every one of them shows up.
+static void generate_brushes(u8 **lumps, const BenchSize *size, vec3 mins_out, vec3 maxs_out)
+{
+	static const float directions[][3] = {
+		{ 1, 1, 0 }, { 1, -1, 0 }, { -1, 1, 0 }, { -1, -1, 0 },
+		{ 1, 0, 1 }, { 1, 0, -1 }, { -1, 0, 1 }, { -1, 0, -1 },
+		{ 0, 1, 1 }, { 0, 1, -1 }, { 0, -1, 1 }, { 0, -1, -1 },
+		{ 1, 1, 1 }, { 1, 1, -1 }, { 1, -1, 1 }, { 1, -1, -1 },
+		{ -1, 1, 1 }, { -1, 1, -1 }, { -1, -1, 1 }, { -1, -1, -1 }
+	};
+	size_t direction_count = sizeof(directions) / sizeof(directions[0]);
+	size_t sides = size->sides < 6 ? 6 : size->sides;
+	size_t grid = (size_t)ceil(cbrt((double)size->brushes));
+	if(grid == 0)
+		grid = 1;
+	for(int k = 0; k < 3; ++k)
+	{
+		mins_out[k] = 0.f;
+		maxs_out[k] = grid * BENCH_BRUSH_SPACING;
+	}
+	for(size_t i = 0; i < size->brushes; ++i)
+	{
+		size_t cell[3] = { i % grid, i / grid % grid, i / (grid * grid) };
+		vec3 mins, maxs;
+		for(int k = 0; k < 3; ++k)
+		{
+			mins[k] = cell[k] * BENCH_BRUSH_SPACING;
+			maxs[k] = mins[k] + 64.f + (float)((i + k) % 3) * 16.f;
+		}
+		DiskBrush brush = { .numSides = (u16)sides, .materialNum = (u16)(i % BENCH_MATERIALS) };
+		append_struct(lumps[LUMP_BRUSHES], brush);
+		// The axial sides store the bounds as the bits of a float instead of a plane index.
+		for(int axis = 0; axis < 3; ++axis)
+		{
+			for(int sign = 0; sign < 2; ++sign)
+			{
+				union
+				{
+					float f;
+					s32 i;
+				} u;
+				u.f = sign ? maxs[axis] : mins[axis];
+				cbrushside_t side = { .plane = u.i, .materialNum = (s32)((i + axis * 2 + sign) % BENCH_MATERIALS) };
+				append_struct(lumps[LUMP_BRUSHSIDES], side);
+			}
+		}
+		for(size_t k = 0; k < sides - 6; ++k)
+		{
+			DiskPlane plane;
+			const float *d = directions[k % direction_count];
+			vec3_dup(plane.normal, d);
+			normalize(plane.normal);
+			float support = 0.f;
+			for(int axis = 0; axis < 3; ++axis)
+				support += plane.normal[axis] * (plane.normal[axis] > 0.f ? maxs[axis] : mins[axis]);
+			plane.dist = support - 4.f - (float)(k / direction_count % 4) * 2.f;
+			cbrushside_t side = { .plane = (s32)(buf_size(lumps[LUMP_PLANES]) / sizeof(DiskPlane)), .materialNum = (s32)(k % BENCH_MATERIALS) };
+			append_struct(lumps[LUMP_PLANES], plane);
+			append_struct(lumps[LUMP_BRUSHSIDES], side);
+		}
+	}
+}
+
+// Splits the brush grid in half along its longest side until every cell is a leaf holding its brush.
+// The split planes run through the gaps between the brushes, blocks of cells share a cluster.
+static s32 generate_node(u8 **lumps, size_t grid, size_t brush_count, const size_t lo[3], const size_t hi[3])
+{
+	int axis = 0;
+	for(int k = 1; k < 3; ++k)
+	{
+		if(hi[k] - lo[k] > hi[axis] - lo[axis])
+			axis = k;
+	}
+	if(hi[axis] - lo[axis] == 1)
+	{
+		s32 leaf_index = (s32)(buf_size(lumps[LUMP_LEAFS]) / sizeof(dleaf_t));
+		size_t brush = lo[0] + lo[1] * grid + lo[2] * grid * grid;
+		size_t clusters = (grid + BENCH_CLUSTER_CELLS - 1) / BENCH_CLUSTER_CELLS;
+		size_t cluster = lo[0] / BENCH_CLUSTER_CELLS + lo[1] / BENCH_CLUSTER_CELLS * clusters + lo[2] / BENCH_CLUSTER_CELLS * clusters * clusters;
+		dleaf_t leaf = { .cluster = (s32)cluster, .cellNum = -1 };
+		leaf.firstLeafBrush = (s32)(buf_size(lumps[LUMP_LEAFBRUSHES]) / sizeof(dleafbrush_t));
+		if(brush < brush_count)
+		{
+			dleafbrush_t lb = { .brush = (s32)brush };
+			append_struct(lumps[LUMP_LEAFBRUSHES], lb);
+			leaf.numLeafBrushes = 1;
+		}
+		append_struct(lumps[LUMP_LEAFS], leaf);
+		return -(leaf_index + 1);
+	}
+	size_t node_index = buf_size(lumps[LUMP_NODES]) / sizeof(dnode_t);
+	dnode_t node = { .planeNum = (s32)(buf_size(lumps[LUMP_PLANES]) / sizeof(DiskPlane)) };
+	for(int k = 0; k < 3; ++k)
+	{
+		node.mins[k] = (s32)(lo[k] * BENCH_BRUSH_SPACING);
+		node.maxs[k] = (s32)(hi[k] * BENCH_BRUSH_SPACING);
+	}
+	append_struct(lumps[LUMP_NODES], node);
+	size_t split = (lo[axis] + hi[axis]) / 2;
+	DiskPlane plane = { 0 };
+	plane.normal[axis] = 1.f;
+	plane.dist = split * BENCH_BRUSH_SPACING - 16.f;
+	append_struct(lumps[LUMP_PLANES], plane);
+	size_t front_lo[3] = { lo[0], lo[1], lo[2] };
+	size_t back_hi[3] = { hi[0], hi[1], hi[2] };
+	front_lo[axis] = split;
+	back_hi[axis] = split;
+	s32 front = generate_node(lumps, grid, brush_count, front_lo, hi);
+	s32 back = generate_node(lumps, grid, brush_count, lo, back_hi);
+	dnode_t *dst = &((dnode_t *)lumps[LUMP_NODES])[node_index];
+	dst->children[0] = front;
+	dst->children[1] = back;
+	return (s32)node_index;
+}
+
+static void generate_tree(u8 **lumps, const BenchSize *size)
+{
+	size_t grid = (size_t)ceil(cbrt((double)size->brushes));
+	if(grid < 2)
+		return;
+	size_t lo[3] = { 0, 0, 0 };
+	size_t hi[3] = { grid, grid, grid };
+	generate_node(lumps, grid, size->brushes, lo, hi);
+}
+
+// Every cluster sees the clusters next to it, diagonals included.
+static void generate_visibility(u8 **lumps, const BenchSize *size)
+{
+	size_t grid = (size_t)ceil(cbrt((double)size->brushes));
+	if(grid < 2)
+		return;
+	size_t clusters = (grid + BENCH_CLUSTER_CELLS - 1) / BENCH_CLUSTER_CELLS;
+	s32 header[2] = { (s32)(clusters * clusters * clusters), (s32)((clusters * clusters * clusters + 7) / 8) };
+	append(&lumps[LUMP_VISIBILITY], header, sizeof(header));
+	u8 *row = malloc(header[1]);
+	for(s32 from = 0; from < header[0]; ++from)
+	{
+		memset(row, 0, header[1]);
+		for(s32 to = 0; to < header[0]; ++to)
+		{
+			bool visible = true;
+			for(size_t axis = 0, stride = 1; axis < 3; ++axis, stride *= clusters)
+			{
+				s64 d = (s64)(from / stride % clusters) - (s64)(to / stride % clusters);
+				if(d < -1 || d > 1)
+					visible = false;
+			}
+			if(visible)
+				row[to >> 3] |= 1 << (to & 7);
+		}
+		append(&lumps[LUMP_VISIBILITY], row, header[1]);
+	}
+	free(row);
+}
+
+typedef struct
+{
+	vec3 mins, maxs;
+} Bounds;
+
+static void bounds_add(Bounds *b, const vec3 p)
+{
+	for(int k = 0; k < 3; ++k)
+	{
+		if(p[k] < b->mins[k])
+			b->mins[k] = p[k];
+		if(p[k] > b->maxs[k])
+			b->maxs[k] = p[k];
+	}
+}
+
+// A height field of triangles, grouped into partitions under a collision AABB tree.
+static void generate_collision(u8 **lumps, const BenchSize *size)
+{
+	if(size->triangles == 0)
+		return;
+	size_t quads = (size->triangles + 1) / 2;
+	size_t width = (size_t)ceil(sqrt((double)quads));
+	size_t rows = (quads + width - 1) / width;
+	for(size_t y = 0; y <= rows; ++y)
+	{
+		for(size_t x = 0; x <= width; ++x)
+		{
+			// Vertices at the origin are skipped by the patch export, the height field stays above it.
+			DiskCollisionVertex v = { .checkStamp = 0 };
+			v.xyz[0] = x * 32.f + 16.f;
+			v.xyz[1] = y * 32.f + 16.f;
+			v.xyz[2] = 32.f + (float)((x * 7 + y * 13) % 5) * 4.f;
+			append_struct(lumps[LUMP_COLLISIONVERTS], v);
+		}
+	}
+	DiskCollisionVertex *vertices = (DiskCollisionVertex *)lumps[LUMP_COLLISIONVERTS];
+	for(size_t i = 0; i < size->triangles; ++i)
+	{
+		size_t quad = i / 2;
+		u32 a = (u32)(quad / width * (width + 1) + quad % width);
+		u32 b = a + 1, c = a + (u32)width + 1, d = c + 1;
+		DiskCollisionTriangle tri = { 0 };
+		u32 indices[2][3] = { { a, b, d }, { a, d, c } };
+		memcpy(tri.vertIndices, indices[i % 2], sizeof(tri.vertIndices));
+		tri.plane[2] = 1.f;
+		tri.plane[3] = vertices[a].xyz[2];
+		append_struct(lumps[LUMP_COLLISIONTRIS], tri);
+	}
+
+	size_t partition_count = (size->triangles + BENCH_TRIANGLES_PER_PARTITION - 1) / BENCH_TRIANGLES_PER_PARTITION;
+	Bounds *bounds = malloc(partition_count * sizeof(Bounds));
+	DiskCollisionTriangle *tris = (DiskCollisionTriangle *)lumps[LUMP_COLLISIONTRIS];
+	for(size_t i = 0; i < partition_count; ++i)
+	{
+		DiskCollisionPartition part = { 0 };
+		part.firstTriIndex = (u32)(i * BENCH_TRIANGLES_PER_PARTITION);
+		size_t left = size->triangles - part.firstTriIndex;
+		part.triCount = (u8)(left < BENCH_TRIANGLES_PER_PARTITION ? left : BENCH_TRIANGLES_PER_PARTITION);
+		append_struct(lumps[LUMP_COLLISIONPARTITIONS], part);
+		vec3_dup(bounds[i].mins, vertices[tris[part.firstTriIndex].vertIndices[0]].xyz);
+		vec3_dup(bounds[i].maxs, bounds[i].mins);
+		for(size_t j = 0; j < part.triCount; ++j)
+		{
+			for(int k = 0; k < 3; ++k)
+				bounds_add(&bounds[i], vertices[tris[part.firstTriIndex + j].vertIndices[k]].xyz);
+		}
+	}
+
+	// Built breadth first, the children of a node are stored next to each other.
+	typedef struct
+	{
+		size_t first, count; // partitions under the node
+	} Range;
+	Range *ranges = NULL;
+	buf_push(ranges, ((Range) { 0, partition_count }));
+	for(size_t i = 0; i < buf_size(ranges); ++i)
+	{
+		Range r = ranges[i];
+		Bounds b = bounds[r.first];
+		for(size_t j = r.first + 1; j < r.first + r.count; ++j)
+		{
+			bounds_add(&b, bounds[j].mins);
+			bounds_add(&b, bounds[j].maxs);
+		}
+		DiskCollisionAabbTree node = { 0 };
+		for(int k = 0; k < 3; ++k)
+		{
+			node.origin[k] = (b.mins[k] + b.maxs[k]) * 0.5f;
+			node.halfSize[k] = (b.maxs[k] - b.mins[k]) * 0.5f;
+		}
+		node.materialIndex = (s16)(r.first % BENCH_MATERIALS);
+		if(r.count == 1)
+		{
+			node.u.partitionIndex = (s32)r.first;
+		}
+		else
+		{
+			size_t per_child = (r.count + BENCH_TREE_FANOUT - 1) / BENCH_TREE_FANOUT;
+			node.u.firstChildIndex = (s32)buf_size(ranges);
+			for(size_t j = 0; j < r.count; j += per_child)
+			{
+				buf_push(ranges, ((Range) { r.first + j, r.count - j < per_child ? r.count - j : per_child }));
+				++node.childCount;
+			}
+		}
+		append_struct(lumps[LUMP_COLLISIONAABBS], node);
+	}
+	buf_free(ranges);
+	free(bounds);
+}
+
+// A row of cells along x, neighbouring cells see each other through a square portal.
+// Render surfaces over the collision height field, every soup has its own quads and cycles through the materials.
+static void generate_surfaces(u8 **lumps, const BenchSize *size)
+{
+	size_t quads = (size->triangles + 1) / 2;
+	size_t width = (size_t)ceil(sqrt((double)quads));
+	for(size_t first = 0; first < quads; first += BENCH_SOUP_QUADS)
+	{
+		size_t count = quads - first < BENCH_SOUP_QUADS ? quads - first : BENCH_SOUP_QUADS;
+		DiskTriangleSoup soup = { 0 };
+		soup.materialIndex = (u16)(buf_size(lumps[LUMP_TRIANGLES]) / sizeof(DiskTriangleSoup) % BENCH_MATERIALS);
+		soup.firstVertex = (u32)(buf_size(lumps[LUMP_DRAWVERTS]) / sizeof(DiskGfxVertex));
+		soup.vertexCount = (u16)(count * 4);
+		soup.firstIndex = (u32)(buf_size(lumps[LUMP_DRAWINDICES]) / sizeof(u16));
+		soup.indexCount = (u16)(count * 6);
+		append_struct(lumps[LUMP_TRIANGLES], soup);
+		for(size_t i = 0; i < count; ++i)
+		{
+			size_t x = (first + i) % width, y = (first + i) / width;
+			for(int corner = 0; corner < 4; ++corner)
+			{
+				DiskGfxVertex v = { .normal = { 0.f, 0.f, 1.f }, .color = 0xffffffff };
+				size_t cx = x + (corner & 1), cy = y + (corner >> 1);
+				v.xyz[0] = cx * 32.f + 16.f;
+				v.xyz[1] = cy * 32.f + 16.f;
+				v.xyz[2] = 32.f + (float)((cx * 7 + cy * 13) % 5) * 4.f;
+				v.texCoord[0] = v.xyz[0] / 256.f;
+				v.texCoord[1] = v.xyz[1] / 256.f;
+				v.lmapCoord[0] = (float)cx / (float)(width + 1);
+				v.lmapCoord[1] = (float)cy / (float)(width + 1);
+				append_struct(lumps[LUMP_DRAWVERTS], v);
+			}
+			u16 base = (u16)(i * 4);
+			u16 indices[6] = { base, (u16)(base + 1), (u16)(base + 3), base, (u16)(base + 3), (u16)(base + 2) };
+			append(&lumps[LUMP_DRAWINDICES], indices, sizeof(indices));
+		}
+	}
+}
+
+static void generate_portals(u8 **lumps, const BenchSize *size)
+{
+	if(size->portals < 2)
+		return;
+	size_t cell_count = size->portals / 2 + 1;
+	for(size_t c = 0; c < cell_count; ++c)
+	{
+		DiskGfxCell cell = { 0 };
+		cell.mins[0] = c * BENCH_CELL_SIZE;
+		cell.maxs[0] = cell.mins[0] + BENCH_CELL_SIZE;
+		cell.maxs[1] = cell.maxs[2] = BENCH_CELL_SIZE;
+		cell.firstPortal = (s32)(buf_size(lumps[LUMP_PORTALS]) / sizeof(DiskGfxPortal));
+		for(int side = 0; side < 2; ++side)
+		{
+			if((side == 0 && c == 0) || (side == 1 && c + 1 == cell_count))
+				continue;
+			float x = side ? cell.maxs[0] : cell.mins[0];
+			DiskPlane plane = { .normal = { side ? 1.f : -1.f, 0.f, 0.f }, .dist = side ? x : -x };
+			DiskGfxPortal portal = { 0 };
+			portal.planeIndex = (u32)(buf_size(lumps[LUMP_PLANES]) / sizeof(DiskPlane));
+			portal.cellIndex = (u32)(side ? c + 1 : c - 1);
+			portal.firstPortalVertex = (u32)(buf_size(lumps[LUMP_PORTALVERTS]) / sizeof(DiskGfxPortalVertex));
+			portal.portalVertexCount = 4;
+			append_struct(lumps[LUMP_PLANES], plane);
+			append_struct(lumps[LUMP_PORTALS], portal);
+			float quad[4][2] = { { 64.f, 64.f }, { 192.f, 64.f }, { 192.f, 192.f }, { 64.f, 192.f } };
+			for(int k = 0; k < 4; ++k)
+			{
+				DiskGfxPortalVertex v = { .xyz = { x, quad[k][0], quad[k][1] } };
+				append_struct(lumps[LUMP_PORTALVERTS], v);
+			}
+			++cell.portalCount;
+		}
+		append_struct(lumps[LUMP_CELLS], cell);
+	}
+}
+
+static void generate_entities(u8 **lumps, const BenchSize *size)
+{
+	static const char *classnames[] = { "info_player_deathmatch", "light", "script_origin", "misc_model" };
+	char text[512];
+	int n = snprintf(text, sizeof(text), "{\n\"classname\" \"worldspawn\"\n\"message\" \"bsp_bench\"\n}\n");
+	append(&lumps[LUMP_ENTITIES], text, n);
+	for(size_t i = 1; i < size->entities; ++i)
+	{
+		n = snprintf(text,
+					 sizeof(text),
+					 "{\n\"classname\" \"%s\"\n\"origin\" \"%d %d %d\"\n\"angles\" \"0 %d 0\"\n\"targetname\" \"bench_%d\"\n}\n",
+					 classnames[i % 4],
+					 (int)(i % 64) * 32,
+					 (int)(i / 64 % 64) * 32,
+					 (int)(i / 4096) * 32 + 16,
+					 (int)(i * 15 % 360),
+					 (int)(i / 8));
+		append(&lumps[LUMP_ENTITIES], text, n);
+	}
+	append(&lumps[LUMP_ENTITIES], "", 1);
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int generate_map(const char *path, const BenchSize *size, s64 *file_size)
+{
+	u8 *lumps[LUMP_MAX] = { 0 };
+	dmodel_t world = { 0 };
+	generate_materials(lumps);
+	generate_brushes(lumps, size, world.mins, world.maxs);
+	generate_collision(lumps, size);
+	generate_surfaces(lumps, size);
+	generate_portals(lumps, size);
+	generate_tree(lumps, size);
+	generate_visibility(lumps, size);
+	generate_entities(lumps, size);
+	world.numBrushes = (u32)size->brushes;
+	append_struct(lumps[LUMP_MODELS], world);
+
+	dheader_t header = { .ident = { 'I', 'B', 'S', 'P' }, .version = 4 };
+	u32 offset = sizeof(header);
+	for(int i = 0; i < LUMP_MAX; ++i)
+	{
+		offset = (offset + 3) & ~3u;
+		header.lumps[i].fileofs = offset;
+		header.lumps[i].filelen = (u32)buf_size(lumps[i]);
+		offset += header.lumps[i].filelen;
+	}
+	*file_size = offset;
+
+	Stream out;
+	int status = stream_open_file(&out, path, "wb");
+	if(!status)
+	{
+		static const u8 padding[4];
+		u32 written = sizeof(header);
+		if(stream_write_buffer(&out, &header, sizeof(header)) != 1)
+			status = 1;
+		for(int i = 0; i < LUMP_MAX && !status; ++i)
+		{
+			u32 pad = header.lumps[i].fileofs - written;
+			if(pad && stream_write_buffer(&out, padding, pad) != 1)
+				status = 1;
+			if(buf_size(lumps[i]) && stream_write_buffer(&out, lumps[i], buf_size(lumps[i])) != 1)
+				status = 1;
+			written = header.lumps[i].fileofs + header.lumps[i].filelen;
+		}
+		if(stream_close_file(&out))
+			status = 1;
+	}
+	for(int i = 0; i < LUMP_MAX; ++i)
+		buf_free(lumps[i]);
+	return status;
+}
+
+// Drops everything written to it and counts the bytes.
+static size_t stream_write_null_(struct Stream_s *stream, const void *ptr, size_t size, size_t nmemb)
+{
+	(void)ptr;
+	*(u64 *)stream->ctx += size * nmemb;
+	return nmemb;
+}
+
+static int64_t stream_tell_null_(struct Stream_s *stream)
+{
+	return (int64_t)*(u64 *)stream->ctx;
+}
+
+static int stream_seek_null_(struct Stream_s *stream, int64_t offset, int whence)
+{
+	(void)stream;
+	(void)offset;
+	(void)whence;
+	return 1;
+}
+
+static int stream_name_null_(struct Stream_s *stream, char *buffer, size_t size)
+{
+	(void)stream;
+	snprintf(buffer, size, "null");
+	return 0;
+}
+
+static int stream_eof_null_(struct Stream_s *stream)
+{
+	(void)stream;
+	return 1;
+}
+
+static size_t stream_read_null_(struct Stream_s *stream, void *ptr, size_t size, size_t nmemb)
+{
+	(void)stream;
+	(void)ptr;
+	(void)size;
+	(void)nmemb;
+	return 0;
+}
+
+static void stream_init_null(Stream *s, u64 *counter)
+{
+	s->ctx = counter;
+	s->read = stream_read_null_;
+	s->write = stream_write_null_;
+	s->eof = stream_eof_null_;
+	s->name = stream_name_null_;
+	s->tell = stream_tell_null_;
+	s->seek = stream_seek_null_;
+}
+
+typedef struct
+{
+	double load, info, export, polygonize, patches, mesh, points, vis, rays, sweeps, views;
+	u64 output_size;
+	u64 mesh_size;
+	u64 patch_triangles;
+} BenchTimes;
+
+static void keep_fastest(double *best, double t)
+{
+	if(*best == 0.0 || t < *best)
+		*best = t;
+}
+
+// Spread over the bounds of the world, seed makes the sequence repeatable.
+static void random_point(const dmodel_t *world, u32 *seed, vec3 p)
+{
+	for(int k = 0; k < 3; ++k)
+	{
+		*seed = *seed * 1664525u + 1013904223u;
+		p[k] = world->mins[k] + (world->maxs[k] - world->mins[k]) * (float)(*seed >> 8) / (float)(1 << 24);
+	}
+}
+
+// Exports into a memory stream and into a file next to the map, then reads both back and compares them.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int check_memory_export(BspMap *map, const char *path, const BenchOptions *opts)
+{
+	char file_path[300];
+	snprintf(file_path, sizeof(file_path), "%s.map", path);
+	BspExportOptions export_opts = { .float_format = WRITER_FLOAT_FIXED, .thread_count = opts->thread_count };
+	Stream memory;
+	if(stream_open_memory(&memory))
+		return 1;
+	int status = bsp_export_map_stream(map, &memory, &export_opts, NULL) || bsp_export_map(map, file_path, &export_opts, NULL);
+	Stream file;
+	if(!status && !stream_open_file(&file, file_path, "r"))
+	{
+		memory.seek(&memory, 0, STREAM_SEEK_BEG);
+		char expected[4096], actual[4096];
+		for(;;)
+		{
+			size_t n = file.read(&file, expected, 1, sizeof(expected));
+			if(memory.read(&memory, actual, 1, sizeof(actual)) != n || memcmp(expected, actual, n))
+			{
+				status = 1;
+				break;
+			}
+			if(n == 0)
+				break;
+		}
+		stream_close_file(&file);
+	}
+	else
+	{
+		status = 1;
+	}
+	if(!opts->keep)
+		remove(file_path);
+	stream_close_memory(&memory);
+	if(status)
+		fprintf(stderr, "The export to memory doesn't match the export to '%s'\n", file_path);
+	return status;
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int bench_map(const char *path, const BenchOptions *opts, BenchTimes *best)
+{
+	memset(best, 0, sizeof(BenchTimes));
+	for(size_t iteration = 0; iteration < opts->iterations; ++iteration)
+	{
+		char error[256];
+		double start = timer_now();
+		BspMap *map = bsp_open_file(path, opts->flags, opts->thread_count, error, sizeof(error));
+		if(!map)
+		{
+			fprintf(stderr, "%s\n", error);
+			return 1;
+		}
+		// Every page is touched so a mapped file is read as well.
+		const dheader_t *header = bsp_header(map);
+		for(int i = 0; i < LUMP_MAX; ++i)
+		{
+			const volatile u8 *data = bsp_lump(map, i, NULL);
+			for(size_t j = 0; data && j < header->lumps[i].filelen; j += 4096)
+				(void)data[j];
+		}
+		keep_fastest(&best->load, timer_now() - start);
+
+		Writer info;
+		writer_init(&info, NULL, WRITER_FLOAT_FIXED);
+		start = timer_now();
+		bsp_print_info(map, &info);
+		keep_fastest(&best->info, timer_now() - start);
+		writer_free(&info);
+
+		u64 output_size = 0;
+		Stream out;
+		stream_init_null(&out, &output_size);
+		BspExportOptions export_opts = { .float_format = WRITER_FLOAT_FIXED, .thread_count = opts->thread_count };
+		start = timer_now();
+		int status = bsp_export_map_stream(map, &out, &export_opts, NULL);
+		keep_fastest(&best->export, timer_now() - start);
+
+		const BspStats *stats = bsp_stats(map);
+		keep_fastest(&best->polygonize, stats->phases[BSP_PHASE_POLYGONIZE].wall);
+		keep_fastest(&best->patches, stats->phases[BSP_PHASE_PATCHES].wall);
+		best->output_size = output_size;
+		best->patch_triangles = stats->model_count ? stats->models[0].patch_triangles : 0;
+		if(iteration == 0 && check_memory_export(map, path, opts))
+			status = 1;
+
+		u64 mesh_size = 0;
+		stream_init_null(&out, &mesh_size);
+		BspMeshOptions mesh_opts = { .format = BSP_MESH_OBJ, .float_format = WRITER_FLOAT_FIXED };
+		start = timer_now();
+		if(bsp_export_mesh_stream(map, &out, &mesh_opts, NULL))
+			status = 1;
+		keep_fastest(&best->mesh, timer_now() - start);
+		best->mesh_size = mesh_size;
+
+		const dmodel_t *world = bsp_models(map, NULL);
+		vec3 *points = malloc((opts->points + 1) * sizeof(vec3));
+		BspPointResult *results = malloc((opts->points + 1) * sizeof(BspPointResult));
+		u32 seed = 1;
+		for(size_t i = 0; i < opts->points; ++i)
+			random_point(world, &seed, points[i]);
+		start = timer_now();
+		bsp_point_query(map, (const vec3 *)points, opts->points, BSP_POINT_CONTENTS, opts->thread_count, results);
+		keep_fastest(&best->points, timer_now() - start);
+		free(results);
+		BspVisResult *visible = malloc((opts->points + 1) * sizeof(BspVisResult));
+		start = timer_now();
+		bsp_point_visibility(map, (const vec3 *)points, opts->points, opts->thread_count, visible, NULL, NULL);
+		keep_fastest(&best->vis, timer_now() - start);
+		free(visible);
+		free(points);
+
+		BspRay *rays = malloc((opts->rays + 1) * sizeof(BspRay));
+		BspTraceResult *hits = malloc((opts->rays + 1) * sizeof(BspTraceResult));
+		for(size_t i = 0; i < opts->rays; ++i)
+		{
+			random_point(world, &seed, rays[i].start);
+			random_point(world, &seed, rays[i].end);
+		}
+		start = timer_now();
+		bsp_trace(map, rays, opts->rays, BSP_TRACE_TRIANGLES | BSP_TRACE_BRUSHES, opts->thread_count, hits);
+		keep_fastest(&best->rays, timer_now() - start);
+		// The same segments swept with a standing player's hull.
+		start = timer_now();
+		bsp_trace_box(map, rays, opts->rays, (vec3) { -15.f, -15.f, 0.f }, (vec3) { 15.f, 15.f, 70.f }, BSP_TRACE_TRIANGLES | BSP_TRACE_BRUSHES, opts->thread_count, hits);
+		keep_fastest(&best->sweeps, timer_now() - start);
+		free(hits);
+		free(rays);
+
+		// Looking down the row of portal cells from the center of each one in turn.
+		size_t cell_count;
+		const DiskGfxCell *cells = bsp_cells(map, &cell_count);
+		if(cell_count > 0)
+		{
+			BspView *views = malloc((opts->views + 1) * sizeof(BspView));
+			u32 *seen = malloc((opts->views + 1) * sizeof(u32));
+			for(size_t i = 0; i < opts->views; ++i)
+			{
+				const DiskGfxCell *cell = &cells[i % cell_count];
+				BspView view = { .forward = { 1.f, 0.f, 0.f }, .fov_x = 90.f, .fov_y = 90.f, .cell = (s32)(i % cell_count) };
+				for(int k = 0; k < 3; ++k)
+					view.origin[k] = (cell->mins[k] + cell->maxs[k]) * 0.5f;
+				views[i] = view;
+			}
+			start = timer_now();
+			bsp_view_cells(map, views, opts->views, opts->thread_count, seen, NULL);
+			keep_fastest(&best->views, timer_now() - start);
+			free(seen);
+			free(views);
+		}
+		bsp_close(map);
+		if(status)
+			return 1;
+	}
+	return 0;
+}
+
+static double per_second(double amount, double seconds)
+{
+	return seconds > 0.0 ? amount / seconds : 0.0;
+}
+
+static void print_usage()
+{
+	printf("Usage: ./bsp_bench [options]\n");
+	printf("\n");
+	printf("Generates synthetic .d3dbsp files, then times loading, -info, -export and point queries on each of them.\n");
+	printf("\n");
+	printf("Options:\n");
+	printf("  -brushes <count> 		Brushes at scale 1, defaults to 1000.\n");
+	printf("  -sides <count> 		Sides per brush, at least 6, defaults to 12.\n");
+	printf("  -triangles <count> 	Collision and render triangles at scale 1, defaults to 4000.\n");
+	printf("  -portals <count> 		Portals at scale 1, defaults to 200.\n");
+	printf("  -entities <count> 	Entities at scale 1, defaults to 200.\n");
+	printf("  -scales <list> 		Comma separated multipliers for the counts above, defaults to 1,4,16.\n");
+	printf("  -points <count> 		Random points queried for their leaf, contents and potentially visible set, defaults to 1000000.\n");
+	printf("  -rays <count> 			Random segments traced, and swept with a player hull, against the collision triangles and brushes, defaults to 100000.\n");
+	printf("  -views <count> 		Views walked through the portals from the cell centers, defaults to 10000.\n");
+	printf("  -iterations <count> 	Runs per size, the fastest one is reported, defaults to 3.\n");
+	printf("  -threads <count> 		Threads used for reading with -preload and exporting, defaults to the number of processors.\n");
+	printf("  -no_mmap 				Read lumps into memory instead of mapping the file.\n");
+	printf("  -preload 				Read all lumps up front with the reads issued concurrently.\n");
+	printf("  -dir <path> 			Directory the generated files are written to, defaults to the current one.\n");
+	printf("  -keep 				Keep the generated files.\n");
+	exit(0);
+}
+
+static bool parse_count(int argc, char **argv, int *i, size_t *count)
+{
+	if(*i + 1 >= argc)
+	{
+		fprintf(stderr, "Error: %s requires a argument.\n", argv[*i]);
+		return false;
+	}
+	*count = (size_t)strtoull(argv[++*i], NULL, 10);
+	return true;
+}
+
+static bool parse_arguments(int argc, char **argv, BenchOptions *opts)
+{
+	opts->base = (BenchSize) { .brushes = 1000, .sides = 12, .triangles = 4000, .portals = 200, .entities = 200 };
+	opts->iterations = 3;
+	opts->points = 1000000;
+	opts->rays = 100000;
+	opts->views = 10000;
+	opts->thread_count = thread_hardware_concurrency();
+	opts->directory = ".";
+	for(int i = 1; i < argc; ++i)
+	{
+		bool ok = true;
+		if(!strcmp(argv[i], "-help") || !strcmp(argv[i], "-?") || !strcmp(argv[i], "-usage"))
+			print_usage();
+		else if(!strcmp(argv[i], "-brushes"))
+			ok = parse_count(argc, argv, &i, &opts->base.brushes);
+		else if(!strcmp(argv[i], "-sides"))
+			ok = parse_count(argc, argv, &i, &opts->base.sides);
+		else if(!strcmp(argv[i], "-triangles"))
+			ok = parse_count(argc, argv, &i, &opts->base.triangles);
+		else if(!strcmp(argv[i], "-portals"))
+			ok = parse_count(argc, argv, &i, &opts->base.portals);
+		else if(!strcmp(argv[i], "-entities"))
+			ok = parse_count(argc, argv, &i, &opts->base.entities);
+		else if(!strcmp(argv[i], "-points"))
+			ok = parse_count(argc, argv, &i, &opts->points);
+		else if(!strcmp(argv[i], "-rays"))
+			ok = parse_count(argc, argv, &i, &opts->rays);
+		else if(!strcmp(argv[i], "-views"))
+			ok = parse_count(argc, argv, &i, &opts->views);
+		else if(!strcmp(argv[i], "-iterations"))
+			ok = parse_count(argc, argv, &i, &opts->iterations);
+		else if(!strcmp(argv[i], "-threads"))
+			ok = parse_count(argc, argv, &i, &opts->thread_count);
+		else if(!strcmp(argv[i], "-no_mmap"))
+			opts->flags |= BSP_OPEN_NO_MMAP;
+		else if(!strcmp(argv[i], "-preload"))
+			opts->flags |= BSP_OPEN_PRELOAD;
+		else if(!strcmp(argv[i], "-keep"))
+			opts->keep = true;
+		else if(!strcmp(argv[i], "-dir"))
+		{
+			if(i + 1 < argc)
+				opts->directory = argv[++i];
+			else
+			{
+				fprintf(stderr, "Error: -dir requires a argument.\n");
+				ok = false;
+			}
+		}
+		else if(!strcmp(argv[i], "-scales"))
+		{
+			if(i + 1 < argc)
+			{
+				for(char *s = argv[++i]; *s;)
+				{
+					char *end;
+					size_t scale = (size_t)strtoull(s, &end, 10);
+					if(end == s)
+						break;
+					if(scale > 0)
+						buf_push(opts->scales, scale);
+					s = *end == ',' ? end + 1 : end;
+				}
+			}
+			else
+			{
+				fprintf(stderr, "Error: -scales requires a argument.\n");
+				ok = false;
+			}
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", argv[i]);
+			ok = false;
+		}
+		if(!ok)
+			return false;
+	}
+	if(buf_size(opts->scales) == 0)
+	{
+		size_t defaults[] = { 1, 4, 16 };
+		for(size_t i = 0; i < 3; ++i)
+			buf_push(opts->scales, defaults[i]);
+	}
+	if(opts->iterations < 1)
+		opts->iterations = 1;
+	if(opts->thread_count < 1)
+		opts->thread_count = 1;
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	BenchOptions opts = { 0 };
+	if(!parse_arguments(argc, argv, &opts))
+		return 1;
+
+	printf("%-6s %8s %8s %8s %8s %8s %8s | %9s %8s | %9s | %9s %10s %8s | %9s %11s | %9s %10s | %9s %10s %8s | %9s %10s | %9s %10s | %9s %10s | %9s %10s | %9s %10s\n",
+		   "scale", "MB", "brushes", "sides", "tris", "portals", "ents",
+		   "load ms", "MB/s",
+		   "info ms",
+		   "export ms", "brushes/s", "MB/s",
+		   "polys ms", "brushes/s",
+		   "patch ms", "tris/s",
+		   "mesh ms", "tris/s", "MB/s",
+		   "points ms", "points/s",
+		   "vis ms", "points/s",
+		   "rays ms", "rays/s",
+		   "sweeps ms", "sweeps/s",
+		   "views ms", "views/s");
+	int status = 0;
+	for(size_t i = 0; i < buf_size(opts.scales) && !status; ++i)
+	{
+		size_t scale = opts.scales[i];
+		BenchSize size = opts.base;
+		size.brushes *= scale;
+		size.triangles *= scale;
+		size.portals *= scale;
+		size.entities *= scale;
+		if(size.entities < 1)
+			size.entities = 1;
+
+		char path[512];
+		snprintf(path, sizeof(path), "%s/bsp_bench_%d.d3dbsp", opts.directory, (int)scale);
+		s64 file_size;
+		if(generate_map(path, &size, &file_size))
+		{
+			fprintf(stderr, "Failed to write '%s'\n", path);
+			status = 1;
+			break;
+		}
+		BenchTimes t;
+		status = bench_map(path, &opts, &t);
+		if(!opts.keep)
+			remove(path);
+		if(status)
+			break;
+		double mb = file_size / (1024.0 * 1024.0);
+		double output_mb = t.output_size / (1024.0 * 1024.0);
+		printf("%-6d %8.2f %8d %8d %8d %8d %8d | %9.2f %8.1f | %9.2f | %9.2f %10.0f %8.1f | %9.2f %11.0f | %9.2f %10.0f | %9.2f %10.0f %8.1f | %9.2f %10.0f | %9.2f %10.0f | %9.2f %10.0f | %9.2f %10.0f | %9.2f %10.0f\n",
+			   (int)scale, mb, (int)size.brushes, (int)(size.sides < 6 ? 6 : size.sides), (int)size.triangles, (int)size.portals, (int)size.entities,
+			   t.load * 1000.0, per_second(mb, t.load),
+			   t.info * 1000.0,
+			   t.export * 1000.0, per_second(size.brushes, t.export), per_second(output_mb, t.export),
+			   t.polygonize * 1000.0, per_second(size.brushes, t.polygonize),
+			   t.patches * 1000.0, per_second(t.patch_triangles, t.patches),
+			   t.mesh * 1000.0, per_second(size.triangles, t.mesh), per_second(t.mesh_size / (1024.0 * 1024.0), t.mesh),
+			   t.points * 1000.0, per_second(opts.points, t.points),
+			   t.vis * 1000.0, per_second(opts.points, t.vis),
+			   t.rays * 1000.0, per_second(opts.rays, t.rays),
+			   t.sweeps * 1000.0, per_second(opts.rays, t.sweeps),
+			   t.views * 1000.0, per_second(opts.views, t.views));
+		fflush(stdout);
+	}
+	buf_free(opts.scales);
+	return status;
+}
@@ -0,0 +1,364 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "bsp_internal.h"
+#include "stream_file.h"
+#include <growable-buf/buf.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+// Sidecar cache next to a .d3dbsp holding the decoded entities, the materials and the reconstructed brush planes.
+// Every section is stored flat so the file is used straight from a read-only mapping, only the entity lookup
+// tables and the brush pointers are rebuilt when loading.
+
+#define BSP_CACHE_VERSION 2
+#define BSP_CACHE_ALIGN 8
+
+typedef struct
+{
+	char ident[4]; // BSPC
+	u32 version;
+	// The cache belongs to the file with this size, modification time and header.
+	s64 file_size;
+	s64 mtime;
+	u64 header_hash;
+	u64 size;
+	u32 entity_count;
+	u32 keyvalue_count;
+	u32 key_count;
+	u32 material_count;
+	u32 brush_count;
+	u32 plane_count;
+	u64 strings_size;
+	u64 entities_offset;
+	u64 keyvalues_offset;
+	u64 keys_offset;
+	u64 strings_offset;
+	u64 materials_offset;
+	u64 brushes_offset;
+	u64 planes_offset;
+} CacheHeader;
+
+typedef struct
+{
+	u32 first_keyvalue;
+	u32 keyvalue_count;
+} CacheEntity;
+
+typedef struct
+{
+	u32 key; // index into the keys
+	u32 value; // offset into the strings
+} CacheKeyValue;
+
+typedef struct
+{
+	vec3 mins, maxs;
+	u32 first_plane;
+	u32 plane_count;
+} CacheBrush;
+
+typedef struct
+{
+	s64 file_size;
+	s64 mtime;
+	u64 header_hash;
+} CacheKey;
+
+static u64 hash_bytes(const void *data, size_t n)
+{
+	const u8 *p = data;
+	u64 h = 14695981039346656037ull;
+	for(size_t i = 0; i < n; ++i)
+	{
+		h ^= p[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int cache_key(BspMap *map, CacheKey *key)
+{
+#ifdef _WIN32
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if(!GetFileAttributesExA(map->path, GetFileExInfoStandard, &fad))
+		return 1;
+	key->mtime = ((s64)fad.ftLastWriteTime.dwHighDateTime << 32) | fad.ftLastWriteTime.dwLowDateTime;
+#else
+	struct stat st;
+	if(stat(map->path, &st))
+		return 1;
+	key->mtime = (s64)st.st_mtime;
+#endif
+	key->file_size = map->filelen;
+	key->header_hash = hash_bytes(&map->header, sizeof(map->header));
+	return 0;
+}
+
+static void cache_path(BspMap *map, char *path, size_t size)
+{
+	snprintf(path, size, "%s.bspcache", map->path);
+}
+
+static bool section_ok(const CacheHeader *h, u64 offset, u64 count, size_t element_size)
+{
+	return offset % BSP_CACHE_ALIGN == 0 && offset <= h->size && count <= (h->size - offset) / element_size;
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int load_cache(BspMap *map, const CacheKey *key)
+{
+	char path[300];
+	cache_path(map, path, sizeof(path));
+	if(file_map_open(&map->cachemap, path))
+		return 1;
+	const u8 *base = map->cachemap.data;
+	const CacheHeader *h = (const CacheHeader *)base;
+	bool valid = map->cachemap.size >= sizeof(CacheHeader) && !memcmp(h->ident, "BSPC", 4) &&
+				 h->version == BSP_CACHE_VERSION && h->size == map->cachemap.size && h->file_size == key->file_size &&
+				 h->mtime == key->mtime && h->header_hash == key->header_hash &&
+				 section_ok(h, h->entities_offset, h->entity_count, sizeof(CacheEntity)) &&
+				 section_ok(h, h->keyvalues_offset, h->keyvalue_count, sizeof(CacheKeyValue)) &&
+				 section_ok(h, h->keys_offset, h->key_count, sizeof(u32)) &&
+				 section_ok(h, h->strings_offset, h->strings_size, 1) &&
+				 section_ok(h, h->materials_offset, h->material_count, sizeof(dmaterial_t)) &&
+				 section_ok(h, h->brushes_offset, h->brush_count, sizeof(CacheBrush)) &&
+				 section_ok(h, h->planes_offset, h->plane_count, sizeof(MapPlane)) &&
+				 (h->strings_size == 0 || base[h->strings_offset + h->strings_size - 1] == 0);
+	if(!valid)
+	{
+		file_map_close(&map->cachemap);
+		map->cachemap.data = NULL;
+		return 1;
+	}
+
+	const CacheEntity *entities = (const CacheEntity *)(base + h->entities_offset);
+	const CacheKeyValue *keyvalues = (const CacheKeyValue *)(base + h->keyvalues_offset);
+	const u32 *keys = (const u32 *)(base + h->keys_offset);
+	char *strings = (char *)(base + h->strings_offset);
+	const CacheBrush *brushes = (const CacheBrush *)(base + h->brushes_offset);
+	MapPlane *planes = (MapPlane *)(base + h->planes_offset);
+
+	// Offsets are checked before anything is built, a damaged cache is rejected as a whole.
+	for(size_t i = 0; i < h->entity_count; ++i)
+	{
+		if(entities[i].first_keyvalue > h->keyvalue_count ||
+		   entities[i].keyvalue_count > h->keyvalue_count - entities[i].first_keyvalue)
+			valid = false;
+	}
+	for(size_t i = 0; i < h->keyvalue_count; ++i)
+	{
+		if(keyvalues[i].key >= h->key_count || keyvalues[i].value >= h->strings_size)
+			valid = false;
+	}
+	for(size_t i = 0; i < h->key_count; ++i)
+	{
+		if(keys[i] >= h->strings_size)
+			valid = false;
+	}
+	for(size_t i = 0; i < h->brush_count; ++i)
+	{
+		if(brushes[i].first_plane > h->plane_count || brushes[i].plane_count > h->plane_count - brushes[i].first_plane)
+			valid = false;
+	}
+	for(size_t i = 0; i < h->plane_count; ++i)
+	{
+		if(planes[i].materialIndex < 0 || (u32)planes[i].materialIndex >= h->material_count)
+			valid = false;
+	}
+	if(!valid)
+	{
+		file_map_close(&map->cachemap);
+		map->cachemap.data = NULL;
+		return 1;
+	}
+
+	stats_add_read(map, map->cachemap.size);
+	// Values point into the mapping, which stays open until the map is closed.
+	entity_list_begin(&map->entities, h->entity_count, h->keyvalue_count, 0);
+	for(size_t i = 0; i < h->entity_count; ++i)
+	{
+		entity_list_add_entity(&map->entities);
+		for(size_t j = 0; j < entities[i].keyvalue_count; ++j)
+		{
+			const CacheKeyValue *kv = &keyvalues[entities[i].first_keyvalue + j];
+			const char *k = strings + keys[kv->key];
+			entity_list_add_pair(&map->entities, k, strlen(k), strings + kv->value);
+		}
+	}
+	entity_list_end(&map->entities);
+	map->entities_parsed = true;
+
+	LumpData *materials = &map->lumpdata[LUMP_MATERIALS];
+	if(!materials->loaded)
+	{
+		materials->data = h->material_count ? (void *)(base + h->materials_offset) : NULL;
+		materials->count = h->material_count;
+		materials->mapped = true;
+		materials->loaded = true;
+	}
+
+	MapBrush *mapbrushes = NULL;
+	buf_grow(mapbrushes, h->brush_count);
+	for(size_t i = 0; i < h->brush_count; ++i)
+	{
+		MapBrush dst = { 0 };
+		vec3_dup(dst.mins, brushes[i].mins);
+		vec3_dup(dst.maxs, brushes[i].maxs);
+		dst.planes = &planes[brushes[i].first_plane];
+		dst.plane_count = brushes[i].plane_count;
+		buf_push(mapbrushes, dst);
+	}
+	map->mapbrushes = mapbrushes;
+	map->mapbrushes_loaded = true;
+	return 0;
+}
+
+static u32 key_index(EntityList *list, KeyValuePair *kvp)
+{
+	for(u32 i = kvp->key_hash & list->key_slot_mask;; i = (i + 1) & list->key_slot_mask)
+	{
+		u32 k = list->key_slots[i] - 1;
+		if(list->keys[k] == kvp->key)
+			return k;
+	}
+}
+
+static u64 align_offset(u64 offset)
+{
+	return (offset + BSP_CACHE_ALIGN - 1) & ~(u64)(BSP_CACHE_ALIGN - 1);
+}
+
+static void push_bytes(u8 **data, const void *ptr, size_t n)
+{
+	if(n == 0)
+		return;
+	size_t size = buf_size(*data);
+	size_t capacity = buf_capacity(*data);
+	if(capacity - size < n)
+		buf_grow(*data, capacity > n ? capacity : n);
+	memcpy(*data + size, ptr, n);
+	buf_ptr(*data)->size = size + n;
+}
+
+// Appends n bytes at the aligned end of data and returns the offset they were written at.
+static u64 append(u8 **data, const void *ptr, size_t n)
+{
+	static const u8 zeros[BSP_CACHE_ALIGN];
+	push_bytes(data, zeros, align_offset(buf_size(*data)) - buf_size(*data));
+	u64 offset = buf_size(*data);
+	push_bytes(data, ptr, n);
+	return offset;
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int write_cache(BspMap *map, const CacheKey *key)
+{
+	EntityList *list = get_entities(map, NULL);
+	MapBrush *mapbrushes = get_map_brushes(map);
+	if(map->mapbrushes_malformed)
+		return 1;
+	LumpData *materials = get_lump(map, LUMP_MATERIALS);
+
+	CacheHeader h = { .ident = { 'B', 'S', 'P', 'C' }, .version = BSP_CACHE_VERSION };
+	h.file_size = key->file_size;
+	h.mtime = key->mtime;
+	h.header_hash = key->header_hash;
+	h.entity_count = list->entity_count;
+	h.keyvalue_count = list->keyvalue_count;
+	h.key_count = list->key_count;
+	h.material_count = materials->count;
+	h.brush_count = buf_size(mapbrushes);
+
+	// Strings first, the other sections refer to them by offset.
+	u8 *strings = NULL;
+	u32 *keys = malloc((list->key_count + 1) * sizeof(u32));
+	for(size_t i = 0; i < list->key_count; ++i)
+	{
+		keys[i] = buf_size(strings);
+		push_bytes(&strings, list->keys[i], strlen(list->keys[i]) + 1);
+	}
+	CacheEntity *entities = malloc((list->entity_count + 1) * sizeof(CacheEntity));
+	CacheKeyValue *keyvalues = malloc((list->keyvalue_count + 1) * sizeof(CacheKeyValue));
+	size_t kv = 0;
+	for(size_t i = 0; i < list->entity_count; ++i)
+	{
+		Entity *e = &list->entities[i];
+		entities[i].first_keyvalue = kv;
+		entities[i].keyvalue_count = e->keyvalue_count;
+		for(size_t j = 0; j < e->keyvalue_count; ++j, ++kv)
+		{
+			keyvalues[kv].key = key_index(list, &e->keyvalues[j]);
+			keyvalues[kv].value = buf_size(strings);
+			push_bytes(&strings, e->keyvalues[j].value, strlen(e->keyvalues[j].value) + 1);
+		}
+	}
+	h.strings_size = buf_size(strings);
+
+	CacheBrush *brushes = malloc((h.brush_count + 1) * sizeof(CacheBrush));
+	MapPlane *first_plane = h.brush_count ? mapbrushes[0].planes : NULL;
+	for(size_t i = 0; i < h.brush_count; ++i)
+	{
+		vec3_dup(brushes[i].mins, mapbrushes[i].mins);
+		vec3_dup(brushes[i].maxs, mapbrushes[i].maxs);
+		brushes[i].first_plane = mapbrushes[i].planes - first_plane;
+		brushes[i].plane_count = mapbrushes[i].plane_count;
+		h.plane_count = brushes[i].first_plane + brushes[i].plane_count;
+	}
+
+	u8 *data = NULL;
+	append(&data, &h, sizeof(h));
+	h.entities_offset = append(&data, entities, h.entity_count * sizeof(CacheEntity));
+	h.keyvalues_offset = append(&data, keyvalues, h.keyvalue_count * sizeof(CacheKeyValue));
+	h.keys_offset = append(&data, keys, h.key_count * sizeof(u32));
+	h.strings_offset = append(&data, strings, h.strings_size);
+	h.materials_offset = append(&data, materials->data, h.material_count * sizeof(dmaterial_t));
+	h.brushes_offset = append(&data, brushes, h.brush_count * sizeof(CacheBrush));
+	h.planes_offset = append(&data, first_plane, h.plane_count * sizeof(MapPlane));
+	h.size = buf_size(data);
+	memcpy(data, &h, sizeof(h));
+
+	free(keys);
+	free(entities);
+	free(keyvalues);
+	free(brushes);
+	buf_free(strings);
+
+	// Written to a temporary file first so a reader never sees a partial cache.
+	char path[300], tmp[310];
+	cache_path(map, path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	Stream out;
+	int status = 1;
+	if(!stream_open_file(&out, tmp, "wb"))
+	{
+		bool written = stream_write_buffer(&out, data, buf_size(data)) == 1;
+		if(!stream_close_file(&out) && written)
+		{
+#ifdef _WIN32
+			remove(path);
+#endif
+			status = rename(tmp, path) ? 1 : 0;
+		}
+		if(status)
+			remove(tmp);
+	}
+	buf_free(data);
+	return status;
+}
+
+int bsp_use_cache(BspMap *map)
+{
+	CacheKey key;
+	if(cache_key(map, &key))
+		return 1;
+	if(!load_cache(map, &key))
+		return 0;
+	return write_cache(map, &key);
+}
@@ -0,0 +1,443 @@
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "bsp_internal.h"
+#include "thread.h"
+
+static bool portal_valid(const DiskGfxPortal *portal, size_t cell_count, size_t vertex_count)
+{
+	return portal->cellIndex < cell_count && portal->portalVertexCount >= 3 &&
+		   (u64)portal->firstPortalVertex + portal->portalVertexCount <= vertex_count;
+}
+
+static void build_cell_graph(BspMap *map, BspCellGraph *graph)
+{
+	load_lumps(map, (int[]) { LUMP_CELLS, LUMP_PORTALS, LUMP_PORTALVERTS }, 3);
+	LumpData *cells = get_lump(map, LUMP_CELLS);
+	LumpData *portals = get_lump(map, LUMP_PORTALS);
+	LumpData *vertices = get_lump(map, LUMP_PORTALVERTS);
+	const DiskGfxPortal *src = portals->data;
+	graph->cell_count = (u32)cells->count;
+	graph->offsets = malloc((cells->count + 1) * sizeof(u32));
+	// Counted first, the portal ranges of the cells may overlap.
+	for(int pass = 0; pass < 2; ++pass)
+	{
+		u32 edges = 0;
+		for(size_t i = 0; i < cells->count; ++i)
+		{
+			const DiskGfxCell *cell = &((const DiskGfxCell *)cells->data)[i];
+			graph->offsets[i] = edges;
+			if(cell->firstPortal < 0 || cell->portalCount < 0)
+				continue;
+			for(s32 k = 0; k < cell->portalCount && (size_t)cell->firstPortal + k < portals->count; ++k)
+			{
+				u32 index = (u32)(cell->firstPortal + k);
+				if(!portal_valid(&src[index], cells->count, vertices->count))
+					continue;
+				if(pass == 1)
+				{
+					graph->targets[edges] = src[index].cellIndex;
+					graph->portals[edges] = index;
+				}
+				++edges;
+			}
+		}
+		graph->offsets[cells->count] = edges;
+		graph->edge_count = edges;
+		if(pass == 0)
+		{
+			graph->targets = malloc((edges + 1) * sizeof(u32));
+			graph->portals = malloc((edges + 1) * sizeof(u32));
+		}
+	}
+}
+
+const BspCellGraph *bsp_cell_graph(BspMap *map)
+{
+	if(!map->cell_graph)
+	{
+		map->cell_graph = calloc(1, sizeof(BspCellGraph));
+		build_cell_graph(map, map->cell_graph);
+	}
+	return map->cell_graph;
+}
+
+void free_cell_graph(BspCellGraph *graph)
+{
+	free(graph->offsets);
+	free(graph->targets);
+	free(graph->portals);
+	free(graph);
+}
+
+// Breadth first from every start at once, a cell is marked when marks[cell] == mark.
+// Returns the number of cells reached, distances may be NULL.
+static u32 flood(const BspCellGraph *g, const s32 *starts, size_t start_count, u32 max_depth, u32 *marks, u32 mark, u32 *queue, s32 *distances)
+{
+	u32 tail = 0;
+	for(size_t i = 0; i < start_count; ++i)
+	{
+		s32 s = starts[i];
+		if(s < 0 || (u32)s >= g->cell_count || marks[s] == mark)
+			continue;
+		marks[s] = mark;
+		queue[tail++] = (u32)s;
+		if(distances)
+			distances[s] = 0;
+	}
+	u32 head = 0, level_end = tail, depth = 0;
+	while(head < tail)
+	{
+		if(head == level_end)
+		{
+			++depth;
+			level_end = tail;
+		}
+		if(max_depth && depth >= max_depth)
+			break;
+		u32 cell = queue[head++];
+		for(u32 e = g->offsets[cell]; e < g->offsets[cell + 1]; ++e)
+		{
+			u32 next = g->targets[e];
+			if(marks[next] == mark)
+				continue;
+			marks[next] = mark;
+			queue[tail++] = next;
+			if(distances)
+				distances[next] = (s32)depth + 1;
+		}
+	}
+	return tail;
+}
+
+void bsp_cell_flood(BspMap *map, const s32 *starts, size_t start_count, u32 max_depth, s32 *distances)
+{
+	const BspCellGraph *g = bsp_cell_graph(map);
+	u32 *marks = calloc(g->cell_count + 1, sizeof(u32));
+	u32 *queue = malloc((g->cell_count + 1) * sizeof(u32));
+	for(u32 i = 0; i < g->cell_count; ++i)
+		distances[i] = -1;
+	flood(g, starts, start_count, max_depth, marks, 1, queue, distances);
+	free(queue);
+	free(marks);
+}
+
+#define CELL_CHUNK_SIZE 64
+
+typedef struct
+{
+	const BspCellGraph *graph;
+	const s32 *starts;
+	size_t count;
+	u32 max_depth;
+	u32 *reached;
+} ReachQuery;
+
+static void reach_chunk(void *ctx, size_t chunk)
+{
+	ReachQuery *q = ctx;
+	u32 *marks = calloc(q->graph->cell_count + 1, sizeof(u32));
+	u32 *queue = malloc((q->graph->cell_count + 1) * sizeof(u32));
+	size_t begin = chunk * CELL_CHUNK_SIZE;
+	size_t end = begin + CELL_CHUNK_SIZE < q->count ? begin + CELL_CHUNK_SIZE : q->count;
+	for(size_t i = begin; i < end; ++i)
+		q->reached[i] = flood(q->graph, &q->starts[i], 1, q->max_depth, marks, (u32)(i - begin + 1), queue, NULL);
+	free(queue);
+	free(marks);
+}
+
+void bsp_cell_reach(BspMap *map, const s32 *starts, size_t count, u32 max_depth, size_t thread_count, u32 *reached)
+{
+	ReachQuery q = { .graph = bsp_cell_graph(map), .starts = starts, .count = count, .max_depth = max_depth, .reached = reached };
+	parallel_for((count + CELL_CHUNK_SIZE - 1) / CELL_CHUNK_SIZE, thread_count, reach_chunk, &q);
+}
+
+static u32 find_root(u32 *parents, u32 i)
+{
+	while(parents[i] != i)
+	{
+		parents[i] = parents[parents[i]];
+		i = parents[i];
+	}
+	return i;
+}
+
+u32 bsp_cell_components(BspMap *map, s32 *components)
+{
+	const BspCellGraph *g = bsp_cell_graph(map);
+	u32 *parents = malloc((g->cell_count + 1) * sizeof(u32));
+	for(u32 i = 0; i < g->cell_count; ++i)
+		parents[i] = i;
+	for(u32 cell = 0; cell < g->cell_count; ++cell)
+	{
+		for(u32 e = g->offsets[cell]; e < g->offsets[cell + 1]; ++e)
+		{
+			u32 a = find_root(parents, cell), b = find_root(parents, g->targets[e]);
+			if(a != b)
+				parents[a > b ? a : b] = a < b ? a : b;
+		}
+	}
+	// Components are numbered in the order of their first cell.
+	u32 count = 0;
+	for(u32 i = 0; i < g->cell_count; ++i)
+	{
+		u32 root = find_root(parents, i);
+		components[i] = root == i ? (s32)count++ : components[root];
+	}
+	free(parents);
+	return count;
+}
+
+#define VIEW_MAX_POINTS 64 // portals with more vertices than half of this pass the frustum on unclipped
+#define VIEW_MAX_DEPTH 1024
+#define VIEW_MAX_PORTALS 65536 // portals passed per view, stops runaway walks through heavily connected cells
+#define VIEW_EPSILON 0.01f
+#define VIEW_DEGREES_TO_RADIANS (3.14159265f / 180.f)
+
+typedef struct
+{
+	vec3 normal; // facing into the frustum
+	float dist;
+} ViewPlane;
+
+typedef struct
+{
+	const BspCellGraph *graph;
+	const DiskGfxPortal *portals;
+	const DiskGfxPortalVertex *vertices;
+	const BspView *views;
+	const s32 *cells; // start cell of every view
+	size_t count;
+	u32 *cell_counts;
+	u64 *cell_bits;
+} ViewQuery;
+
+// Scratch space for one step of the walk, kept on the heap so long chains of portals don't exhaust the stack.
+typedef struct
+{
+	vec3 a[VIEW_MAX_POINTS + 1], b[VIEW_MAX_POINTS + 1];
+	ViewPlane frustum[VIEW_MAX_POINTS + 1];
+} ViewLevel;
+
+typedef struct
+{
+	ViewQuery *q;
+	const float *origin;
+	u64 *seen;
+	u8 *in_path;
+	u32 portals_passed;
+	ViewLevel *levels[VIEW_MAX_DEPTH]; // allocated on first use
+} ViewWork;
+
+// Keeps the part of the polygon in front of the plane. A convex polygon gains at most one point,
+// a concave one from a broken file can gain more, anything past capacity points is dropped.
+static int clip_polygon(const vec3 *in, int count, const ViewPlane *plane, vec3 *out, int capacity)
+{
+	int n = 0;
+	for(int i = 0; i < count && n < capacity; ++i)
+	{
+		const float *a = in[i], *b = in[(i + 1) % count];
+		float da = vec3_mul_inner(plane->normal, a) - plane->dist;
+		float db = vec3_mul_inner(plane->normal, b) - plane->dist;
+		if(da >= 0.f)
+			vec3_dup(out[n++], a);
+		if((da >= 0.f) != (db >= 0.f) && n < capacity)
+		{
+			float t = da / (da - db);
+			for(int k = 0; k < 3; ++k)
+				out[n][k] = a[k] + t * (b[k] - a[k]);
+			++n;
+		}
+	}
+	return n;
+}
+
+static void view_cell(ViewWork *w, u32 cell, const ViewPlane *planes, int plane_count, int depth)
+{
+	const BspCellGraph *g = w->q->graph;
+	w->seen[cell >> 6] |= (u64)1 << (cell & 63);
+	if(depth >= VIEW_MAX_DEPTH)
+		return;
+	if(!w->levels[depth])
+		w->levels[depth] = malloc(sizeof(ViewLevel));
+	ViewLevel *level = w->levels[depth];
+	w->in_path[cell] = 1;
+	for(u32 e = g->offsets[cell]; e < g->offsets[cell + 1]; ++e)
+	{
+		u32 next = g->targets[e];
+		if(w->in_path[next] || w->portals_passed >= VIEW_MAX_PORTALS)
+			continue;
+		const DiskGfxPortal *portal = &w->q->portals[g->portals[e]];
+		const DiskGfxPortalVertex *src = &w->q->vertices[portal->firstPortalVertex];
+		int count = (int)portal->portalVertexCount;
+		if(count > VIEW_MAX_POINTS / 2)
+		{
+			++w->portals_passed;
+			view_cell(w, next, planes, plane_count, depth + 1);
+			continue;
+		}
+		for(int k = 0; k < count; ++k)
+			vec3_dup(level->a[k], src[k].xyz);
+		vec3 *poly = level->a, *scratch = level->b;
+		for(int i = 0; i < plane_count && count >= 3; ++i)
+		{
+			count = clip_polygon(poly, count, &planes[i], scratch, VIEW_MAX_POINTS);
+			vec3 *t = poly;
+			poly = scratch;
+			scratch = t;
+		}
+		if(count < 3)
+			continue;
+
+		// The new frustum runs from the origin through the edges of what is left of the portal,
+		// with the portal itself as the near plane.
+		vec3 center = { 0.f, 0.f, 0.f }, normal = { 0.f, 0.f, 0.f };
+		for(int k = 0; k < count; ++k)
+		{
+			const float *p = poly[k], *q = poly[(k + 1) % count];
+			vec3_add(center, center, p);
+			normal[0] += (p[1] - q[1]) * (p[2] + q[2]);
+			normal[1] += (p[2] - q[2]) * (p[0] + q[0]);
+			normal[2] += (p[0] - q[0]) * (p[1] + q[1]);
+		}
+		vec3_scale(center, center, 1.f / count);
+		float length = vec3_len(normal);
+		++w->portals_passed;
+		if(length < 1e-6f)
+			continue;
+		vec3_scale(normal, normal, 1.f / length);
+		float side = vec3_mul_inner(normal, w->origin) - vec3_mul_inner(normal, center);
+		// Standing in the portal sees through all of it.
+		if(fabsf(side) < VIEW_EPSILON)
+		{
+			view_cell(w, next, planes, plane_count, depth + 1);
+			continue;
+		}
+		ViewPlane *frustum = level->frustum;
+		int frustum_count = 0;
+		for(int k = 0; k < count; ++k)
+		{
+			vec3 ea, eb;
+			vec3_sub(ea, poly[k], w->origin);
+			vec3_sub(eb, poly[(k + 1) % count], w->origin);
+			ViewPlane *plane = &frustum[frustum_count];
+			vec3_mul_cross(plane->normal, ea, eb);
+			float plane_length = vec3_len(plane->normal);
+			if(plane_length < 1e-6f)
+				continue;
+			vec3_scale(plane->normal, plane->normal, 1.f / plane_length);
+			plane->dist = vec3_mul_inner(plane->normal, w->origin);
+			if(vec3_mul_inner(plane->normal, center) < plane->dist)
+			{
+				vec3_scale(plane->normal, plane->normal, -1.f);
+				plane->dist = -plane->dist;
+			}
+			++frustum_count;
+		}
+		ViewPlane *near = &frustum[frustum_count++];
+		vec3_scale(near->normal, normal, side > 0.f ? -1.f : 1.f);
+		near->dist = vec3_mul_inner(near->normal, center);
+		view_cell(w, next, frustum, frustum_count, depth + 1);
+	}
+	w->in_path[cell] = 0;
+}
+
+// The side planes of the view, none when it sees in every direction.
+static int view_frustum(const BspView *view, ViewPlane *planes)
+{
+	if(view->fov_x <= 0.f || view->fov_y <= 0.f)
+		return 0;
+	vec3 forward, right, up;
+	vec3_norm(forward, view->forward);
+	vec3_mul_cross(right, forward, (vec3) { 0.f, 0.f, 1.f });
+	// Looking straight up or down.
+	if(vec3_len(right) < 1e-6f)
+		vec3_dup(right, (vec3) { 0.f, -1.f, 0.f });
+	vec3_norm(right, right);
+	vec3_mul_cross(up, right, forward);
+	float hx = fminf(view->fov_x, 180.f) * 0.5f * VIEW_DEGREES_TO_RADIANS;
+	float hy = fminf(view->fov_y, 180.f) * 0.5f * VIEW_DEGREES_TO_RADIANS;
+	const float *axes[2] = { right, up };
+	float halves[2] = { hx, hy };
+	int n = 0;
+	for(int a = 0; a < 2; ++a)
+	{
+		for(int sign = -1; sign <= 1; sign += 2)
+		{
+			ViewPlane *plane = &planes[n++];
+			for(int k = 0; k < 3; ++k)
+				plane->normal[k] = sign * axes[a][k] * cosf(halves[a]) + forward[k] * sinf(halves[a]);
+			plane->dist = vec3_mul_inner(plane->normal, view->origin);
+		}
+	}
+	return n;
+}
+
+static void view_chunk(void *ctx, size_t chunk)
+{
+	ViewQuery *q = ctx;
+	size_t words = (q->graph->cell_count + 63) / 64;
+	ViewWork w = { .q = q };
+	w.seen = malloc((words + 1) * sizeof(u64));
+	w.in_path = calloc(q->graph->cell_count + 1, 1);
+	size_t begin = chunk * CELL_CHUNK_SIZE;
+	size_t end = begin + CELL_CHUNK_SIZE < q->count ? begin + CELL_CHUNK_SIZE : q->count;
+	for(size_t i = begin; i < end; ++i)
+	{
+		const BspView *view = &q->views[i];
+		memset(w.seen, 0, words * sizeof(u64));
+		s32 cell = q->cells[i];
+		if(cell >= 0 && (u32)cell < q->graph->cell_count)
+		{
+			ViewPlane planes[4];
+			int plane_count = view_frustum(view, planes);
+			w.origin = view->origin;
+			w.portals_passed = 0;
+			view_cell(&w, (u32)cell, planes, plane_count, 0);
+		}
+		u32 seen = 0;
+		for(size_t k = 0; k < words; ++k)
+			seen += popcount64(w.seen[k]);
+		q->cell_counts[i] = seen;
+		if(q->cell_bits)
+			memcpy(&q->cell_bits[i * words], w.seen, words * sizeof(u64));
+	}
+	for(int i = 0; i < VIEW_MAX_DEPTH; ++i)
+		free(w.levels[i]);
+	free(w.in_path);
+	free(w.seen);
+}
+
+void bsp_view_cells(BspMap *map, const BspView *views, size_t count, size_t thread_count, u32 *cell_counts, u64 *cell_bits)
+{
+	ViewQuery q = { .views = views, .count = count, .cell_counts = cell_counts, .cell_bits = cell_bits };
+	q.graph = bsp_cell_graph(map);
+	q.portals = get_lump(map, LUMP_PORTALS)->data;
+	q.vertices = get_lump(map, LUMP_PORTALVERTS)->data;
+
+	// Views without a cell are placed by the node tree.
+	s32 *cells = malloc((count + 1) * sizeof(s32));
+	vec3 *origins = malloc((count + 1) * sizeof(vec3));
+	size_t lookups = 0;
+	for(size_t i = 0; i < count; ++i)
+	{
+		cells[i] = views[i].cell;
+		if(cells[i] < 0)
+			vec3_dup(origins[lookups++], views[i].origin);
+	}
+	if(lookups > 0)
+	{
+		BspPointResult *located = malloc(lookups * sizeof(BspPointResult));
+		bsp_point_query(map, (const vec3 *)origins, lookups, 0, thread_count, located);
+		for(size_t i = 0, j = 0; i < count; ++i)
+		{
+			if(cells[i] < 0)
+				cells[i] = located[j++].cell;
+		}
+		free(located);
+	}
+	q.cells = cells;
+	parallel_for((count + CELL_CHUNK_SIZE - 1) / CELL_CHUNK_SIZE, thread_count, view_chunk, &q);
+	free(origins);
+	free(cells);
+}
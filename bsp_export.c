@@ -0,0 +1,770 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "bsp_internal.h"
+#include "thread.h"
+#include "stream_file.h"
+#include <growable-buf/buf.h>
+
+static void write_plane(Writer *w, const char *material, vec3 n, float dist, vec3 origin)
+{
+	vec3 tangent, bitangent;
+	vec3 up = { 0, 0, 1.f };
+	vec3 fw = { 0, 1.f, 0 };
+	float d = vec3_mul_inner(up, n);
+	if(fabs(d) < 0.01f)
+	{
+		vec3_mul_cross(tangent, n, up);
+	}
+	else
+	{
+		vec3_mul_cross(tangent, n, fw);
+	}
+	vec3_mul_cross(bitangent, n, tangent);
+
+	vec3 a, b, c;
+	vec3 t;
+	vec3_scale(a, n, dist);
+	vec3_scale(t, tangent, 100.f);
+	vec3_add(b, a, t);
+	vec3_scale(t, bitangent, 100.f);
+	vec3_add(c, a, t);
+
+	vec3 *points[] = { &c, &b, &a };
+	for(size_t i = 0; i < 3; ++i)
+	{
+		float *p = *points[i];
+		writer_string(w, " ( ");
+		writer_float(w, p[0] + origin[0]);
+		writer_string(w, " ");
+		writer_float(w, p[1] + origin[1]);
+		writer_string(w, " ");
+		writer_float(w, p[2] + origin[2]);
+		writer_string(w, " )");
+	}
+	writer_string(w, " ");
+	writer_string(w, material ? material : "caulk");
+	writer_string(w, " 128 128 0 0 0 0 lightmap_gray 16384 16384 0 0 0 0\n");
+}
+
+typedef struct
+{
+	s32 vertex[3];
+} Triangle;
+
+typedef struct
+{
+	Triangle *triangles;
+	s32 materialIndex;
+} Patch;
+
+static int triangle_vertex_compare(const void *a, const void *b)
+{
+	return (*(int *)a - *(int *)b);
+}
+
+// Open addressing set of triangles keyed by their sorted vertex indices.
+typedef struct
+{
+	Triangle *slots;
+	bool *used;
+	size_t capacity; // power of two
+	size_t count;
+} TriangleSet;
+
+static size_t triangle_hash(const s32 *v)
+{
+	u64 h = (u32)v[0];
+	h = h * 0x9E3779B97F4A7C15ull + (u32)v[1];
+	h = h * 0x9E3779B97F4A7C15ull + (u32)v[2];
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ull;
+	h ^= h >> 32;
+	return (size_t)h;
+}
+
+static void triangle_set_free(TriangleSet *set)
+{
+	free(set->slots);
+	free(set->used);
+	memset(set, 0, sizeof(*set));
+}
+
+static bool triangle_set_insert(TriangleSet *set, const Triangle *tri);
+
+static void triangle_set_grow(TriangleSet *set)
+{
+	TriangleSet grown = { 0 };
+	grown.capacity = set->capacity ? set->capacity * 2 : 1024;
+	grown.slots = malloc(grown.capacity * sizeof(Triangle));
+	grown.used = calloc(grown.capacity, sizeof(bool));
+	for(size_t i = 0; i < set->capacity; ++i)
+	{
+		if(set->used[i])
+			triangle_set_insert(&grown, &set->slots[i]);
+	}
+	triangle_set_free(set);
+	*set = grown;
+}
+
+// vertices should be sorted, returns false if the triangle was already in the set
+static bool triangle_set_insert(TriangleSet *set, const Triangle *tri)
+{
+	if((set->count + 1) * 2 > set->capacity)
+		triangle_set_grow(set);
+	size_t mask = set->capacity - 1;
+	size_t i = triangle_hash(tri->vertex) & mask;
+	while(set->used[i])
+	{
+		Triangle *other = &set->slots[i];
+		if(other->vertex[0] == tri->vertex[0] && other->vertex[1] == tri->vertex[1] && other->vertex[2] == tri->vertex[2])
+			return false;
+		i = (i + 1) & mask;
+	}
+	set->used[i] = true;
+	set->slots[i] = *tri;
+	++set->count;
+	return true;
+}
+
+static bool vec3_fuzzy_zero(float *v)
+{
+	float e = 0.0001f;
+	return fabs(v[0]) < e && fabs(v[1]) < e && fabs(v[2]) < e;
+}
+
+static void write_patch_vertex(Writer *w, DiskCollisionVertex *v)
+{
+	writer_string(w, "	v ");
+	writer_float(w, v->xyz[0]);
+	writer_string(w, " ");
+	writer_float(w, v->xyz[1]);
+	writer_string(w, " ");
+	writer_float(w, v->xyz[2]);
+	writer_string(w, " t -1024 1024 -4 4\n");
+}
+
+// Returns the number of duplicate triangles that were dropped.
+static size_t write_patches(BspMap *map, Writer *w, BspModelStats *stats)
+{
+	LumpData *materiallump = get_lump(map, LUMP_MATERIALS);
+	dmaterial_t *materials = (dmaterial_t*)materiallump->data;
+	LumpData *vertexlump = get_lump(map, LUMP_COLLISIONVERTS);
+	DiskCollisionVertex *vertices = vertexlump->data;
+	LumpData *trilump = get_lump(map, LUMP_COLLISIONTRIS);
+	DiskCollisionTriangle *tris = trilump->data;
+	LumpData *aabbs = get_lump(map, LUMP_COLLISIONAABBS);
+	DiskCollisionAabbTree *collaabbtrees = aabbs->data;
+	LumpData *partitionlump = get_lump(map, LUMP_COLLISIONPARTITIONS);
+	DiskCollisionPartition *collpartitions = partitionlump->data;
+
+	Patch *patches = NULL;
+	Patch *patch = NULL;
+	TriangleSet seen = { 0 };
+	size_t duplicates = 0;
+
+	for(size_t i = 0; i < aabbs->count; ++i)
+	{
+		DiskCollisionAabbTree *tree = &collaabbtrees[i];
+		if(tree->childCount > 0)
+			continue;
+		// Leaves referencing a partition, triangle, vertex or material that doesn't exist are skipped.
+		if((u32)tree->u.partitionIndex >= partitionlump->count || tree->materialIndex < 0
+		   || (size_t)tree->materialIndex >= materiallump->count)
+			continue;
+		DiskCollisionPartition *part = &collpartitions[tree->u.partitionIndex];
+		if((u64)part->firstTriIndex + part->triCount > trilump->count)
+			continue;
+		bool created_new_patch = false;
+		if(part->triCount > 0)
+		{
+			for(size_t j = 0; j < part->triCount; ++j)
+			{
+				DiskCollisionTriangle *tri = &tris[part->firstTriIndex + j];
+				if(tri->vertIndices[0] >= vertexlump->count || tri->vertIndices[1] >= vertexlump->count
+				   || tri->vertIndices[2] >= vertexlump->count)
+					continue;
+
+				Triangle triangle;
+				triangle.vertex[0] = tri->vertIndices[0];
+				triangle.vertex[1] = tri->vertIndices[1];
+				triangle.vertex[2] = tri->vertIndices[2];
+
+				if(vec3_fuzzy_zero(vertices[triangle.vertex[0]].xyz)
+				   || vec3_fuzzy_zero(vertices[triangle.vertex[1]].xyz)
+				   || vec3_fuzzy_zero(vertices[triangle.vertex[2]].xyz))
+				{
+					continue;
+				}
+
+				if(patch && buf_size(patch->triangles) >= 7)
+				{
+					buf_push(patches, ((Patch) { .triangles = NULL, .materialIndex = tree->materialIndex }));
+					patch = &patches[buf_size(patches) - 1];
+					created_new_patch = true;
+				}
+				qsort(triangle.vertex, 3, sizeof(int), triangle_vertex_compare);
+
+				if(!triangle_set_insert(&seen, &triangle))
+				{
+					++duplicates;
+				}
+				else
+				{
+					if(!created_new_patch)
+					{
+						buf_push(patches, ((Patch) { .triangles = NULL, .materialIndex = tree->materialIndex }));
+						patch = &patches[buf_size(patches) - 1];
+						created_new_patch = true;
+					}
+					buf_push(patch->triangles, triangle);
+				}
+			}
+		}
+	}
+	
+	// TODO: better way of converting triangles into patches
+
+	for(size_t i = 0; i < buf_size(patches); ++i)
+	{
+		Patch *patch = &patches[i];
+		if(buf_size(patch->triangles) == 0)
+			continue;
+
+		writer_string(w, "  {\n");
+		writer_string(w, "   mesh\n");
+		writer_string(w, "   {\n");
+		writer_string(w, "   ");
+		writer_string(w, materials[patch->materialIndex].material);
+		writer_string(w, "\n");
+		// TODO: write contentFlags and contentFlags info
+		writer_string(w, "   lightmap_gray\n");
+		writer_string(w, "   ");
+		writer_int(w, buf_size(patch->triangles) * 2);
+		writer_string(w, " 2 16 8\n");
+
+		for(size_t j = 0; j < buf_size(patch->triangles); ++j)
+		{
+			Triangle *tri = &patch->triangles[j];
+			DiskCollisionVertex *v1 = &vertices[tri->vertex[0]];
+			DiskCollisionVertex *v2 = &vertices[tri->vertex[1]];
+			DiskCollisionVertex *v3 = &vertices[tri->vertex[2]];
+			writer_string(w, "   (\n");
+			write_patch_vertex(w, v1);
+			write_patch_vertex(w, v2);
+			writer_string(w, "   )\n");
+			writer_string(w, "   (\n");
+			write_patch_vertex(w, v3);
+			write_patch_vertex(w, v1);
+			writer_string(w, "   )\n");
+		}
+		writer_string(w, "   }\n");
+		writer_string(w, "  }\n");
+		++stats->patches;
+		stats->patch_triangles += buf_size(patch->triangles);
+	}
+	for(size_t i = 0; i < buf_size(patches); ++i)
+		buf_free(patches[i].triangles);
+	buf_free(patches);
+	triangle_set_free(&seen);
+	return duplicates;
+}
+
+// Vertices are compared on a 0.0001 grid, the same tolerance vec3_fuzzy_eq used for the pairwise comparison.
+#define PORTAL_QUANTIZE (10000.0)
+
+typedef struct
+{
+	s32 xyz[3];
+} QuantizedVertex;
+
+static int quantized_vertex_compare(const void *a, const void *b)
+{
+	const QuantizedVertex *va = a;
+	const QuantizedVertex *vb = b;
+	for(size_t k = 0; k < 3; ++k)
+	{
+		if(va->xyz[k] != vb->xyz[k])
+			return va->xyz[k] < vb->xyz[k] ? -1 : 1;
+	}
+	return 0;
+}
+
+// Order independent signature of a portal, the sorted list of its quantized vertices.
+typedef struct
+{
+	QuantizedVertex *vertices;
+	size_t count;
+	size_t hash;
+} PortalSignature;
+
+static void portal_signature(PortalSignature *sig, QuantizedVertex *storage, DiskGfxPortalVertex *vertices, size_t count)
+{
+	sig->vertices = storage;
+	sig->count = count;
+	for(size_t i = 0; i < count; ++i)
+	{
+		for(size_t k = 0; k < 3; ++k)
+			storage[i].xyz[k] = (s32)floor(vertices[i].xyz[k] * PORTAL_QUANTIZE + 0.5);
+	}
+	qsort(storage, count, sizeof(QuantizedVertex), quantized_vertex_compare);
+
+	u64 h = count;
+	for(size_t i = 0; i < count; ++i)
+	{
+		for(size_t k = 0; k < 3; ++k)
+		{
+			h = (h ^ (u32)storage[i].xyz[k]) * 0x100000001B3ull;
+		}
+	}
+	h ^= h >> 32;
+	sig->hash = (size_t)h;
+}
+
+static bool portal_signature_eq(PortalSignature *a, PortalSignature *b)
+{
+	return a->hash == b->hash && a->count == b->count
+		   && !memcmp(a->vertices, b->vertices, a->count * sizeof(QuantizedVertex));
+}
+
+static void write_portals(BspMap *map, Writer *w)
+{
+	LumpData *portallump = get_lump(map, LUMP_PORTALS);
+	DiskGfxPortal *portals = portallump->data;
+	DiskGfxPortalVertex *vertices = get_lump(map, LUMP_PORTALVERTS)->data;
+	DiskPlane *planes = (DiskPlane*)get_lump(map, LUMP_PLANES)->data;
+
+	size_t vertex_count = get_lump(map, LUMP_PORTALVERTS)->count;
+	size_t plane_count = get_lump(map, LUMP_PLANES)->count;
+
+	size_t total_vertices = 0;
+	for(size_t i = 0; i < portallump->count; ++i)
+		total_vertices += portals[i].portalVertexCount;
+	QuantizedVertex *storage = malloc((total_vertices + 1) * sizeof(QuantizedVertex));
+	PortalSignature *signatures = malloc((portallump->count + 1) * sizeof(PortalSignature));
+
+	// Open addressing table of the portals written so far.
+	size_t capacity = 16;
+	while(capacity < portallump->count * 2)
+		capacity *= 2;
+	s32 *written = malloc(capacity * sizeof(s32));
+	memset(written, -1, capacity * sizeof(s32));
+
+	size_t offset = 0;
+	for(size_t i = 0; i < portallump->count; ++i)
+	{
+		DiskGfxPortal *portal = &portals[i];
+		PortalSignature *sig = &signatures[i];
+		sig->count = 0;
+		sig->hash = 0;
+		if(portal->portalVertexCount < 3 || portal->planeIndex >= plane_count
+		   || (u64)portal->firstPortalVertex + portal->portalVertexCount > vertex_count)
+			continue;
+		portal_signature(sig, &storage[offset], &vertices[portal->firstPortalVertex], portal->portalVertexCount);
+		offset += portal->portalVertexCount;
+
+		bool found = false;
+		size_t slot = sig->hash & (capacity - 1);
+		while(written[slot] != -1)
+		{
+			if(portal_signature_eq(&signatures[written[slot]], sig))
+			{
+				found = true;
+				break;
+			}
+			slot = (slot + 1) & (capacity - 1);
+		}
+		if(found)
+			continue;
+		written[slot] = i;
+		writer_string(w, "{\n");
+
+		DiskPlane *plane = &planes[portal->planeIndex];
+
+		vec3 portal_normal;
+		triangle_normal(portal_normal, vertices[portal->firstPortalVertex].xyz, vertices[portal->firstPortalVertex + 1].xyz, vertices[portal->firstPortalVertex + 2].xyz);
+		float portal_distance = vec3_mul_inner(portal_normal, vertices[portal->firstPortalVertex].xyz);
+
+		write_plane(w, "portal", portal_normal, portal_distance, (vec3) { 0.f, 0.f, 0.f });
+		for(int k = 0; k < 3; ++k)
+			portal_normal[k] = -portal_normal[k];
+		write_plane(w, "portal_nodraw", portal_normal, -portal_distance + 8.f, (vec3) { 0.f, 0.f, 0.f });
+		for(size_t i = 0; i < portal->portalVertexCount; ++i)
+		{
+			DiskGfxPortalVertex *a = &vertices[portal->firstPortalVertex + i];
+			int next_idx = i + 1 >= portal->portalVertexCount ? 0 : i + 1;
+			DiskGfxPortalVertex *b = &vertices[portal->firstPortalVertex + next_idx];
+
+			vec3 ba;
+			vec3_sub(ba, b->xyz, a->xyz);
+			vec3_norm(ba, ba);
+			vec3 n;
+			vec3_mul_cross(n, ba, plane->normal);
+
+			float d = vec3_mul_inner(n, a->xyz);
+			for(int k = 0; k < 3; ++k)
+				n[k] = -n[k];
+			write_plane(w, "portal_nodraw", n, -d, (vec3) { 0.f, 0.f, 0.f });
+		}
+		writer_string(w, "}\n");
+	}
+	free(written);
+	free(signatures);
+	free(storage);
+}
+
+static bool ignore_material(const char *material)
+{
+	static const char *ignored[] = { "portal", "portal_nodraw", NULL };
+	for(size_t i = 0; ignored[i]; ++i)
+	{
+		if(!strcmp(material, ignored[i]))
+			return true;
+	}
+	return false;
+}
+
+typedef struct
+{
+	MapBrush *brush;
+	vec3 origin;
+} BrushJob;
+
+// Brushes are formatted in chunks so the text can be produced out of order and written back in order.
+#define BRUSH_CHUNK_SIZE (64)
+
+typedef struct
+{
+	BrushJob *jobs;
+	dmaterial_t *materials;
+	int float_format;
+	size_t portal_jobs; // leading world jobs whose portal brushes are dropped, the portal lump is written instead
+	char **chunks;
+	size_t *offsets; // end of each job's text inside its chunk
+} BrushExport;
+
+static size_t queue_brushes(BspMap *map, BrushExport *ex, dmodel_t *model, vec3 origin)
+{
+	MapBrush *mapbrushes = get_map_brushes(map);
+	size_t first = buf_size(ex->jobs);
+	for(size_t i = 0; i < model->numBrushes; ++i)
+	{
+		BrushJob job = { .brush = &mapbrushes[model->firstBrush + i] };
+		vec3_dup(job.origin, origin);
+		buf_push(ex->jobs, job);
+	}
+	return first;
+}
+
+static void add_model_stats(BspMap *map, dmodel_t *models, int modelidx, size_t entity)
+{
+	MapBrush *mapbrushes = get_map_brushes(map);
+	dmodel_t *model = &models[modelidx];
+	BspModelStats m = { .model = modelidx, .entity = entity, .brushes = model->numBrushes, .surfaces = model->numSurfaces };
+	for(size_t i = 0; i < model->numBrushes; ++i)
+		m.sides += mapbrushes[model->firstBrush + i].plane_count;
+	buf_push(map->stats.models, m);
+	map->stats.model_count = buf_size(map->stats.models);
+}
+
+// A brush made only of portal faces, these are replaced by the brushes written from the portal lump.
+static bool portal_brush(BrushExport *ex, Polygon *polys)
+{
+	if(buf_size(polys) == 0)
+		return false;
+	for(size_t i = 0; i < buf_size(polys); ++i)
+	{
+		if(!ignore_material(ex->materials[polys[i].plane->materialIndex].material))
+			return false;
+	}
+	return true;
+}
+
+static void format_brush_chunk(void *ctx, size_t chunk)
+{
+	BrushExport *ex = ctx;
+	size_t begin = chunk * BRUSH_CHUNK_SIZE;
+	size_t end = begin + BRUSH_CHUNK_SIZE;
+	if(end > buf_size(ex->jobs))
+		end = buf_size(ex->jobs);
+
+	Writer w;
+	writer_init(&w, NULL, ex->float_format);
+	for(size_t i = begin; i < end; ++i)
+	{
+		BrushJob *job = &ex->jobs[i];
+		Polygon *polys = NULL;
+		polygonize_brush(job->brush, &polys);
+		if(i < ex->portal_jobs && portal_brush(ex, polys))
+		{
+			free_polygons(polys);
+			ex->offsets[i] = buf_size(w.data);
+			continue;
+		}
+		writer_string(&w, "{\n");
+		for(size_t j = 0; j < buf_size(polys); ++j)
+		{
+			Polygon *poly = &polys[j];
+			MapPlane *plane = poly->plane;
+			write_plane(&w, ex->materials[plane->materialIndex].material, plane->normal, plane->distance, job->origin);
+		}
+		free_polygons(polys);
+		writer_string(&w, "}\n");
+		ex->offsets[i] = buf_size(w.data);
+	}
+	ex->chunks[chunk] = w.data;
+}
+
+// Returns the CPU seconds used by the threads other than the calling one.
+static double format_brushes(BrushExport *ex, size_t thread_count)
+{
+	size_t chunk_count = (buf_size(ex->jobs) + BRUSH_CHUNK_SIZE - 1) / BRUSH_CHUNK_SIZE;
+	ex->chunks = calloc(chunk_count + 1, sizeof(char *));
+	ex->offsets = calloc(buf_size(ex->jobs) + 1, sizeof(size_t));
+	return parallel_for_cpu(chunk_count, thread_count, format_brush_chunk, ex);
+}
+
+static void free_brush_export(BrushExport *ex)
+{
+	size_t chunk_count = (buf_size(ex->jobs) + BRUSH_CHUNK_SIZE - 1) / BRUSH_CHUNK_SIZE;
+	for(size_t i = 0; i < chunk_count; ++i)
+		buf_free(ex->chunks[i]);
+	free(ex->chunks);
+	free(ex->offsets);
+	buf_free(ex->jobs);
+}
+
+static void write_brushes(Writer *w, BrushExport *ex, size_t first, size_t count)
+{
+	size_t i = first;
+	size_t end = first + count;
+	while(i < end)
+	{
+		size_t chunk = i / BRUSH_CHUNK_SIZE;
+		size_t chunk_end = (chunk + 1) * BRUSH_CHUNK_SIZE;
+		size_t last = (end < chunk_end ? end : chunk_end) - 1;
+		size_t from = i % BRUSH_CHUNK_SIZE == 0 ? 0 : ex->offsets[i - 1];
+		writer_write(w, ex->chunks[chunk] + from, ex->offsets[last] - from);
+		i = last + 1;
+	}
+}
+
+static bool entity_brush_model(Entity *e, int *modelidx, vec3 origin)
+{
+	const char *classname = entity_key_by_value(e, "classname");
+	bool has_brushes = classname && (!strcmp(classname, "script_brushmodel") || strstr(classname, "trigger_"));
+	if(!has_brushes)
+		return false;
+	const char *modelstr = entity_key_by_value(e, "model");
+	if(!modelstr)
+		return false;
+	origin[0] = origin[1] = origin[2] = 0.f;
+	const char *originstr = entity_key_by_value(e, "origin");
+	if(originstr)
+	{
+		sscanf(originstr, "%f %f %f", &origin[0], &origin[1], &origin[2]);
+	}
+	*modelidx = 0;
+	sscanf(modelstr, "*%d", modelidx);
+	return true;
+}
+
+// Keys and values can't hold a quote, the parser ends them at the first one, so they are written as they are.
+static void write_key_value(Writer *w, KeyValuePair *kvp)
+{
+	writer_string(w, "\"");
+	writer_string(w, kvp->key);
+	writer_string(w, "\" \"");
+	writer_string(w, kvp->value);
+	writer_string(w, "\"\n");
+}
+
+static bool model_in_range(BspMap *map, size_t model_count, int modelidx)
+{
+	if(modelidx < 0 || (size_t)modelidx >= model_count)
+		return false;
+	dmodel_t *model = &((dmodel_t *)get_lump(map, LUMP_MODELS)->data)[modelidx];
+	size_t brush_count = buf_size(map->mapbrushes);
+	return model->firstBrush <= brush_count && model->numBrushes <= brush_count - model->firstBrush;
+}
+
+// Checks the entities and the models they reference before anything is written, the reason goes to log.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int validate_export(BspMap *map, EntityList *list, Writer *log)
+{
+	get_map_brushes(map);
+	if(map->mapbrushes_malformed)
+	{
+		writer_printf(log, "%s\n", map->error);
+		return 1;
+	}
+	if(list->entity_count == 0)
+	{
+		writer_printf(log, "Missing the worldspawn entity\n");
+		return 1;
+	}
+	size_t model_count = get_lump(map, LUMP_MODELS)->count;
+	if(!model_in_range(map, model_count, 0))
+	{
+		writer_printf(log, "The world model has brushes out of range\n");
+		return 1;
+	}
+	for(size_t i = 1; i < list->entity_count; ++i)
+	{
+		int modelidx;
+		vec3 origin;
+		if(entity_brush_model(&list->entities[i], &modelidx, origin) && !model_in_range(map, model_count, modelidx))
+		{
+			writer_printf(log, "Entity %zu references model %d which is missing or has brushes out of range\n", i, modelidx);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int bsp_export_map_stream(BspMap *map, Stream *out, const BspExportOptions *opts, Writer *log)
+{
+	Writer discard;
+	if(!log)
+	{
+		writer_init(&discard, NULL, WRITER_FLOAT_FIXED);
+		log = &discard;
+	}
+	// Everything the export reads. Entities and brushes that came from the cache don't need their lumps,
+	// the collision lumps are only needed for patches and the portal lumps for portals.
+	static const int lumps[] = { LUMP_MODELS, LUMP_MATERIALS };
+	static const int brush_lumps[] = { LUMP_BRUSHES, LUMP_BRUSHSIDES, LUMP_PLANES };
+	static const int patch_lumps[] = { LUMP_COLLISIONVERTS, LUMP_COLLISIONTRIS, LUMP_COLLISIONAABBS, LUMP_COLLISIONPARTITIONS };
+	static const int portal_lumps[] = { LUMP_PORTALS, LUMP_PORTALVERTS, LUMP_PLANES };
+	int types[LUMP_MAX];
+	size_t type_count = 0;
+	for(size_t i = 0; i < sizeof(lumps) / sizeof(lumps[0]); ++i)
+		types[type_count++] = lumps[i];
+	if(!map->entities_parsed)
+		types[type_count++] = LUMP_ENTITIES;
+	for(size_t i = 0; !map->mapbrushes_loaded && i < sizeof(brush_lumps) / sizeof(brush_lumps[0]); ++i)
+		types[type_count++] = brush_lumps[i];
+	for(size_t i = 0; !opts->exclude_patches && i < sizeof(patch_lumps) / sizeof(patch_lumps[0]); ++i)
+		types[type_count++] = patch_lumps[i];
+	for(size_t i = 0; !opts->original_brush_portals && i < sizeof(portal_lumps) / sizeof(portal_lumps[0]); ++i)
+		types[type_count++] = portal_lumps[i];
+	if(load_lumps(map, types, type_count))
+	{
+		writer_printf(log, "Failed to read the lumps\n");
+		if(log == &discard)
+			writer_free(&discard);
+		return 1;
+	}
+	EntityList *list = get_entities(map, log);
+	if(validate_export(map, list, log))
+	{
+		if(log == &discard)
+			writer_free(&discard);
+		return 1;
+	}
+	Entity *entities = list->entities;
+	dmodel_t *models = get_lump(map, LUMP_MODELS)->data;
+
+	// Queue the brushes of every model in the order they are written and format them up front.
+	BrushExport ex = { .float_format = opts->float_format };
+	ex.materials = get_lump(map, LUMP_MATERIALS)->data;
+	size_t *first_job = calloc(list->entity_count + 1, sizeof(size_t));
+	size_t *job_count = calloc(list->entity_count + 1, sizeof(size_t));
+	first_job[0] = queue_brushes(map, &ex, &models[0], (vec3) { 0.f, 0.f, 0.f });
+	job_count[0] = models[0].numBrushes;
+	if(!opts->original_brush_portals)
+		ex.portal_jobs = job_count[0];
+	buf_clear(map->stats.models);
+	add_model_stats(map, models, 0, 0);
+	for(size_t i = 1; i < list->entity_count; ++i)
+	{
+		int modelidx;
+		vec3 origin;
+		if(entity_brush_model(&entities[i], &modelidx, origin))
+		{
+			first_job[i] = queue_brushes(map, &ex, &models[modelidx], origin);
+			job_count[i] = models[modelidx].numBrushes;
+			add_model_stats(map, models, modelidx, i);
+		}
+	}
+	int previous = stats_enter(map, BSP_PHASE_POLYGONIZE);
+	stats_add_cpu(map, format_brushes(&ex, opts->thread_count));
+	stats_leave(map, previous);
+
+	previous = stats_enter(map, BSP_PHASE_WRITE);
+	Writer w;
+	writer_init(&w, out, opts->float_format);
+	Entity *worldspawn = &entities[0];
+	writer_printf(&w, "iwmap 4\n");
+	writer_printf(&w, "// entity 0\n{\n");
+	for(size_t i = 0; i < worldspawn->keyvalue_count; ++i)
+	{
+		KeyValuePair *kvp = &worldspawn->keyvalues[i];
+		write_key_value(&w, kvp);
+	}
+
+	write_brushes(&w, &ex, first_job[0], job_count[0]);
+	if(!opts->original_brush_portals)
+		write_portals(map, &w);
+
+	if(!opts->exclude_patches)
+	{
+		int write_phase = stats_enter(map, BSP_PHASE_PATCHES);
+		size_t duplicates = write_patches(map, &w, &map->stats.models[0]);
+		stats_leave(map, write_phase);
+		writer_printf(log, "Dropped %zu duplicate patch triangles\n", duplicates);
+	}
+	writer_printf(&w, "}\n");
+	for(size_t i = 1; i < list->entity_count; ++i)
+	{
+		Entity *e = &entities[i];
+		writer_printf(&w, "// entity %zu\n{\n", i);
+
+		int modelidx;
+		vec3 origin;
+		bool has_brushes = entity_brush_model(e, &modelidx, origin);
+		for(size_t j = 0; j < e->keyvalue_count; ++j)
+		{
+			KeyValuePair *kvp = &e->keyvalues[j];
+			if(has_brushes)
+			{
+				if(!strcmp(kvp->key, "origin") || !strcmp(kvp->key, "model"))
+					continue;
+			}
+			write_key_value(&w, kvp);
+		}
+		if(has_brushes)
+		{
+			write_brushes(&w, &ex, first_job[i], job_count[i]);
+		}
+		writer_printf(&w, "}\n");
+	}
+	writer_free(&w);
+	stats_leave(map, previous);
+	free(first_job);
+	free(job_count);
+	free_brush_export(&ex);
+	if(w.error)
+		writer_printf(log, "Failed to write the map\n");
+	if(log == &discard)
+		writer_free(&discard);
+	return w.error ? 1 : 0;
+}
+
+int bsp_export_map(BspMap *map, const char *path, const BspExportOptions *opts, Writer *log)
+{
+	Stream out;
+	if(stream_open_file(&out, path, "w"))
+	{
+		if(log)
+			writer_printf(log, "Failed to open '%s'\n", path);
+		return 1;
+	}
+	if(log)
+		writer_printf(log, "Exporting to '%s'\n", path);
+	int status = bsp_export_map_stream(map, &out, opts, log);
+	if(stream_close_file(&out))
+		status = 1;
+	return status;
+}
@@ -0,0 +1,252 @@
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "bsp_internal.h"
+#include <growable-buf/buf.h>
+
+void planes_from_aabb(vec3 mins, vec3 maxs, DiskPlane planes[6])
+{
+	planes[0].normal[0] = -1.0f;
+	planes[0].normal[1] = 0.0f;
+	planes[0].normal[2] = 0.0f;
+	planes[0].dist = -mins[0];
+
+	planes[1].normal[0] = 1.0f;
+	planes[1].normal[1] = 0.0f;
+	planes[1].normal[2] = 0.0f;
+	planes[1].dist = maxs[0];
+
+	planes[2].normal[0] = 0.0f;
+	planes[2].normal[1] = -1.0f;
+	planes[2].normal[2] = 0.0f;
+	planes[2].dist = -mins[1];
+
+	planes[3].normal[0] = 0.0f;
+	planes[3].normal[1] = 1.0f;
+	planes[3].normal[2] = 0.0f;
+	planes[3].dist = maxs[1];
+
+	planes[4].normal[0] = 0.0f;
+	planes[4].normal[1] = 0.0f;
+	planes[4].normal[2] = -1.0f;
+	planes[4].dist = -mins[2];
+
+	planes[5].normal[0] = 0.0f;
+	planes[5].normal[1] = 0.0f;
+	planes[5].normal[2] = 1.0f;
+	planes[5].dist = maxs[2];
+}
+
+void map_planes_from_aabb(vec3 mins, vec3 maxs, MapPlane planes[6])
+{
+	planes[0].normal[0] = -1.0f;
+	planes[0].normal[1] = 0.0f;
+	planes[0].normal[2] = 0.0f;
+	planes[0].distance = -mins[0];
+
+	planes[1].normal[0] = 1.0f;
+	planes[1].normal[1] = 0.0f;
+	planes[1].normal[2] = 0.0f;
+	planes[1].distance = maxs[0];
+
+	planes[2].normal[0] = 0.0f;
+	planes[2].normal[1] = -1.0f;
+	planes[2].normal[2] = 0.0f;
+	planes[2].distance = -mins[1];
+
+	planes[3].normal[0] = 0.0f;
+	planes[3].normal[1] = 1.0f;
+	planes[3].normal[2] = 0.0f;
+	planes[3].distance = maxs[1];
+
+	planes[4].normal[0] = 0.0f;
+	planes[4].normal[1] = 0.0f;
+	planes[4].normal[2] = -1.0f;
+	planes[4].distance = -mins[2];
+
+	planes[5].normal[0] = 0.0f;
+	planes[5].normal[1] = 0.0f;
+	planes[5].normal[2] = 1.0f;
+	planes[5].distance = maxs[2];
+}
+
+void triangle_normal(vec3 n, const vec3 a, const vec3 b, const vec3 c)
+{
+    vec3 e1, e2;
+    vec3_sub(e1, b, a);
+    vec3_sub(e2, c, a);
+    vec3_mul_cross(n, e1, e2);
+    vec3_norm(n, n);
+}
+
+#define buf_set_size(v, new_size)                                                                               \
+	do                                                                                                          \
+	{                                                                                                           \
+		if(v)                                                                                                   \
+		{                                                                                                       \
+			buf_ptr((v))->size = (size_t)new_size > buf_ptr((v))->capacity ? buf_ptr((v))->capacity : new_size; \
+		}                                                                                                       \
+	} while(0)
+
+// Half extent of the initial winding, larger than any coordinate in a map.
+#define WINDING_RANGE (131072.0)
+#define WINDING_EPSILON (0.008)
+
+typedef double WindingPoint[3];
+
+// Large quad lying on the plane, wound the same way as the face it will become.
+static size_t base_winding_for_plane(WindingPoint *points, vec3 normal, float dist)
+{
+	size_t axis = 0;
+	double max = -1.0;
+	for(size_t i = 0; i < 3; ++i)
+	{
+		double v = fabs(normal[i]);
+		if(v > max)
+		{
+			axis = i;
+			max = v;
+		}
+	}
+
+	double up[3] = { 0.0, 0.0, 0.0 };
+	if(axis == 2)
+		up[0] = 1.0;
+	else
+		up[2] = 1.0;
+
+	double d = up[0] * normal[0] + up[1] * normal[1] + up[2] * normal[2];
+	for(size_t i = 0; i < 3; ++i)
+		up[i] -= d * normal[i];
+	double len = sqrt(up[0] * up[0] + up[1] * up[1] + up[2] * up[2]);
+	for(size_t i = 0; i < 3; ++i)
+		up[i] = up[i] / len * WINDING_RANGE;
+
+	double right[3] = {
+		(up[1] * normal[2] - up[2] * normal[1]),
+		(up[2] * normal[0] - up[0] * normal[2]),
+		(up[0] * normal[1] - up[1] * normal[0])
+	};
+
+	for(size_t i = 0; i < 3; ++i)
+	{
+		double org = normal[i] * dist;
+		points[0][i] = org - right[i] + up[i];
+		points[1][i] = org + right[i] + up[i];
+		points[2][i] = org + right[i] - up[i];
+		points[3][i] = org - right[i] - up[i];
+	}
+	return 4;
+}
+
+// Keeps the part of the winding behind the plane, returns the new point count.
+// dists and sides are scratch space for count + 1 entries.
+static size_t clip_winding(WindingPoint *out, WindingPoint *in, size_t count, vec3 normal, float dist, double *dists, int *sides)
+{
+	if(count == 0)
+		return 0;
+
+	size_t front = 0;
+	for(size_t i = 0; i < count; ++i)
+	{
+		dists[i] = in[i][0] * normal[0] + in[i][1] * normal[1] + in[i][2] * normal[2] - dist;
+		if(dists[i] > WINDING_EPSILON)
+		{
+			sides[i] = 1;
+			++front;
+		}
+		else if(dists[i] < -WINDING_EPSILON)
+			sides[i] = -1;
+		else
+			sides[i] = 0;
+	}
+	dists[count] = dists[0];
+	sides[count] = sides[0];
+
+	if(front == 0)
+	{
+		memcpy(out, in, count * sizeof(WindingPoint));
+		return count;
+	}
+
+	size_t n = 0;
+	for(size_t i = 0; i < count; ++i)
+	{
+		if(sides[i] <= 0)
+		{
+			memcpy(out[n++], in[i], sizeof(WindingPoint));
+		}
+		if(sides[i] == 0 || sides[i + 1] == 0 || sides[i + 1] == sides[i])
+			continue;
+
+		// Edge crosses the plane, emit the intersection.
+		double *p1 = in[i];
+		double *p2 = in[i + 1 == count ? 0 : i + 1];
+		double t = dists[i] / (dists[i] - dists[i + 1]);
+		for(size_t k = 0; k < 3; ++k)
+			out[n][k] = p1[k] + t * (p2[k] - p1[k]);
+		++n;
+	}
+	return n;
+}
+
+bool polygonize_brush(MapBrush *brush, Polygon **polygons_out)
+{
+	Polygon *polygons = NULL;
+	size_t plane_count = brush->plane_count;
+
+	// Every clip adds at most one point.
+	size_t max_points = plane_count + 4;
+	WindingPoint *a = malloc(max_points * sizeof(WindingPoint));
+	WindingPoint *b = malloc(max_points * sizeof(WindingPoint));
+	double *dists = malloc((max_points + 1) * sizeof(double));
+	int *sides = malloc((max_points + 1) * sizeof(int));
+
+	for(size_t i = 0; i < plane_count; ++i)
+	{
+		MapPlane *p0 = &brush->planes[i];
+		size_t count = base_winding_for_plane(a, p0->normal, p0->distance);
+
+		for(size_t j = 0; j < plane_count && count > 0; ++j)
+		{
+			if(j == i)
+				continue;
+			MapPlane *p1 = &brush->planes[j];
+			count = clip_winding(b, a, count, p1->normal, p1->distance, dists, sides);
+			WindingPoint *tmp = a;
+			a = b;
+			b = tmp;
+		}
+
+		if(count < 3)
+			continue;
+
+		Polygon polygon = { 0 };
+		polygon.plane = p0;
+		buf_grow(polygon.points, count);
+		buf_set_size(polygon.points, count);
+		for(size_t k = 0; k < count; ++k)
+		{
+			for(size_t m = 0; m < 3; ++m)
+				polygon.points[k][m] = (float)a[k][m];
+		}
+		buf_push(polygons, polygon);
+	}
+	free(a);
+	free(b);
+	free(dists);
+	free(sides);
+	*polygons_out = polygons;
+	return true;
+}
+
+void free_polygons(Polygon *polygons)
+{
+	for(size_t i = 0; i < buf_size(polygons); ++i)
+	{
+		buf_free(polygons[i].points);
+		buf_free(polygons[i].indices);
+		buf_free(polygons[i].uvs);
+	}
+	buf_free(polygons);
+}
@@ -0,0 +1,146 @@
+#pragma once
+#include "bsp.h"
+#include "file_map.h"
+#include "file_reader.h"
+#include <linmath.h/linmath.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+typedef struct
+{
+	vec3 normal;
+	float distance;
+	s32 materialIndex; // into LUMP_MATERIALS, the name is resolved when writing
+} MapPlane;
+
+typedef struct
+{
+	vec3 mins, maxs;
+	MapPlane *planes; // points into BspMap.mapplanes
+	size_t plane_count;
+} MapBrush;
+
+typedef struct
+{
+	vec3 *points;
+	uint32_t *indices;
+	vec2 *uvs;
+	MapPlane *plane;
+} Polygon;
+
+// Everything loaded from a single .d3dbsp, nothing here is shared between maps.
+struct BspMap
+{
+	char path[256];
+	char error[256];
+	dheader_t header;
+	s64 filelen;
+
+	// Lumps are either pointed to in memory, or read from the stream.
+	const u8 *memory;
+	FileMap filemap;
+	Stream filestream;
+	Stream *stream;
+	FileReader *reader; // only set while a preloading open reads the lumps
+	size_t reader_thread_count;
+	LumpData lumpdata[LUMP_MAX];
+
+	EntityList entities;
+	bool entities_parsed;
+
+	MapBrush *mapbrushes;
+	MapPlane *mapplanes; // NULL when the planes come from the cache
+	bool mapbrushes_loaded;
+	bool mapbrushes_malformed; // the brush lumps were broken, mapbrushes is empty and the reason is in error
+
+	FileMap cachemap;
+
+	struct PointNode *pointnodes; // NULL when the node tree is missing or broken
+	size_t pointnode_count;
+	bool pointnodes_built;
+
+	struct CollisionTree *collision;
+	BspCellGraph *cell_graph;
+
+	BspStats stats;
+	int phase; // the phase being timed, -1 for none
+	double wall_mark, cpu_mark; // when the current phase was last charged
+	s64 heap_mark;
+	long open_serial; // number of maps opened in the process up to and including this one
+};
+
+LumpData *get_lump(BspMap *map, int type);
+// Loads several lumps at once, lumps that aren't in memory are fetched with a single batched read.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+int load_lumps(BspMap *map, const int *types, size_t count);
+// Parses the entities on first use, parse errors go to log when this is the call that parses, log may be NULL.
+EntityList *get_entities(BspMap *map, Writer *log);
+MapBrush *get_map_brushes(BspMap *map);
+
+// Node of the BSP tree with its plane stored inline, children follow dnode_t.
+typedef struct PointNode
+{
+	vec3 normal;
+	float dist;
+	s32 children[2];
+} PointNode;
+
+PointNode *get_point_nodes(BspMap *map);
+
+// Node of the collision AABB tree with the partition resolved, children always come after their parent.
+typedef struct
+{
+	vec3 mins, maxs;
+	s32 first; // first child, or first triangle of a leaf
+	s32 count; // children, or triangles of a leaf
+	s32 material; // into LUMP_MATERIALS
+	bool leaf;
+} CollisionNode;
+
+typedef struct
+{
+	vec3 v0, e1, e2; // first vertex and the edges to the other two
+	vec3 normal;
+	s32 index; // into LUMP_COLLISIONTRIS
+} CollisionTriangle;
+
+typedef struct CollisionTree
+{
+	CollisionNode *nodes;
+	size_t node_count;
+	s32 *roots; // nodes that aren't the child of another node
+	size_t root_count;
+	CollisionTriangle *triangles; // stored per leaf, a triangle in several partitions is repeated
+	size_t triangle_count;
+} CollisionTree;
+
+CollisionTree *get_collision_tree(BspMap *map);
+void free_collision_tree(CollisionTree *tree);
+void free_cell_graph(BspCellGraph *graph);
+// Loads the entities, materials and brushes from the sidecar cache, or writes the cache when it is missing or stale.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+int bsp_use_cache(BspMap *map);
+
+// Starts timing a phase and returns the one that was running, which is resumed by passing it to stats_leave.
+int stats_enter(BspMap *map, int phase);
+void stats_leave(BspMap *map, int previous);
+// Counts towards the current phase, or towards loading when no phase is running.
+void stats_add_read(BspMap *map, u64 bytes);
+// CPU time spent for the current phase on threads other than the one running it.
+void stats_add_cpu(BspMap *map, double seconds);
+
+static inline u32 popcount64(u64 v)
+{
+#ifdef _MSC_VER
+	return (u32)__popcnt64(v);
+#else
+	return (u32)__builtin_popcountll(v);
+#endif
+}
+
+void planes_from_aabb(vec3 mins, vec3 maxs, DiskPlane planes[6]);
+void map_planes_from_aabb(vec3 mins, vec3 maxs, MapPlane planes[6]);
+void triangle_normal(vec3 n, const vec3 a, const vec3 b, const vec3 c);
+bool polygonize_brush(MapBrush *brush, Polygon **polygons_out);
+void free_polygons(Polygon *polygons);
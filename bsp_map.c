@@ -0,0 +1,738 @@
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include "bsp_internal.h"
+#include "stream_file.h"
+#include "timer.h"
+#include "process_stats.h"
+#include <growable-buf/buf.h>
+
+// Maps opened so far and maps open right now, over all threads.
+static volatile long maps_opened;
+static volatile long maps_open;
+
+static long atomic_add(volatile long *v, long delta)
+{
+#ifdef _MSC_VER
+	return _InterlockedExchangeAdd(v, delta) + delta;
+#else
+	return __atomic_add_fetch(v, delta, __ATOMIC_SEQ_CST);
+#endif
+}
+
+// Adds the time since the last charge to the current phase. CPU time is the calling thread's,
+// the heap and peak RSS belong to the process and so include any other map open at the same time.
+static void stats_charge(BspMap *map)
+{
+	double wall = timer_now();
+	double cpu = thread_cpu_time();
+	s64 heap = process_heap_in_use();
+	if(atomic_add(&maps_open, 0) > 1 || atomic_add(&maps_opened, 0) != map->open_serial)
+		map->stats.process_wide_memory = true;
+	if(map->phase >= 0)
+	{
+		BspPhaseStats *p = &map->stats.phases[map->phase];
+		p->wall += wall - map->wall_mark;
+		p->cpu += cpu - map->cpu_mark;
+		p->heap += heap - map->heap_mark;
+		p->peak_rss = process_peak_rss();
+	}
+	map->wall_mark = wall;
+	map->cpu_mark = cpu;
+	map->heap_mark = heap;
+}
+
+int stats_enter(BspMap *map, int phase)
+{
+	stats_charge(map);
+	int previous = map->phase;
+	map->phase = phase;
+	++map->stats.phases[phase].calls;
+	return previous;
+}
+
+void stats_leave(BspMap *map, int previous)
+{
+	stats_charge(map);
+	map->phase = previous;
+}
+
+void stats_add_cpu(BspMap *map, double seconds)
+{
+	if(map->phase >= 0)
+		map->stats.phases[map->phase].cpu += seconds;
+}
+
+void stats_add_read(BspMap *map, u64 bytes)
+{
+	map->stats.phases[map->phase >= 0 ? map->phase : BSP_PHASE_LOAD].bytes_read += bytes;
+}
+
+int load_lumps(BspMap *map, const int *types, size_t count)
+{
+	size_t first = 0;
+	while(first < count && map->lumpdata[types[first]].loaded)
+		++first;
+	if(first == count)
+		return 0;
+	int previous = stats_enter(map, BSP_PHASE_LOAD);
+	StreamRange ranges[LUMP_MAX];
+	size_t range_count = 0;
+	// Lumps that are read are only marked loaded once the read succeeded.
+	bool pending[LUMP_MAX] = { 0 };
+	for(size_t i = first; i < count; ++i)
+	{
+		int type = types[i];
+		LumpData *ld = &map->lumpdata[type];
+		if(ld->loaded || pending[type])
+			continue;
+
+		lump_t *l = &map->header.lumps[type];
+		if(l->filelen == 0 || lumpsizes[type] == 0)
+		{
+			ld->loaded = true;
+			continue;
+		}
+		ld->count = l->filelen / lumpsizes[type];
+		stats_add_read(map, l->filelen);
+		if(map->memory)
+		{
+			const u8 *ptr = map->memory + l->fileofs;
+			// Misaligned lumps are copied so the element structs can be accessed directly.
+			if((uintptr_t)ptr % lumpalignments[type] == 0)
+			{
+				ld->data = (void *)ptr;
+				ld->mapped = true;
+			}
+			else
+			{
+				ld->data = calloc(ld->count, lumpsizes[type]);
+				memcpy(ld->data, ptr, l->filelen);
+			}
+			ld->loaded = true;
+		}
+		else
+		{
+			ld->data = calloc(ld->count, lumpsizes[type]);
+			ranges[range_count++] = (StreamRange) { .offset = l->fileofs, .length = ld->count * lumpsizes[type], .ptr = ld->data };
+			pending[type] = true;
+		}
+	}
+	int status = 0;
+	if(range_count > 0 && map->reader)
+		status = file_reader_read(map->reader, ranges, range_count, map->reader_thread_count);
+	// Lumps are read in file order in one pass over the stream.
+	else if(range_count > 0 && stream_readv(map->stream, ranges, range_count) != range_count)
+		status = 1;
+	// A failed read leaves the lumps empty and unloaded instead of holding zeroes, so a later access tries again.
+	for(int type = 0; type < LUMP_MAX; ++type)
+	{
+		if(!pending[type])
+			continue;
+		LumpData *ld = &map->lumpdata[type];
+		if(status)
+		{
+			free(ld->data);
+			ld->data = NULL;
+			ld->count = 0;
+		}
+		else
+		{
+			ld->loaded = true;
+		}
+	}
+	stats_leave(map, previous);
+	return status;
+}
+
+// The lump is empty when it couldn't be read, callers that need to tell apart a failed read use load_lumps.
+LumpData *get_lump(BspMap *map, int type)
+{
+	load_lumps(map, &type, 1);
+	return &map->lumpdata[type];
+}
+
+EntityList *get_entities(BspMap *map, Writer *log)
+{
+	// Nothing is parsed when the lump can't be read, so a later call tries again.
+	if(!map->entities_parsed && !load_lumps(map, (int[]) { LUMP_ENTITIES }, 1))
+	{
+		LumpData *lump = get_lump(map, LUMP_ENTITIES);
+		int previous = stats_enter(map, BSP_PHASE_ENTITIES);
+		parse_entities(&map->entities, lump, log);
+		map->entities_parsed = true;
+		stats_leave(map, previous);
+	}
+	return &map->entities;
+}
+
+static int bsp_error(BspMap *map, const char *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	vsnprintf(map->error, sizeof(map->error), fmt, va);
+	va_end(va);
+	return 1;
+}
+
+// Checks the header and the lump directory once the header has been read.
+static int bsp_validate(BspMap *map)
+{
+	dheader_t *hdr = &map->header;
+	if(memcmp(hdr->ident, "IBSP", 4))
+		return bsp_error(map, "Magic mismatch");
+	if(hdr->version != 4)
+		return bsp_error(map, "Version mismatch");
+	// Every map has at least the worldspawn entity and the world model.
+	if(hdr->lumps[LUMP_MODELS].filelen < (s32)sizeof(dmodel_t))
+		return bsp_error(map, "Missing models");
+	if(hdr->lumps[LUMP_ENTITIES].filelen == 0)
+		return bsp_error(map, "Missing entities");
+	for(size_t i = 0; i < LUMP_MAX; ++i)
+	{
+		lump_t *l = &hdr->lumps[i];
+		if(l->filelen != 0 && lumpsizes[i] != 0)
+		{
+			if(l->filelen % lumpsizes[i] != 0)
+				return bsp_error(map, "Lump '%s' has a partial element", lumpnames[i]);
+			if((s64)l->fileofs + (s64)l->filelen > map->filelen)
+				return bsp_error(map, "Lump '%s' is out of bounds", lumpnames[i]);
+		}
+	}
+	return 0;
+}
+
+static int bsp_read_memory(BspMap *map, const void *data, size_t size)
+{
+	map->memory = data;
+	map->filelen = size;
+	if(size < sizeof(map->header))
+		return bsp_error(map, "File too small");
+	memcpy(&map->header, data, sizeof(map->header));
+	stats_add_read(map, sizeof(map->header));
+	return bsp_validate(map);
+}
+
+static int bsp_read_stream(BspMap *map, Stream *s)
+{
+	map->stream = s;
+	s->seek(s, 0, STREAM_SEEK_END);
+	map->filelen = s->tell(s);
+	s->seek(s, 0, STREAM_SEEK_BEG);
+
+	if(map->filelen < (s64)sizeof(map->header))
+		return bsp_error(map, "File too small");
+	if(!stream_read(*s, map->header))
+		return bsp_error(map, "Failed to read header");
+	stats_add_read(map, sizeof(map->header));
+	return bsp_validate(map);
+}
+
+// Reads the header and then every lump with all reads in flight at once, the file is closed afterwards.
+static int bsp_read_preload(BspMap *map, const char *path, size_t thread_count)
+{
+	FileReader reader;
+	if(file_reader_open(&reader, path))
+		return bsp_error(map, "Failed to open '%s'", path);
+	map->filelen = reader.size;
+	StreamRange header = { .offset = 0, .length = sizeof(map->header), .ptr = &map->header };
+	int status;
+	if(map->filelen < (s64)sizeof(map->header))
+		status = bsp_error(map, "File too small");
+	else if(file_reader_read(&reader, &header, 1, 1))
+		status = bsp_error(map, "Failed to read header");
+	else
+		status = bsp_validate(map);
+	stats_add_read(map, status ? 0 : sizeof(map->header));
+	if(!status)
+	{
+		int types[LUMP_MAX];
+		for(int i = 0; i < LUMP_MAX; ++i)
+			types[i] = i;
+		map->reader = &reader;
+		map->reader_thread_count = thread_count;
+		if(load_lumps(map, types, LUMP_MAX))
+			status = bsp_error(map, "Failed to read lumps");
+		map->reader = NULL;
+	}
+	file_reader_close(&reader);
+	return status;
+}
+
+static BspMap *bsp_new_map()
+{
+	BspMap *map = calloc(1, sizeof(BspMap));
+	map->open_serial = atomic_add(&maps_opened, 1);
+	atomic_add(&maps_open, 1);
+	map->phase = -1;
+	stats_enter(map, BSP_PHASE_LOAD);
+	return map;
+}
+
+static BspMap *bsp_finish_open(BspMap *map, int status, char *error, size_t error_size)
+{
+	stats_leave(map, -1);
+	if(!status)
+		return map;
+	if(error && error_size > 0)
+		snprintf(error, error_size, "%s", map->error);
+	bsp_close(map);
+	return NULL;
+}
+
+BspMap *bsp_open_file(const char *path, int flags, size_t thread_count, char *error, size_t error_size)
+{
+	BspMap *map = bsp_new_map();
+	snprintf(map->path, sizeof(map->path), "%s", path);
+
+	int status;
+	if(flags & BSP_OPEN_PRELOAD)
+	{
+		status = bsp_read_preload(map, path, thread_count);
+	}
+	else if(!(flags & BSP_OPEN_NO_MMAP) && 0 == file_map_open(&map->filemap, path))
+	{
+		status = bsp_read_memory(map, map->filemap.data, map->filemap.size);
+	}
+	else if(stream_open_file(&map->filestream, path, "rb"))
+	{
+		status = bsp_error(map, "Failed to open '%s'", path);
+	}
+	else
+	{
+		status = bsp_read_stream(map, &map->filestream);
+	}
+	// The cache is only an optimization, the map works the same without it.
+	if(!status && (flags & BSP_OPEN_CACHE))
+		bsp_use_cache(map);
+	return bsp_finish_open(map, status, error, error_size);
+}
+
+BspMap *bsp_open_memory(const void *data, size_t size, char *error, size_t error_size)
+{
+	BspMap *map = bsp_new_map();
+	return bsp_finish_open(map, bsp_read_memory(map, data, size), error, error_size);
+}
+
+BspMap *bsp_open_stream(Stream *stream, char *error, size_t error_size)
+{
+	BspMap *map = bsp_new_map();
+	stream->name(stream, map->path, sizeof(map->path));
+	return bsp_finish_open(map, bsp_read_stream(map, stream), error, error_size);
+}
+
+void bsp_close(BspMap *map)
+{
+	if(!map)
+		return;
+	atomic_add(&maps_open, -1);
+	for(size_t i = 0; i < LUMP_MAX; ++i)
+	{
+		LumpData *ld = &map->lumpdata[i];
+		if(!ld->mapped)
+			free(ld->data);
+	}
+	if(map->entities_parsed)
+		free_entities(&map->entities);
+	buf_free(map->mapbrushes);
+	free(map->mapplanes);
+	free(map->pointnodes);
+	if(map->collision)
+		free_collision_tree(map->collision);
+	if(map->cell_graph)
+		free_cell_graph(map->cell_graph);
+	if(map->filemap.data)
+		file_map_close(&map->filemap);
+	if(map->filestream.ctx)
+		stream_close_file(&map->filestream);
+	if(map->cachemap.data)
+		file_map_close(&map->cachemap);
+	buf_free(map->stats.models);
+	free(map);
+}
+
+const char *bsp_path(BspMap *map)
+{
+	return map->path;
+}
+
+s64 bsp_file_size(BspMap *map)
+{
+	return map->filelen;
+}
+
+const dheader_t *bsp_header(BspMap *map)
+{
+	return &map->header;
+}
+
+const void *bsp_lump(BspMap *map, int type, size_t *count)
+{
+	LumpData *ld = get_lump(map, type);
+	if(count)
+		*count = ld->count;
+	return ld->data;
+}
+
+size_t bsp_entity_count(BspMap *map)
+{
+	return get_entities(map, NULL)->entity_count;
+}
+
+Entity *bsp_entity(BspMap *map, size_t index)
+{
+	EntityList *entities = get_entities(map, NULL);
+	return index < entities->entity_count ? &entities->entities[index] : NULL;
+}
+
+const u32 *bsp_entities_by_classname(BspMap *map, const char *classname, size_t *count)
+{
+	return entity_index_find(&get_entities(map, NULL)->by_classname, classname, count);
+}
+
+const u32 *bsp_entities_by_targetname(BspMap *map, const char *targetname, size_t *count)
+{
+	return entity_index_find(&get_entities(map, NULL)->by_targetname, targetname, count);
+}
+
+// Checks that every side of every brush exists and references a plane and a material in range.
+static int validate_map_brushes(BspMap *map)
+{
+	LumpData *brushes = get_lump(map, LUMP_BRUSHES);
+	LumpData *brushsides = get_lump(map, LUMP_BRUSHSIDES);
+	size_t plane_count = get_lump(map, LUMP_PLANES)->count;
+	size_t material_count = get_lump(map, LUMP_MATERIALS)->count;
+	cbrushside_t *sides = brushsides->data;
+	size_t side_offset = 0;
+	for(size_t i = 0; i < brushes->count; ++i)
+	{
+		DiskBrush *src = &((DiskBrush*)brushes->data)[i];
+		size_t side_count = src->numSides > 6 ? src->numSides : 6;
+		if(side_count > brushsides->count - side_offset)
+			return bsp_error(map, "Brush %zu has sides out of range", i);
+		for(size_t k = 0; k < side_count; ++k)
+		{
+			cbrushside_t *side = &sides[side_offset + k];
+			// The first 6 sides hold the bounds as floats instead of plane indices.
+			if(k >= 6 && (side->plane < 0 || (size_t)side->plane >= plane_count))
+				return bsp_error(map, "Brush %zu has a plane out of range", i);
+			if(side->materialNum < 0 || (size_t)side->materialNum >= material_count)
+				return bsp_error(map, "Brush %zu has a material out of range", i);
+		}
+		side_offset += side_count;
+	}
+	return 0;
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int load_map_brushes(BspMap *map)
+{
+	if(load_lumps(map, (int[]) { LUMP_BRUSHES, LUMP_BRUSHSIDES, LUMP_PLANES, LUMP_MATERIALS }, 4))
+		return bsp_error(map, "Failed to read the brush lumps");
+	if(validate_map_brushes(map))
+		return 1;
+	size_t side_offset = 0;
+	LumpData *brushes = get_lump(map, LUMP_BRUSHES);
+	cbrushside_t *brushsides = (cbrushside_t*)get_lump(map, LUMP_BRUSHSIDES)->data;
+	DiskPlane *diskplanes = (DiskPlane*)get_lump(map, LUMP_PLANES)->data;
+
+	// All planes live in one block, every brush has at least the 6 axial ones.
+	size_t total_planes = 0;
+	for(size_t i = 0; i < brushes->count; ++i)
+	{
+		DiskBrush *src = &((DiskBrush*)brushes->data)[i];
+		total_planes += src->numSides > 6 ? src->numSides : 6;
+	}
+	MapPlane *mapplanes = malloc((total_planes + 1) * sizeof(MapPlane));
+	MapBrush *mapbrushes = NULL;
+	buf_grow(mapbrushes, brushes->count);
+	size_t plane_offset = 0;
+	
+	for(size_t i = 0; i < brushes->count; ++i)
+	{
+		MapBrush dst = { 0 };
+		dst.planes = &mapplanes[plane_offset];
+
+		DiskBrush *src = &((DiskBrush*)brushes->data)[i];
+		size_t numsides = src->numSides > 6 ? src->numSides - 6 : 0;
+		s32 axialMaterialNum[6] = {0};
+		for(size_t axis = 0; axis < 3; axis++)
+		{
+			for(size_t sign = 0; sign < 2; sign++)
+			{
+				union f2i
+				{
+					float f;
+					int i;
+				} u;
+				u.i = brushsides[side_offset].plane;
+				axialMaterialNum[sign + axis * 2] = brushsides[side_offset].materialNum;
+				float f = u.f;
+				if(sign)
+				{
+					dst.maxs[axis] = f;
+				}
+				else
+				{
+					dst.mins[axis] = f;
+				}
+				++side_offset;
+			}
+		}
+
+		map_planes_from_aabb(dst.mins, dst.maxs, dst.planes);
+		for(size_t h = 0; h < 6; ++h)
+		{
+			dst.planes[h].materialIndex = axialMaterialNum[h];
+		}
+		for(size_t k = 0; k < numsides; ++k)
+		{
+			cbrushside_t *side = &brushsides[side_offset + k];
+			DiskPlane *diskplane = &diskplanes[side->plane];
+
+			MapPlane *plane = &dst.planes[6 + k];
+			plane->distance = diskplane->dist;
+			plane->materialIndex = side->materialNum;
+			vec3_dup(plane->normal, diskplane->normal);
+		}
+		dst.plane_count = 6 + numsides;
+		plane_offset += dst.plane_count;
+		buf_push(mapbrushes, dst);
+		side_offset += numsides;
+	}
+	map->mapbrushes = mapbrushes;
+	map->mapplanes = mapplanes;
+	return 0;
+}
+
+MapBrush *get_map_brushes(BspMap *map)
+{
+	if(!map->mapbrushes_loaded)
+	{
+		int previous = stats_enter(map, BSP_PHASE_BRUSHES);
+		map->mapbrushes_malformed = load_map_brushes(map) != 0;
+		map->mapbrushes_loaded = true;
+		stats_leave(map, previous);
+	}
+	return map->mapbrushes;
+}
+
+static void info(Writer *log, BspMap *map, int type, int *count)
+{
+	lump_t *l = &map->header.lumps[type];
+	char amount[256] = { 0 };
+	if(count)
+	{
+		snprintf(amount, sizeof(amount), "%6d", *count);
+	} else
+	{
+		if(lumpsizes[type] == 0)
+			snprintf(amount, sizeof(amount), "     ?");
+		else if(lumpsizes[type] == 1)
+		{
+			snprintf(amount, sizeof(amount), "      ");
+		}
+		else if(lumpsizes[type] > 1)
+		{
+			snprintf(amount, sizeof(amount), "%6zu", l->filelen / lumpsizes[type]);
+		}
+	}
+	writer_printf(log, "%s %-19s %6d B\t%2d KB %5.1f%%\n",
+		amount,
+		lumpnames[type],
+		l->filelen,
+		(int)ceilf((float)l->filelen / 1000.f),
+		(float)l->filelen / (float)map->filelen * 100.f);
+}
+
+void bsp_print_info(BspMap *map, Writer *log)
+{
+	writer_printf(log, "bsp.c v0.1 (c) 2024\n");
+	writer_printf(log, "---------------------\n");
+	writer_printf(log, "%s: %lld\n", map->path, (long long)map->filelen);
+	
+	info(log, map, LUMP_MODELS, NULL);
+	info(log, map, LUMP_MATERIALS, NULL);
+	info(log, map, LUMP_BRUSHES, NULL);
+	info(log, map, LUMP_BRUSHSIDES, NULL);
+	info(log, map, LUMP_PLANES, NULL);
+	EntityList *entities = get_entities(map, log);
+	int entity_count = entities->entity_count;
+	info(log, map, LUMP_ENTITIES, &entity_count);
+	writer_printf(log, "\n");
+	info(log, map, LUMP_NODES, NULL);
+	info(log, map, LUMP_LEAFS, NULL);
+	info(log, map, LUMP_LEAFBRUSHES, NULL);
+	info(log, map, LUMP_LEAFSURFACES, NULL);
+	info(log, map, LUMP_COLLISIONVERTS, NULL);
+	info(log, map, LUMP_COLLISIONEDGES, NULL);
+	info(log, map, LUMP_COLLISIONTRIS, NULL);
+	info(log, map, LUMP_COLLISIONBORDERS, NULL);
+	info(log, map, LUMP_COLLISIONAABBS, NULL);
+	info(log, map, LUMP_DRAWVERTS, NULL);
+	info(log, map, LUMP_DRAWINDICES, NULL);
+	info(log, map, LUMP_TRIANGLES, NULL);
+	
+	info(log, map, LUMP_OBSOLETE_1, NULL);
+	info(log, map, LUMP_OBSOLETE_2, NULL);
+	info(log, map, LUMP_OBSOLETE_3, NULL);
+	info(log, map, LUMP_OBSOLETE_4, NULL);
+	info(log, map, LUMP_OBSOLETE_5, NULL);
+
+	info(log, map, LUMP_LIGHTBYTES, NULL);
+	info(log, map, LUMP_LIGHTGRIDENTRIES, NULL);
+	info(log, map, LUMP_LIGHTGRIDCOLORS, NULL);
+	// Not sure if it's stored as a lump or just parsed from entdata with classname "light"
+	size_t light_entity_count;
+	entity_index_find(&entities->by_classname, "light", &light_entity_count);
+	writer_printf(log, "     %zu lights                   0 B      0 KB   0.0%%\n", light_entity_count);
+	info(log, map, LUMP_VISIBILITY, NULL);
+	info(log, map, LUMP_PORTALVERTS, NULL);
+	info(log, map, LUMP_OCCLUDERS, NULL);
+	info(log, map, LUMP_OCCLUDERPLANES, NULL);
+	info(log, map, LUMP_OCCLUDEREDGES, NULL);
+	info(log, map, LUMP_OCCLUDERINDICES, NULL);
+	info(log, map, LUMP_AABBTREES, NULL);
+	info(log, map, LUMP_CELLS, NULL);
+	info(log, map, LUMP_PORTALS, NULL);
+	info(log, map, LUMP_CULLGROUPS, NULL);
+	info(log, map, LUMP_CULLGROUPINDICES, NULL);
+	writer_printf(log, "\n");
+	info(log, map, LUMP_PATHCONNECTIONS, NULL);
+	writer_printf(log, "---------------------\n");
+}
+
+static const char *phase_names[BSP_PHASE_MAX] = {
+	[BSP_PHASE_LOAD] = "load",
+	[BSP_PHASE_ENTITIES] = "entities",
+	[BSP_PHASE_BRUSHES] = "brushes",
+	[BSP_PHASE_POLYGONIZE] = "polygonize",
+	[BSP_PHASE_PATCHES] = "patches",
+	[BSP_PHASE_WRITE] = "write"
+};
+
+const char *bsp_phase_name(int phase)
+{
+	return phase >= 0 && phase < BSP_PHASE_MAX ? phase_names[phase] : "";
+}
+
+const BspStats *bsp_stats(BspMap *map)
+{
+	return &map->stats;
+}
+
+static void write_json_string(Writer *log, const char *s)
+{
+	writer_string(log, "\"");
+	for(; *s; ++s)
+	{
+		unsigned char c = *s;
+		if(c == '"' || c == '\\')
+			writer_printf(log, "\\%c", c);
+		else if(c < 0x20)
+			writer_printf(log, "\\u%04x", c);
+		else
+			writer_write(log, &c, 1);
+	}
+	writer_string(log, "\"");
+}
+
+static void print_stats_json(BspMap *map, Writer *log)
+{
+	BspStats *stats = &map->stats;
+	writer_string(log, "{\"path\":");
+	write_json_string(log, map->path);
+	writer_string(log, ",\"phases\":{");
+	for(int i = 0; i < BSP_PHASE_MAX; ++i)
+	{
+		BspPhaseStats *p = &stats->phases[i];
+		writer_printf(log,
+					  "%s\"%s\":{\"calls\":%u,\"wall_ms\":%.3f,\"cpu_ms\":%.3f,\"bytes_read\":%llu,\"heap_bytes\":%lld,\"peak_rss_bytes\":%llu}",
+					  i ? "," : "",
+					  phase_names[i],
+					  p->calls,
+					  p->wall * 1000.0,
+					  p->cpu * 1000.0,
+					  (unsigned long long)p->bytes_read,
+					  (long long)p->heap,
+					  (unsigned long long)p->peak_rss);
+	}
+	writer_string(log, "},\"models\":[");
+	for(size_t i = 0; i < stats->model_count; ++i)
+	{
+		BspModelStats *m = &stats->models[i];
+		writer_printf(log,
+					  "%s{\"model\":%u,\"entity\":%u,\"brushes\":%u,\"sides\":%u,\"surfaces\":%u,\"patches\":%u,\"patch_triangles\":%u}",
+					  i ? "," : "",
+					  m->model,
+					  m->entity,
+					  m->brushes,
+					  m->sides,
+					  m->surfaces,
+					  m->patches,
+					  m->patch_triangles);
+	}
+	writer_printf(log, "],\"process_wide_memory\":%s}\n", stats->process_wide_memory ? "true" : "false");
+}
+
+static void print_stats_text(BspMap *map, Writer *log)
+{
+	BspStats *stats = &map->stats;
+	BspPhaseStats total = { 0 };
+	writer_printf(log, "%s\n", map->path);
+	writer_printf(log, "phase        calls   wall ms    cpu ms    read KB    heap KB  peak RSS KB\n");
+	for(int i = 0; i < BSP_PHASE_MAX; ++i)
+	{
+		BspPhaseStats *p = &stats->phases[i];
+		writer_printf(log, "%-12s %5u %9.2f %9.2f %10.1f %10.1f %12.1f\n",
+					  phase_names[i],
+					  p->calls,
+					  p->wall * 1000.0,
+					  p->cpu * 1000.0,
+					  p->bytes_read / 1024.0,
+					  p->heap / 1024.0,
+					  p->peak_rss / 1024.0);
+		total.calls += p->calls;
+		total.wall += p->wall;
+		total.cpu += p->cpu;
+		total.bytes_read += p->bytes_read;
+		total.heap += p->heap;
+		if(p->peak_rss > total.peak_rss)
+			total.peak_rss = p->peak_rss;
+	}
+	writer_printf(log, "%-12s %5u %9.2f %9.2f %10.1f %10.1f %12.1f\n",
+				  "total",
+				  total.calls,
+				  total.wall * 1000.0,
+				  total.cpu * 1000.0,
+				  total.bytes_read / 1024.0,
+				  total.heap / 1024.0,
+				  total.peak_rss / 1024.0);
+	if(stats->process_wide_memory)
+		writer_printf(log, "heap and peak RSS are process-wide, other maps were open at the same time\n");
+	if(stats->model_count == 0)
+		return;
+	writer_printf(log, "model  entity  brushes    sides  surfaces  patches  patch tris\n");
+	for(size_t i = 0; i < stats->model_count; ++i)
+	{
+		BspModelStats *m = &stats->models[i];
+		writer_printf(log, "%5u %7u %8u %8u %9u %8u %11u\n",
+					  m->model,
+					  m->entity,
+					  m->brushes,
+					  m->sides,
+					  m->surfaces,
+					  m->patches,
+					  m->patch_triangles);
+	}
+}
+
+void bsp_print_stats(BspMap *map, Writer *log, int format)
+{
+	if(format == BSP_STATS_JSON)
+		print_stats_json(map, log);
+	else
+		print_stats_text(map, log);
+}
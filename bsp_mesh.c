@@ -0,0 +1,324 @@
+#include <string.h>
+#include <stdlib.h>
+#include "bsp_internal.h"
+#include "stream_file.h"
+#include <growable-buf/buf.h>
+
+// Vertices and indices are fetched one soup at a time. When the map isn't in memory the lumps aren't loaded,
+// only the range of the soup being written is read from the stream.
+typedef struct
+{
+	BspMap *map;
+	const DiskGfxVertex *vertices; // NULL when read per soup
+	const u16 *indices; // NULL when read per soup
+	size_t vertex_count;
+	size_t index_count;
+	DiskGfxVertex *vertex_scratch;
+	u16 *index_scratch;
+	bool failed; // a read from the stream failed
+} MeshSource;
+
+static size_t mesh_lump_count(BspMap *map, int type)
+{
+	return map->header.lumps[type].filelen / lumpsizes[type];
+}
+
+static void mesh_source_init(MeshSource *src, BspMap *map)
+{
+	memset(src, 0, sizeof(*src));
+	src->map = map;
+	src->vertex_count = mesh_lump_count(map, LUMP_DRAWVERTS);
+	src->index_count = mesh_lump_count(map, LUMP_DRAWINDICES);
+	if(map->memory || map->lumpdata[LUMP_DRAWVERTS].loaded)
+		src->vertices = get_lump(map, LUMP_DRAWVERTS)->data;
+	else
+		src->vertex_scratch = malloc(UINT16_MAX * sizeof(DiskGfxVertex));
+	if(map->memory || map->lumpdata[LUMP_DRAWINDICES].loaded)
+		src->indices = get_lump(map, LUMP_DRAWINDICES)->data;
+	else
+		src->index_scratch = malloc(UINT16_MAX * sizeof(u16));
+}
+
+static void mesh_source_free(MeshSource *src)
+{
+	free(src->vertex_scratch);
+	free(src->index_scratch);
+}
+
+static const void *mesh_read(MeshSource *src, int type, size_t first, size_t count, void *scratch)
+{
+	BspMap *map = src->map;
+	StreamRange range = { .offset = map->header.lumps[type].fileofs + (s64)(first * lumpsizes[type]),
+						  .length = count * lumpsizes[type],
+						  .ptr = scratch };
+	if(count > 0 && stream_readv(map->stream, &range, 1) != 1)
+	{
+		src->failed = true;
+		memset(scratch, 0, range.length);
+	}
+	stats_add_read(map, range.length);
+	return scratch;
+}
+
+static const DiskGfxVertex *soup_vertices(MeshSource *src, const DiskTriangleSoup *soup)
+{
+	if(src->vertices)
+		return &src->vertices[soup->firstVertex];
+	return mesh_read(src, LUMP_DRAWVERTS, soup->firstVertex, soup->vertexCount, src->vertex_scratch);
+}
+
+static const u16 *soup_indices(MeshSource *src, const DiskTriangleSoup *soup)
+{
+	if(src->indices)
+		return &src->indices[soup->firstIndex];
+	return mesh_read(src, LUMP_DRAWINDICES, soup->firstIndex, soup->indexCount, src->index_scratch);
+}
+
+// Soups grouped by material, in file order within a material.
+typedef struct
+{
+	const DiskTriangleSoup *soups;
+	const dmaterial_t *materials;
+	u32 *order;
+	u32 *group_firsts; // group i is order[group_firsts[i]] up to order[group_firsts[i + 1]]
+	BspMeshGroup *groups;
+	size_t group_count;
+	size_t vertex_count;
+	size_t index_count;
+	size_t skipped; // soups that point outside the lumps
+} MeshLayout;
+
+static bool soup_valid(const DiskTriangleSoup *soup, size_t material_count, const MeshSource *src)
+{
+	return soup->materialIndex < material_count && (size_t)soup->firstVertex + soup->vertexCount <= src->vertex_count
+		   && (size_t)soup->firstIndex + soup->indexCount <= src->index_count;
+}
+
+static void build_mesh_layout(BspMap *map, const MeshSource *src, MeshLayout *layout)
+{
+	memset(layout, 0, sizeof(*layout));
+	LumpData *soups = get_lump(map, LUMP_TRIANGLES);
+	LumpData *materials = get_lump(map, LUMP_MATERIALS);
+	layout->soups = soups->data;
+	layout->materials = materials->data;
+
+	// Counting sort of the soups by material, only the indices of the soups are held.
+	u32 *counts = calloc(materials->count + 1, sizeof(u32));
+	for(size_t i = 0; i < soups->count; ++i)
+	{
+		const DiskTriangleSoup *soup = &layout->soups[i];
+		if(soup_valid(soup, materials->count, src))
+			++counts[soup->materialIndex];
+		else
+			++layout->skipped;
+	}
+	u32 *starts = calloc(materials->count + 1, sizeof(u32));
+	for(size_t i = 0; i < materials->count; ++i)
+	{
+		starts[i + 1] = starts[i] + counts[i];
+		if(counts[i] > 0)
+			++layout->group_count;
+	}
+	layout->order = malloc((soups->count + 1) * sizeof(u32));
+	layout->group_firsts = malloc((layout->group_count + 1) * sizeof(u32));
+	layout->groups = calloc(layout->group_count + 1, sizeof(BspMeshGroup));
+	u32 *next = malloc((materials->count + 1) * sizeof(u32));
+	memcpy(next, starts, (materials->count + 1) * sizeof(u32));
+	for(size_t i = 0; i < soups->count; ++i)
+	{
+		const DiskTriangleSoup *soup = &layout->soups[i];
+		if(soup_valid(soup, materials->count, src))
+			layout->order[next[soup->materialIndex]++] = (u32)i;
+	}
+
+	size_t group = 0;
+	for(size_t i = 0; i < materials->count; ++i)
+	{
+		if(counts[i] == 0)
+			continue;
+		BspMeshGroup *g = &layout->groups[group];
+		layout->group_firsts[group++] = starts[i];
+		memcpy(g->material, layout->materials[i].material, sizeof(g->material));
+		g->material[sizeof(g->material) - 1] = '\0';
+		g->first_vertex = (u32)layout->vertex_count;
+		g->first_index = (u32)layout->index_count;
+		for(u32 j = starts[i]; j < starts[i + 1]; ++j)
+		{
+			const DiskTriangleSoup *soup = &layout->soups[layout->order[j]];
+			g->vertex_count += soup->vertexCount;
+			g->index_count += soup->indexCount / 3 * 3;
+		}
+		layout->vertex_count += g->vertex_count;
+		layout->index_count += g->index_count;
+	}
+	layout->group_firsts[group] = starts[materials->count];
+	free(next);
+	free(starts);
+	free(counts);
+}
+
+static void free_mesh_layout(MeshLayout *layout)
+{
+	free(layout->order);
+	free(layout->group_firsts);
+	free(layout->groups);
+}
+
+static void write_obj_vector(Writer *w, const char *prefix, const float *v, int n)
+{
+	writer_string(w, prefix);
+	for(int k = 0; k < n; ++k)
+	{
+		writer_string(w, " ");
+		writer_float(w, v[k]);
+	}
+	writer_string(w, "\n");
+}
+
+// Positions, normals and the material texture coordinates, lightmap coordinates have no place in OBJ.
+static void write_obj(Writer *w, MeshSource *src, const MeshLayout *layout)
+{
+	writer_printf(w, "# %zu vertices, %zu triangles, %zu materials\n", layout->vertex_count, layout->index_count / 3, layout->group_count);
+	size_t base = 1; // OBJ counts from 1
+	for(size_t i = 0; i < layout->group_count; ++i)
+	{
+		const char *material = layout->groups[i].material;
+		writer_printf(w, "g %s\nusemtl %s\n", material, material);
+		for(u32 j = layout->group_firsts[i]; j < layout->group_firsts[i + 1]; ++j)
+		{
+			const DiskTriangleSoup *soup = &layout->soups[layout->order[j]];
+			const DiskGfxVertex *vertices = soup_vertices(src, soup);
+			for(size_t k = 0; k < soup->vertexCount; ++k)
+			{
+				const DiskGfxVertex *v = &vertices[k];
+				// OBJ puts the texture origin at the bottom left.
+				vec2 uv = { v->texCoord[0], 1.f - v->texCoord[1] };
+				write_obj_vector(w, "v", v->xyz, 3);
+				write_obj_vector(w, "vt", uv, 2);
+				write_obj_vector(w, "vn", v->normal, 3);
+			}
+			const u16 *indices = soup_indices(src, soup);
+			for(size_t k = 0; k + 3 <= soup->indexCount; k += 3)
+			{
+				const u16 *tri = &indices[k];
+				if(tri[0] >= soup->vertexCount || tri[1] >= soup->vertexCount || tri[2] >= soup->vertexCount)
+					continue;
+				writer_string(w, "f");
+				for(int n = 0; n < 3; ++n)
+				{
+					s64 index = (s64)(base + tri[n]);
+					for(int m = 0; m < 3; ++m)
+					{
+						writer_string(w, m == 0 ? " " : "/");
+						writer_int(w, index);
+					}
+				}
+				writer_string(w, "\n");
+			}
+			base += soup->vertexCount;
+		}
+	}
+}
+
+static void write_binary(Writer *w, MeshSource *src, const MeshLayout *layout)
+{
+	BspMeshHeader header = { .ident = { 'B', 'S', 'P', 'M' },
+							 .version = BSP_MESH_VERSION,
+							 .group_count = (u32)layout->group_count,
+							 .vertex_count = (u32)layout->vertex_count,
+							 .index_count = (u32)layout->index_count };
+	writer_write(w, &header, sizeof(header));
+	writer_write(w, layout->groups, layout->group_count * sizeof(BspMeshGroup));
+
+	// All vertices first and then all indices, so each lump is read only once.
+	for(size_t i = 0; i < layout->group_count; ++i)
+	{
+		for(u32 j = layout->group_firsts[i]; j < layout->group_firsts[i + 1]; ++j)
+		{
+			const DiskTriangleSoup *soup = &layout->soups[layout->order[j]];
+			const DiskGfxVertex *vertices = soup_vertices(src, soup);
+			for(size_t k = 0; k < soup->vertexCount; ++k)
+			{
+				const DiskGfxVertex *v = &vertices[k];
+				BspMeshVertex out;
+				vec3_dup(out.xyz, v->xyz);
+				vec3_dup(out.normal, v->normal);
+				memcpy(out.uv, v->texCoord, sizeof(out.uv));
+				memcpy(out.lightmap_uv, v->lmapCoord, sizeof(out.lightmap_uv));
+				writer_write(w, &out, sizeof(out));
+			}
+		}
+	}
+	u32 base = 0;
+	for(size_t i = 0; i < layout->group_count; ++i)
+	{
+		for(u32 j = layout->group_firsts[i]; j < layout->group_firsts[i + 1]; ++j)
+		{
+			const DiskTriangleSoup *soup = &layout->soups[layout->order[j]];
+			const u16 *indices = soup_indices(src, soup);
+			for(size_t k = 0; k + 3 <= soup->indexCount; k += 3)
+			{
+				const u16 *tri = &indices[k];
+				// A triangle pointing outside its soup collapses onto the first vertex, which keeps the counts in the header.
+				bool valid = tri[0] < soup->vertexCount && tri[1] < soup->vertexCount && tri[2] < soup->vertexCount;
+				u32 out[3];
+				for(int n = 0; n < 3; ++n)
+					out[n] = base + (valid ? tri[n] : 0);
+				writer_write(w, out, sizeof(out));
+			}
+			base += soup->vertexCount;
+		}
+	}
+}
+
+int bsp_export_mesh_stream(BspMap *map, Stream *out, const BspMeshOptions *opts, Writer *log)
+{
+	if(load_lumps(map, (int[]) { LUMP_MATERIALS, LUMP_TRIANGLES }, 2))
+	{
+		if(log)
+			writer_printf(log, "Failed to read the lumps\n");
+		return 1;
+	}
+	int previous = stats_enter(map, BSP_PHASE_WRITE);
+	MeshSource src;
+	mesh_source_init(&src, map);
+	MeshLayout layout;
+	build_mesh_layout(map, &src, &layout);
+
+	Writer w;
+	writer_init(&w, out, opts->float_format);
+	if(opts->format == BSP_MESH_BINARY)
+		write_binary(&w, &src, &layout);
+	else
+		write_obj(&w, &src, &layout);
+	writer_free(&w);
+	stats_leave(map, previous);
+
+	if(log && layout.skipped > 0)
+		writer_printf(log, "Skipped %zu triangle soups outside the vertex or index lumps\n", layout.skipped);
+	if(log && src.failed)
+		writer_printf(log, "Failed to read the vertices or indices\n");
+	if(log && w.error)
+		writer_printf(log, "Failed to write the mesh\n");
+	int status = w.error || src.failed ? 1 : 0;
+	free_mesh_layout(&layout);
+	mesh_source_free(&src);
+	return status;
+}
+
+int bsp_export_mesh(BspMap *map, const char *path, const BspMeshOptions *opts, Writer *log)
+{
+	Stream out;
+	if(stream_open_file(&out, path, opts->format == BSP_MESH_BINARY ? "wb" : "w"))
+	{
+		if(log)
+			writer_printf(log, "Failed to open '%s'\n", path);
+		return 1;
+	}
+	if(log)
+		writer_printf(log, "Exporting to '%s'\n", path);
+	int status = bsp_export_mesh_stream(map, &out, opts, log);
+	if(stream_close_file(&out))
+		status = 1;
+	return status;
+}
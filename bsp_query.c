@@ -0,0 +1,163 @@
+#include <string.h>
+#include <stdlib.h>
+#include "bsp_internal.h"
+#include "thread.h"
+#include <growable-buf/buf.h>
+
+// Copies the node planes next to the children, so walking the tree touches a single array.
+static void build_point_nodes(BspMap *map)
+{
+	load_lumps(map, (int[]) { LUMP_NODES, LUMP_LEAFS, LUMP_PLANES }, 3);
+	LumpData *nodes = get_lump(map, LUMP_NODES);
+	LumpData *leafs = get_lump(map, LUMP_LEAFS);
+	LumpData *planes = get_lump(map, LUMP_PLANES);
+	if(nodes->count == 0)
+		return;
+	PointNode *pointnodes = malloc(nodes->count * sizeof(PointNode));
+	for(size_t i = 0; i < nodes->count; ++i)
+	{
+		dnode_t *src = &((dnode_t *)nodes->data)[i];
+		PointNode *dst = &pointnodes[i];
+		bool valid = src->planeNum >= 0 && (size_t)src->planeNum < planes->count;
+		for(int k = 0; k < 2; ++k)
+		{
+			s32 child = src->children[k];
+			if(child >= 0 ? (size_t)child >= nodes->count : (size_t)(-(child + 1)) >= leafs->count)
+				valid = false;
+			dst->children[k] = child;
+		}
+		if(!valid)
+		{
+			free(pointnodes);
+			return;
+		}
+		DiskPlane *plane = &((DiskPlane *)planes->data)[src->planeNum];
+		vec3_dup(dst->normal, plane->normal);
+		dst->dist = plane->dist;
+	}
+	map->pointnodes = pointnodes;
+	map->pointnode_count = nodes->count;
+}
+
+PointNode *get_point_nodes(BspMap *map)
+{
+	if(!map->pointnodes_built)
+	{
+		build_point_nodes(map);
+		map->pointnodes_built = true;
+	}
+	return map->pointnodes;
+}
+
+// Returns the leaf index, or -1 if the walk doesn't end in a leaf.
+static s32 point_leaf(const PointNode *nodes, size_t node_count, const vec3 p)
+{
+	s32 node = 0;
+	// A well formed tree reaches a leaf within node_count steps, this also stops on cycles.
+	for(size_t steps = 0; steps < node_count; ++steps)
+	{
+		const PointNode *n = &nodes[node];
+		float d = n->normal[0] * p[0] + n->normal[1] * p[1] + n->normal[2] * p[2] - n->dist;
+		node = n->children[d < 0.f];
+		if(node < 0)
+			return -(node + 1);
+	}
+	return -1;
+}
+
+static bool point_in_brush(const MapBrush *brush, const vec3 p)
+{
+	for(int k = 0; k < 3; ++k)
+	{
+		if(p[k] < brush->mins[k] || p[k] > brush->maxs[k])
+			return false;
+	}
+	for(size_t i = 6; i < brush->plane_count; ++i)
+	{
+		const MapPlane *plane = &brush->planes[i];
+		if(vec3_mul_inner(plane->normal, p) > plane->distance)
+			return false;
+	}
+	return true;
+}
+
+typedef struct
+{
+	const PointNode *nodes;
+	size_t node_count;
+	const dleaf_t *leafs;
+	const dleafbrush_t *leafbrushes;
+	size_t leafbrush_count;
+	const MapBrush *mapbrushes;
+	const DiskBrush *brushes;
+	size_t brush_count;
+	const dmaterial_t *materials;
+	size_t material_count;
+	int flags;
+	const vec3 *points;
+	size_t count;
+	BspPointResult *results;
+} PointQuery;
+
+#define POINT_CHUNK_SIZE 4096
+
+static void point_query_chunk(void *ctx, size_t chunk)
+{
+	PointQuery *q = ctx;
+	size_t begin = chunk * POINT_CHUNK_SIZE;
+	size_t end = begin + POINT_CHUNK_SIZE < q->count ? begin + POINT_CHUNK_SIZE : q->count;
+	for(size_t i = begin; i < end; ++i)
+	{
+		BspPointResult *r = &q->results[i];
+		r->leaf = q->nodes ? point_leaf(q->nodes, q->node_count, q->points[i]) : -1;
+		r->brush = -1;
+		r->contents = 0;
+		if(r->leaf < 0)
+		{
+			r->cluster = r->area = r->cell = -1;
+			continue;
+		}
+		const dleaf_t *leaf = &q->leafs[r->leaf];
+		r->cluster = leaf->cluster;
+		r->area = leaf->area;
+		r->cell = leaf->cellNum;
+		if(!(q->flags & BSP_POINT_CONTENTS) || leaf->firstLeafBrush < 0)
+			continue;
+		for(size_t j = 0; j < leaf->numLeafBrushes && (size_t)leaf->firstLeafBrush + j < q->leafbrush_count; ++j)
+		{
+			s32 brush = q->leafbrushes[leaf->firstLeafBrush + j].brush;
+			if(brush < 0 || (size_t)brush >= q->brush_count || !point_in_brush(&q->mapbrushes[brush], q->points[i]))
+				continue;
+			if(r->brush == -1)
+				r->brush = brush;
+			u16 material = q->brushes[brush].materialNum;
+			if(material < q->material_count)
+				r->contents |= q->materials[material].contentFlags;
+		}
+	}
+}
+
+void bsp_point_query(BspMap *map, const vec3 *points, size_t count, int flags, size_t thread_count, BspPointResult *results)
+{
+	// Everything is loaded up front, the workers only read.
+	PointQuery q = { .flags = flags, .points = points, .count = count, .results = results };
+	q.nodes = get_point_nodes(map);
+	q.node_count = map->pointnode_count;
+	q.leafs = get_lump(map, LUMP_LEAFS)->data;
+	if(flags & BSP_POINT_CONTENTS)
+	{
+		load_lumps(map, (int[]) { LUMP_LEAFBRUSHES, LUMP_BRUSHES, LUMP_MATERIALS }, 3);
+		LumpData *leafbrushes = get_lump(map, LUMP_LEAFBRUSHES);
+		LumpData *brushes = get_lump(map, LUMP_BRUSHES);
+		LumpData *materials = get_lump(map, LUMP_MATERIALS);
+		q.leafbrushes = leafbrushes->data;
+		q.leafbrush_count = leafbrushes->count;
+		q.mapbrushes = get_map_brushes(map);
+		q.brushes = brushes->data;
+		// Both counts match for a sound file, the smaller one keeps a broken one in bounds.
+		q.brush_count = brushes->count < buf_size(map->mapbrushes) ? brushes->count : buf_size(map->mapbrushes);
+		q.materials = materials->data;
+		q.material_count = materials->count;
+	}
+	parallel_for((count + POINT_CHUNK_SIZE - 1) / POINT_CHUNK_SIZE, thread_count, point_query_chunk, &q);
+}
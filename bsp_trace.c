@@ -0,0 +1,492 @@
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include "bsp_internal.h"
+#include "thread.h"
+#include <growable-buf/buf.h>
+
+// Nodes that break the ordering or point outside the lumps become empty leaves, so a damaged tree can't loop.
+static void build_collision_tree(BspMap *map, CollisionTree *tree)
+{
+	static const int lumps[] = { LUMP_COLLISIONAABBS, LUMP_COLLISIONPARTITIONS, LUMP_COLLISIONTRIS, LUMP_COLLISIONVERTS };
+	load_lumps(map, lumps, 4);
+	LumpData *aabbs = get_lump(map, LUMP_COLLISIONAABBS);
+	LumpData *partitions = get_lump(map, LUMP_COLLISIONPARTITIONS);
+	LumpData *tris = get_lump(map, LUMP_COLLISIONTRIS);
+	LumpData *vertices = get_lump(map, LUMP_COLLISIONVERTS);
+	if(aabbs->count == 0)
+		return;
+
+	tree->node_count = aabbs->count;
+	tree->nodes = malloc(aabbs->count * sizeof(CollisionNode));
+	bool *is_child = calloc(aabbs->count, sizeof(bool));
+	CollisionTriangle *triangles = NULL;
+	for(size_t i = 0; i < aabbs->count; ++i)
+	{
+		DiskCollisionAabbTree *src = &((DiskCollisionAabbTree *)aabbs->data)[i];
+		CollisionNode *dst = &tree->nodes[i];
+		vec3_sub(dst->mins, src->origin, src->halfSize);
+		vec3_add(dst->maxs, src->origin, src->halfSize);
+		dst->material = src->materialIndex;
+		dst->leaf = true;
+		dst->first = (s32)buf_size(triangles);
+		dst->count = 0;
+		if(src->childCount > 0)
+		{
+			s64 first = src->u.firstChildIndex;
+			if(first > (s64)i && first + src->childCount <= (s64)aabbs->count)
+			{
+				dst->leaf = false;
+				dst->first = (s32)first;
+				dst->count = src->childCount;
+				for(s32 k = 0; k < src->childCount; ++k)
+					is_child[first + k] = true;
+			}
+			continue;
+		}
+		if(src->u.partitionIndex < 0 || (size_t)src->u.partitionIndex >= partitions->count)
+			continue;
+		DiskCollisionPartition *part = &((DiskCollisionPartition *)partitions->data)[src->u.partitionIndex];
+		for(size_t j = 0; j < part->triCount && (size_t)part->firstTriIndex + j < tris->count; ++j)
+		{
+			DiskCollisionTriangle *tri = &((DiskCollisionTriangle *)tris->data)[part->firstTriIndex + j];
+			if(tri->vertIndices[0] >= vertices->count || tri->vertIndices[1] >= vertices->count || tri->vertIndices[2] >= vertices->count)
+				continue;
+			DiskCollisionVertex *v = vertices->data;
+			CollisionTriangle t = { .index = (s32)(part->firstTriIndex + j) };
+			vec3_dup(t.v0, v[tri->vertIndices[0]].xyz);
+			vec3_sub(t.e1, v[tri->vertIndices[1]].xyz, t.v0);
+			vec3_sub(t.e2, v[tri->vertIndices[2]].xyz, t.v0);
+			vec3_mul_cross(t.normal, t.e1, t.e2);
+			float length = vec3_len(t.normal);
+			if(length > 0.f)
+				vec3_scale(t.normal, t.normal, 1.f / length);
+			buf_push(triangles, t);
+			++dst->count;
+		}
+	}
+	for(size_t i = 0; i < aabbs->count; ++i)
+	{
+		if(!is_child[i])
+			buf_push(tree->roots, (s32)i);
+	}
+	tree->root_count = buf_size(tree->roots);
+	tree->triangles = triangles;
+	tree->triangle_count = buf_size(triangles);
+	free(is_child);
+}
+
+CollisionTree *get_collision_tree(BspMap *map)
+{
+	if(!map->collision)
+	{
+		map->collision = calloc(1, sizeof(CollisionTree));
+		build_collision_tree(map, map->collision);
+	}
+	return map->collision;
+}
+
+void free_collision_tree(CollisionTree *tree)
+{
+	free(tree->nodes);
+	buf_free(tree->roots);
+	buf_free(tree->triangles);
+	free(tree);
+}
+
+typedef struct
+{
+	vec3 start, delta, inv_delta;
+} Segment;
+
+// The segment is moved by offset, so a box is swept around its center.
+static void segment_init(Segment *s, const BspRay *ray, const vec3 offset)
+{
+	vec3_add(s->start, ray->start, offset);
+	vec3_sub(s->delta, ray->end, ray->start);
+	// Division by zero gives infinities, which the slab test handles.
+	for(int k = 0; k < 3; ++k)
+		s->inv_delta[k] = 1.f / s->delta[k];
+}
+
+// Returns whether the segment passes through the box before max_fraction.
+static bool segment_hits_box(const Segment *s, const vec3 mins, const vec3 maxs, float max_fraction)
+{
+	float enter = 0.f, leave = max_fraction;
+	for(int k = 0; k < 3; ++k)
+	{
+		float t1 = (mins[k] - s->start[k]) * s->inv_delta[k];
+		float t2 = (maxs[k] - s->start[k]) * s->inv_delta[k];
+		// fminf and fmaxf drop the NaN of a start exactly on a slab with no movement along the axis.
+		enter = fmaxf(enter, fminf(t1, t2));
+		leave = fminf(leave, fmaxf(t1, t2));
+	}
+	return enter <= leave;
+}
+
+// Möller-Trumbore, both sides of the triangle count.
+static bool segment_hits_triangle(const Segment *s, const CollisionTriangle *t, float *fraction)
+{
+	vec3 p, q, offset;
+	vec3_mul_cross(p, s->delta, t->e2);
+	float det = vec3_mul_inner(t->e1, p);
+	if(fabsf(det) < 1e-8f)
+		return false;
+	float inv_det = 1.f / det;
+	vec3_sub(offset, s->start, t->v0);
+	float u = vec3_mul_inner(offset, p) * inv_det;
+	if(u < 0.f || u > 1.f)
+		return false;
+	vec3_mul_cross(q, offset, t->e1);
+	float v = vec3_mul_inner(s->delta, q) * inv_det;
+	if(v < 0.f || u + v > 1.f)
+		return false;
+	float f = vec3_mul_inner(t->e2, q) * inv_det;
+	if(f < 0.f || f >= *fraction)
+		return false;
+	*fraction = f;
+	return true;
+}
+
+// Separating axis test of a box with half size extents moving along the segment, both sides of the triangle count.
+static bool box_hits_triangle(const Segment *s, const vec3 extents, const CollisionTriangle *t, float *fraction, vec3 normal)
+{
+	vec3 v[3], edges[3], axes[13];
+	vec3_dup(v[0], t->v0);
+	vec3_add(v[1], t->v0, t->e1);
+	vec3_add(v[2], t->v0, t->e2);
+	vec3_dup(edges[0], t->e1);
+	vec3_sub(edges[1], t->e2, t->e1);
+	vec3_dup(edges[2], t->e2);
+	int axis_count = 0;
+	for(int k = 0; k < 3; ++k)
+	{
+		vec3 unit = { 0.f, 0.f, 0.f };
+		unit[k] = 1.f;
+		vec3_dup(axes[axis_count++], unit);
+		for(int e = 0; e < 3; ++e)
+			vec3_mul_cross(axes[axis_count++], edges[e], unit);
+	}
+	vec3_dup(axes[axis_count++], t->normal);
+
+	float enter = -INFINITY, leave = *fraction;
+	int enter_axis = -1;
+	for(int i = 0; i < axis_count; ++i)
+	{
+		const float *axis = axes[i];
+		float length = vec3_len(axis);
+		// Parallel edges give no axis.
+		if(length < 1e-6f)
+			continue;
+		float lo = vec3_mul_inner(v[0], axis), hi = lo;
+		for(int k = 1; k < 3; ++k)
+		{
+			float d = vec3_mul_inner(v[k], axis);
+			lo = d < lo ? d : lo;
+			hi = d > hi ? d : hi;
+		}
+		float radius = fabsf(axis[0]) * extents[0] + fabsf(axis[1]) * extents[1] + fabsf(axis[2]) * extents[2];
+		lo -= radius;
+		hi += radius;
+		float p = vec3_mul_inner(s->start, axis);
+		float speed = vec3_mul_inner(s->delta, axis);
+		if(fabsf(speed) < 1e-8f * length)
+		{
+			if(p < lo || p > hi)
+				return false;
+			continue;
+		}
+		float t1 = (lo - p) / speed, t2 = (hi - p) / speed;
+		float near = t1 < t2 ? t1 : t2, far = t1 < t2 ? t2 : t1;
+		if(near > enter)
+		{
+			enter = near;
+			enter_axis = i;
+		}
+		leave = far < leave ? far : leave;
+		if(enter > leave)
+			return false;
+	}
+	// Contact that ended before the start doesn't count.
+	if(leave < 0.f || enter >= *fraction)
+		return false;
+	// Overlapping at the start counts as a hit at 0.
+	if(enter_axis < 0)
+		enter_axis = axis_count - 1;
+	*fraction = enter < 0.f ? 0.f : enter;
+	const float *axis = axes[enter_axis];
+	vec3_scale(normal, axis, (vec3_mul_inner(axis, s->delta) > 0.f ? -1.f : 1.f) / vec3_len(axis));
+	return true;
+}
+
+#define TRACE_CHUNK_SIZE 1024
+#define TRACE_MAX_DEPTH 256
+#define TRACE_PLANE_EPSILON 1.f // segments this close to a node plane go down both sides
+#define TRACE_SPLIT_EPSILON 0.125f
+
+typedef struct
+{
+	CollisionTree *collision;
+	const PointNode *nodes;
+	size_t node_count;
+	const dleaf_t *leafs;
+	size_t leaf_count;
+	const dleafbrush_t *leafbrushes;
+	size_t leafbrush_count;
+	const MapBrush *mapbrushes;
+	size_t brush_count;
+	vec3 offset; // center of the box
+	vec3 extents; // half size of the box
+	bool box;
+	int flags;
+	const BspRay *rays;
+	size_t count;
+	BspTraceResult *results;
+} TraceQuery;
+
+// Per thread scratch space.
+typedef struct
+{
+	TraceQuery *q;
+	s32 *stack;
+	u32 *brush_stamps; // a brush is only tested once per segment
+	u32 stamp;
+	Segment segment;
+	BspTraceResult *result;
+} TraceWork;
+
+static void trace_triangles(TraceWork *w)
+{
+	CollisionTree *tree = w->q->collision;
+	BspTraceResult *r = w->result;
+	buf_clear(w->stack);
+	for(size_t i = tree->root_count; i > 0; --i)
+		buf_push(w->stack, tree->roots[i - 1]);
+	const float *extents = w->q->extents;
+	while(buf_size(w->stack) > 0)
+	{
+		CollisionNode *node = &tree->nodes[w->stack[--buf_ptr(w->stack)->size]];
+		vec3 mins, maxs;
+		vec3_sub(mins, node->mins, extents);
+		vec3_add(maxs, node->maxs, extents);
+		if(!segment_hits_box(&w->segment, mins, maxs, r->fraction))
+			continue;
+		if(!node->leaf)
+		{
+			for(s32 k = node->count; k > 0; --k)
+				buf_push(w->stack, node->first + k - 1);
+			continue;
+		}
+		for(s32 k = 0; k < node->count; ++k)
+		{
+			CollisionTriangle *t = &tree->triangles[node->first + k];
+			if(w->q->box)
+			{
+				if(!box_hits_triangle(&w->segment, extents, t, &r->fraction, r->normal))
+					continue;
+			}
+			else
+			{
+				if(!segment_hits_triangle(&w->segment, t, &r->fraction))
+					continue;
+				float sign = vec3_mul_inner(t->normal, w->segment.delta) > 0.f ? -1.f : 1.f;
+				vec3_scale(r->normal, t->normal, sign);
+			}
+			r->triangle = t->index;
+			r->brush = -1;
+			r->material = node->material;
+		}
+	}
+}
+
+// Clips the segment against the planes of a convex brush, pushed out by the box.
+static void trace_brush(TraceWork *w, s32 index)
+{
+	const MapBrush *brush = &w->q->mapbrushes[index];
+	const float *extents = w->q->extents;
+	const Segment *s = &w->segment;
+	BspTraceResult *r = w->result;
+	vec3 end;
+	vec3_add(end, s->start, s->delta);
+	float enter = -1.f, leave = 1.f;
+	const MapPlane *enter_plane = NULL;
+	bool starts_outside = false;
+	for(size_t i = 0; i < brush->plane_count; ++i)
+	{
+		const MapPlane *plane = &brush->planes[i];
+		float distance = plane->distance + fabsf(plane->normal[0]) * extents[0] + fabsf(plane->normal[1]) * extents[1] + fabsf(plane->normal[2]) * extents[2];
+		float d1 = vec3_mul_inner(plane->normal, s->start) - distance;
+		float d2 = vec3_mul_inner(plane->normal, end) - distance;
+		// Entirely in front of a single plane misses the brush.
+		if(d1 > 0.f && d2 > 0.f)
+			return;
+		if(d1 <= 0.f && d2 <= 0.f)
+			continue;
+		float f = d1 / (d1 - d2);
+		if(d1 > 0.f)
+		{
+			starts_outside = true;
+			if(f > enter)
+			{
+				enter = f;
+				enter_plane = plane;
+			}
+		}
+		else if(f < leave)
+		{
+			leave = f;
+		}
+	}
+	if(!starts_outside)
+	{
+		r->start_solid = true;
+		r->fraction = 0.f;
+		r->brush = index;
+		r->triangle = -1;
+		r->material = brush->plane_count > 0 ? brush->planes[0].materialIndex : -1;
+		memset(r->normal, 0, sizeof(r->normal));
+		return;
+	}
+	if(enter <= leave && enter < r->fraction)
+	{
+		r->fraction = enter;
+		r->brush = index;
+		r->triangle = -1;
+		r->material = enter_plane->materialIndex;
+		vec3_dup(r->normal, enter_plane->normal);
+	}
+}
+
+static void trace_leaf(TraceWork *w, s32 leaf_index)
+{
+	TraceQuery *q = w->q;
+	if((size_t)leaf_index >= q->leaf_count)
+		return;
+	const dleaf_t *leaf = &q->leafs[leaf_index];
+	if(leaf->firstLeafBrush < 0)
+		return;
+	for(size_t j = 0; j < leaf->numLeafBrushes && (size_t)leaf->firstLeafBrush + j < q->leafbrush_count; ++j)
+	{
+		s32 brush = q->leafbrushes[leaf->firstLeafBrush + j].brush;
+		if(brush < 0 || (size_t)brush >= q->brush_count || w->brush_stamps[brush] == w->stamp)
+			continue;
+		w->brush_stamps[brush] = w->stamp;
+		trace_brush(w, brush);
+	}
+}
+
+// Walks the node tree along the part of the segment between f1 and f2, nearest side first.
+static void trace_node(TraceWork *w, s32 node, float f1, float f2, const vec3 p1, const vec3 p2, int depth)
+{
+	if(f1 >= w->result->fraction)
+		return;
+	if(node < 0)
+	{
+		trace_leaf(w, -(node + 1));
+		return;
+	}
+	if(depth >= TRACE_MAX_DEPTH)
+		return;
+	const PointNode *n = &w->q->nodes[node];
+	const float *extents = w->q->extents;
+	float d1 = vec3_mul_inner(n->normal, p1) - n->dist;
+	float d2 = vec3_mul_inner(n->normal, p2) - n->dist;
+	// How far the box reaches towards the plane.
+	float offset = fabsf(n->normal[0]) * extents[0] + fabsf(n->normal[1]) * extents[1] + fabsf(n->normal[2]) * extents[2];
+	if(d1 >= offset + TRACE_PLANE_EPSILON && d2 >= offset + TRACE_PLANE_EPSILON)
+	{
+		trace_node(w, n->children[0], f1, f2, p1, p2, depth + 1);
+		return;
+	}
+	if(d1 < -offset - TRACE_PLANE_EPSILON && d2 < -offset - TRACE_PLANE_EPSILON)
+	{
+		trace_node(w, n->children[1], f1, f2, p1, p2, depth + 1);
+		return;
+	}
+	// The side the segment moves away from comes first, the two parts overlap a little around the plane.
+	int side = d1 < d2;
+	float near = 1.f, far = 0.f;
+	if(d1 != d2)
+	{
+		float inv = 1.f / (d1 - d2);
+		float margin = side ? -offset - TRACE_SPLIT_EPSILON : offset + TRACE_SPLIT_EPSILON;
+		near = (d1 + margin) * inv;
+		far = (d1 - margin) * inv;
+		near = near < 0.f ? 0.f : (near > 1.f ? 1.f : near);
+		far = far < 0.f ? 0.f : (far > 1.f ? 1.f : far);
+	}
+	vec3 mid, delta;
+	vec3_sub(delta, p2, p1);
+	for(int k = 0; k < 3; ++k)
+		mid[k] = p1[k] + near * delta[k];
+	trace_node(w, n->children[side], f1, f1 + near * (f2 - f1), p1, mid, depth + 1);
+	for(int k = 0; k < 3; ++k)
+		mid[k] = p1[k] + far * delta[k];
+	trace_node(w, n->children[!side], f1 + far * (f2 - f1), f2, mid, p2, depth + 1);
+}
+
+static void trace_chunk(void *ctx, size_t chunk)
+{
+	TraceQuery *q = ctx;
+	TraceWork w = { .q = q };
+	if(q->flags & BSP_TRACE_BRUSHES)
+		w.brush_stamps = calloc(q->brush_count + 1, sizeof(u32));
+	size_t begin = chunk * TRACE_CHUNK_SIZE;
+	size_t end = begin + TRACE_CHUNK_SIZE < q->count ? begin + TRACE_CHUNK_SIZE : q->count;
+	for(size_t i = begin; i < end; ++i)
+	{
+		BspTraceResult *r = &q->results[i];
+		memset(r, 0, sizeof(BspTraceResult));
+		r->fraction = 1.f;
+		r->triangle = r->brush = r->material = -1;
+		w.result = r;
+		segment_init(&w.segment, &q->rays[i], q->offset);
+		if((q->flags & BSP_TRACE_TRIANGLES) && q->collision->node_count > 0)
+			trace_triangles(&w);
+		if((q->flags & BSP_TRACE_BRUSHES) && q->nodes)
+		{
+			vec3 end;
+			vec3_add(end, w.segment.start, w.segment.delta);
+			++w.stamp;
+			trace_node(&w, 0, 0.f, 1.f, w.segment.start, end, 0);
+		}
+	}
+	buf_free(w.stack);
+	free(w.brush_stamps);
+}
+
+void bsp_trace_box(BspMap *map, const BspRay *rays, size_t count, const vec3 mins, const vec3 maxs, int flags, size_t thread_count, BspTraceResult *results)
+{
+	// Everything is loaded up front, the workers only read.
+	TraceQuery q = { .flags = flags, .rays = rays, .count = count, .results = results };
+	for(int k = 0; k < 3; ++k)
+	{
+		q.offset[k] = (mins[k] + maxs[k]) * 0.5f;
+		q.extents[k] = fabsf(maxs[k] - mins[k]) * 0.5f;
+		if(q.extents[k] > 0.f)
+			q.box = true;
+	}
+	if(flags & BSP_TRACE_TRIANGLES)
+		q.collision = get_collision_tree(map);
+	if(flags & BSP_TRACE_BRUSHES)
+	{
+		q.nodes = get_point_nodes(map);
+		q.node_count = map->pointnode_count;
+		load_lumps(map, (int[]) { LUMP_LEAFS, LUMP_LEAFBRUSHES }, 2);
+		LumpData *leafs = get_lump(map, LUMP_LEAFS);
+		LumpData *leafbrushes = get_lump(map, LUMP_LEAFBRUSHES);
+		q.leafs = leafs->data;
+		q.leaf_count = leafs->count;
+		q.leafbrushes = leafbrushes->data;
+		q.leafbrush_count = leafbrushes->count;
+		q.mapbrushes = get_map_brushes(map);
+		q.brush_count = buf_size(map->mapbrushes);
+	}
+	parallel_for((count + TRACE_CHUNK_SIZE - 1) / TRACE_CHUNK_SIZE, thread_count, trace_chunk, &q);
+}
+
+void bsp_trace(BspMap *map, const BspRay *rays, size_t count, int flags, size_t thread_count, BspTraceResult *results)
+{
+	const vec3 zero = { 0.f, 0.f, 0.f };
+	bsp_trace_box(map, rays, count, zero, zero, flags, thread_count, results);
+}
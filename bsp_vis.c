@@ -0,0 +1,312 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "bsp_internal.h"
+#include "thread.h"
+
+static u32 popcount_row(const u64 *row, size_t words)
+{
+	u32 n = 0;
+	for(size_t i = 0; i < words; ++i)
+		n += popcount64(row[i]);
+	return n;
+}
+
+// The lump starts with the number of clusters and the bytes per row, followed by one uncompressed row per cluster.
+typedef struct
+{
+	const u8 *rows; // NULL when the map has no visibility data, then every cluster sees every other one
+	s32 cluster_count;
+	s32 row_bytes;
+} VisLump;
+
+static void get_vis_lump(BspMap *map, VisLump *vis)
+{
+	memset(vis, 0, sizeof(VisLump));
+	LumpData *lump = get_lump(map, LUMP_VISIBILITY);
+	if(lump->count < 8)
+		return;
+	s32 header[2];
+	memcpy(header, lump->data, sizeof(header));
+	if(header[0] <= 0 || header[1] <= 0 || (s64)header[1] * 8 < header[0])
+		return;
+	if((u64)header[0] * (u64)header[1] > lump->count - 8)
+		return;
+	vis->rows = (const u8 *)lump->data + 8;
+	vis->cluster_count = header[0];
+	vis->row_bytes = header[1];
+}
+
+static bool cluster_visible(const VisLump *vis, s32 from, s32 to)
+{
+	if(from < 0 || to < 0)
+		return false;
+	if(!vis->rows)
+		return true;
+	if(from >= vis->cluster_count || to >= vis->cluster_count)
+		return false;
+	return (vis->rows[(size_t)from * vis->row_bytes + (to >> 3)] >> (to & 7)) & 1;
+}
+
+s32 bsp_cluster_count(BspMap *map)
+{
+	VisLump vis;
+	get_vis_lump(map, &vis);
+	return vis.cluster_count;
+}
+
+#define VIS_CHUNK_SIZE 1024
+#define VIS_CACHE_BYTES (4 << 20) // per worker
+
+typedef struct
+{
+	VisLump vis;
+	size_t cluster_count;
+	const s32 *leaf_clusters;
+	size_t leaf_count;
+	const s32 *entity_clusters;
+	size_t entity_count;
+	const BspPointResult *points;
+	size_t count;
+	size_t worker_count;
+	BspVisResult *results;
+	u64 *leaf_bits;
+	u64 *entity_bits;
+} VisQuery;
+
+// What a cluster sees: its row decoded into whole words with the bits past the last cluster cleared,
+// followed by the leafs and entities in those clusters. Each worker keeps the most recently used ones
+// that fit in VIS_CACHE_BYTES.
+typedef struct
+{
+	size_t cluster_words, leaf_words, entity_words, row_words;
+	size_t capacity;
+	u64 *rows;
+	s32 *slots; // per cluster, -1 when it isn't cached
+	s32 *clusters; // per slot
+	u32 *used;
+	BspVisResult *counts;
+	u32 tick;
+} VisCache;
+
+static void vis_cache_init(VisCache *c, const VisQuery *q)
+{
+	c->cluster_words = (q->cluster_count + 63) / 64;
+	c->leaf_words = (q->leaf_count + 63) / 64;
+	c->entity_words = (q->entity_count + 63) / 64;
+	c->row_words = c->cluster_words + c->leaf_words + c->entity_words;
+	c->capacity = VIS_CACHE_BYTES / (c->row_words * sizeof(u64) + 1);
+	if(c->capacity > q->cluster_count)
+		c->capacity = q->cluster_count;
+	if(c->capacity < 1)
+		c->capacity = 1;
+	c->rows = malloc((c->capacity * c->row_words + 1) * sizeof(u64));
+	c->slots = malloc((q->cluster_count + 1) * sizeof(s32));
+	c->clusters = malloc(c->capacity * sizeof(s32));
+	c->used = calloc(c->capacity, sizeof(u32));
+	c->counts = malloc(c->capacity * sizeof(BspVisResult));
+	for(size_t i = 0; i < q->cluster_count; ++i)
+		c->slots[i] = -1;
+	for(size_t i = 0; i < c->capacity; ++i)
+		c->clusters[i] = -1;
+	c->tick = 0;
+}
+
+static void vis_cache_free(VisCache *c)
+{
+	free(c->rows);
+	free(c->slots);
+	free(c->clusters);
+	free(c->used);
+	free(c->counts);
+}
+
+static void decode_row(const VisQuery *q, s32 cluster, u64 *row, size_t words)
+{
+	size_t cluster_count = q->cluster_count;
+	if(!q->vis.rows)
+	{
+		memset(row, 0xff, words * sizeof(u64));
+		if(cluster_count & 63)
+			row[words - 1] = ((u64)1 << (cluster_count & 63)) - 1;
+		return;
+	}
+	const u8 *src = q->vis.rows + (size_t)cluster * q->vis.row_bytes;
+	memset(row, 0, words * sizeof(u64));
+	memcpy(row, src, cluster_count / 8);
+	// The rest of the last byte may hold padding bits.
+	for(size_t k = cluster_count & ~(size_t)7; k < cluster_count; ++k)
+	{
+		if((src[k >> 3] >> (k & 7)) & 1)
+			row[k >> 6] |= (u64)1 << (k & 63);
+	}
+}
+
+// Sets the bits of the items whose cluster is set in row.
+static u32 gather_visible(const u64 *row, const s32 *clusters, size_t item_count, size_t cluster_count, u64 *bits)
+{
+	u32 visible = 0;
+	for(size_t base = 0; base < item_count; base += 64)
+	{
+		u64 word = 0;
+		size_t n = item_count - base < 64 ? item_count - base : 64;
+		for(size_t k = 0; k < n; ++k)
+		{
+			s32 c = clusters[base + k];
+			if(c >= 0 && (size_t)c < cluster_count)
+				word |= ((row[c >> 6] >> (c & 63)) & 1) << k;
+		}
+		bits[base / 64] = word;
+		visible += popcount64(word);
+	}
+	return visible;
+}
+
+// Returns the cache slot of the cluster, filling it when it isn't cached yet.
+static s32 vis_lookup(VisCache *c, const VisQuery *q, s32 cluster)
+{
+	s32 slot = c->slots[cluster];
+	if(slot >= 0)
+	{
+		c->used[slot] = ++c->tick;
+		return slot;
+	}
+	// Only a miss pays for finding the least recently used slot, next to decoding the row it is cheap.
+	slot = 0;
+	for(size_t i = 1; i < c->capacity; ++i)
+	{
+		if(c->used[i] < c->used[slot])
+			slot = (s32)i;
+	}
+	if(c->clusters[slot] >= 0)
+		c->slots[c->clusters[slot]] = -1;
+	u64 *row = &c->rows[slot * c->row_words];
+	u64 *leafs = row + c->cluster_words;
+	u64 *entities = leafs + c->leaf_words;
+	decode_row(q, cluster, row, c->cluster_words);
+	BspVisResult *counts = &c->counts[slot];
+	counts->cluster = cluster;
+	counts->clusters = popcount_row(row, c->cluster_words);
+	counts->leafs = gather_visible(row, q->leaf_clusters, q->leaf_count, q->cluster_count, leafs);
+	counts->entities = gather_visible(row, q->entity_clusters, q->entity_count, q->cluster_count, entities);
+	c->clusters[slot] = cluster;
+	c->slots[cluster] = slot;
+	c->used[slot] = ++c->tick;
+	return slot;
+}
+
+// Each worker takes an equal range of the points so its cache lives through all of them.
+static void point_visibility_range(void *ctx, size_t worker)
+{
+	VisQuery *q = ctx;
+	VisCache cache;
+	vis_cache_init(&cache, q);
+	size_t begin = q->count * worker / q->worker_count;
+	size_t end = q->count * (worker + 1) / q->worker_count;
+	for(size_t i = begin; i < end; ++i)
+	{
+		BspVisResult *r = &q->results[i];
+		u64 *leaf_bits = q->leaf_bits ? &q->leaf_bits[i * cache.leaf_words] : NULL;
+		u64 *entity_bits = q->entity_bits ? &q->entity_bits[i * cache.entity_words] : NULL;
+		s32 cluster = q->points[i].cluster;
+		// Points outside the map or in a cluster the visibility data doesn't cover see nothing.
+		if(cluster < 0 || (size_t)cluster >= q->cluster_count)
+		{
+			memset(r, 0, sizeof(BspVisResult));
+			r->cluster = cluster;
+			if(leaf_bits)
+				memset(leaf_bits, 0, cache.leaf_words * sizeof(u64));
+			if(entity_bits)
+				memset(entity_bits, 0, cache.entity_words * sizeof(u64));
+			continue;
+		}
+		s32 slot = vis_lookup(&cache, q, cluster);
+		*r = cache.counts[slot];
+		const u64 *row = &cache.rows[slot * cache.row_words];
+		if(leaf_bits)
+			memcpy(leaf_bits, row + cache.cluster_words, cache.leaf_words * sizeof(u64));
+		if(entity_bits)
+			memcpy(entity_bits, row + cache.cluster_words + cache.leaf_words, cache.entity_words * sizeof(u64));
+	}
+	vis_cache_free(&cache);
+}
+
+void bsp_point_visibility(BspMap *map, const vec3 *points, size_t count, size_t thread_count, BspVisResult *results, u64 *leaf_bits, u64 *entity_bits)
+{
+	VisQuery q = { .count = count, .results = results, .leaf_bits = leaf_bits, .entity_bits = entity_bits };
+	load_lumps(map, (int[]) { LUMP_VISIBILITY, LUMP_LEAFS }, 2);
+	get_vis_lump(map, &q.vis);
+
+	LumpData *leafs = get_lump(map, LUMP_LEAFS);
+	s32 *leaf_clusters = malloc((leafs->count + 1) * sizeof(s32));
+	s32 max_cluster = -1;
+	for(size_t i = 0; i < leafs->count; ++i)
+	{
+		leaf_clusters[i] = ((dleaf_t *)leafs->data)[i].cluster;
+		if(leaf_clusters[i] > max_cluster)
+			max_cluster = leaf_clusters[i];
+	}
+	// Without visibility data the clusters are only known from the leafs.
+	q.cluster_count = q.vis.rows ? (size_t)q.vis.cluster_count : (size_t)(max_cluster + 1);
+	q.leaf_clusters = leaf_clusters;
+	q.leaf_count = leafs->count;
+
+	// Entities are placed by their origin, those without one are never visible.
+	EntityList *entities = get_entities(map, NULL);
+	vec3 *origins = malloc((entities->entity_count + 1) * sizeof(vec3));
+	bool *has_origin = malloc(entities->entity_count + 1);
+	for(size_t i = 0; i < entities->entity_count; ++i)
+	{
+		const char *origin = entity_key_by_value(&entities->entities[i], "origin");
+		has_origin[i] = origin && sscanf(origin, "%f %f %f", &origins[i][0], &origins[i][1], &origins[i][2]) == 3;
+		if(!has_origin[i])
+			memset(origins[i], 0, sizeof(vec3));
+	}
+	BspPointResult *located = malloc((entities->entity_count + count + 1) * sizeof(BspPointResult));
+	bsp_point_query(map, (const vec3 *)origins, entities->entity_count, 0, thread_count, located);
+	s32 *entity_clusters = malloc((entities->entity_count + 1) * sizeof(s32));
+	for(size_t i = 0; i < entities->entity_count; ++i)
+		entity_clusters[i] = has_origin[i] ? located[i].cluster : -1;
+	q.entity_clusters = entity_clusters;
+	q.entity_count = entities->entity_count;
+
+	BspPointResult *from = &located[entities->entity_count];
+	bsp_point_query(map, points, count, 0, thread_count, from);
+	q.points = from;
+	q.worker_count = (count + VIS_CHUNK_SIZE - 1) / VIS_CHUNK_SIZE;
+	if(q.worker_count > thread_count)
+		q.worker_count = thread_count;
+	if(q.worker_count < 1)
+		q.worker_count = 1;
+	parallel_for(q.worker_count, q.worker_count, point_visibility_range, &q);
+
+	free(located);
+	free(entity_clusters);
+	free(has_origin);
+	free(origins);
+	free(leaf_clusters);
+}
+
+typedef struct
+{
+	VisLump vis;
+	const BspClusterPair *pairs;
+	size_t count;
+	u8 *visible;
+} PairQuery;
+
+static void cluster_visibility_chunk(void *ctx, size_t chunk)
+{
+	PairQuery *q = ctx;
+	size_t begin = chunk * VIS_CHUNK_SIZE;
+	size_t end = begin + VIS_CHUNK_SIZE < q->count ? begin + VIS_CHUNK_SIZE : q->count;
+	for(size_t i = begin; i < end; ++i)
+		q->visible[i] = cluster_visible(&q->vis, q->pairs[i].from, q->pairs[i].to);
+}
+
+void bsp_cluster_visibility(BspMap *map, const BspClusterPair *pairs, size_t count, size_t thread_count, u8 *visible)
+{
+	PairQuery q = { .pairs = pairs, .count = count, .visible = visible };
+	get_vis_lump(map, &q.vis);
+	parallel_for((count + VIS_CHUNK_SIZE - 1) / VIS_CHUNK_SIZE, thread_count, cluster_visibility_chunk, &q);
+}
@@ -1,63 +1,378 @@
 #include "entity_parser.h"
-#include "stream.h"
-#include "stream_buffer.h"
 #include "lump.h"
 #include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
 #include <growable-buf/buf.h>
-#include <assert.h>
 
-extern LumpData lumpdata[LUMP_MAX];
+void entity_tokenizer_init(EntityTokenizer *t, const char *data, size_t length)
+{
+	t->cur = data;
+	t->end = data + length;
+	t->line = 1;
+}
 
-Entity *parse_entities()
+// Scans the lump in place, the entity text ends at the end of the lump or at the first NUL.
+// Like the game, strings have no escapes and end at the next quote, so a value such as "maps\" keeps its backslash.
+int entity_next_token(EntityTokenizer *t, EntityToken *token)
 {
-	Stream s = {0};
-	StreamBuffer sb = {0};
-	init_stream_from_buffer(&s, &sb, lumpdata[LUMP_ENTITIES].data, lumpdata[LUMP_ENTITIES].count);
-	
-    char line[2048];
-	unsigned int node_depth = PARSE_NODE_DEPTH_ROOT;
-	Entity *entities = NULL;
-    Entity *entity = NULL;
+	const char *p = t->cur;
+	const char *end = t->end;
+	while(p < end && *p && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+	{
+		if(*p == '\n')
+			++t->line;
+		++p;
+	}
+	token->ptr = p;
+	token->length = 0;
+	token->line = t->line;
+	if(p >= end || !*p)
+	{
+		t->cur = p;
+		token->type = ENTITY_TOKEN_END;
+		return token->type;
+	}
+	switch(*p)
+	{
+		case '{':
+			token->type = ENTITY_TOKEN_OPEN;
+			++p;
+			break;
+		case '}':
+			token->type = ENTITY_TOKEN_CLOSE;
+			++p;
+			break;
+		case '"':
+		{
+			const char *start = ++p;
+			while(p < end && *p && *p != '"')
+			{
+				if(*p == '\n')
+					++t->line;
+				++p;
+			}
+			if(p >= end || *p != '"')
+			{
+				token->type = ENTITY_TOKEN_ERROR;
+				break;
+			}
+			token->type = ENTITY_TOKEN_STRING;
+			token->ptr = start;
+			token->length = p - start;
+			++p;
+		}
+		break;
+		default:
+			token->type = ENTITY_TOKEN_ERROR;
+			break;
+	}
+	t->cur = p;
+	return token->type;
+}
 
-	while(!stream_read_line(&s, line, sizeof(line)))
+static u32 hash_string(const char *s, size_t n)
+{
+	u32 h = 2166136261u;
+	for(size_t i = 0; i < n; ++i)
 	{
-		size_t offsz = 0;
-		while(line[offsz] && line[offsz] == ' ')
-			offsz++;
+		h ^= (u8)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
 
-		switch(line[offsz])
+// Allocates an empty open addressing table that keeps the load factor at or below one half.
+static u32 *alloc_slots(Arena *a, size_t count, u32 *mask)
+{
+	u32 size = 2;
+	while(size < count * 2)
+		size <<= 1;
+	u32 *slots = arena_alloc(a, size * sizeof(u32));
+	memset(slots, 0, size * sizeof(u32));
+	*mask = size - 1;
+	return slots;
+}
+
+// While a list is built the key table is on the heap and grows, entity_list_end moves it into the arena.
+static void rehash_keys(EntityList *list, size_t count)
+{
+	u32 size = 2;
+	while(size < count * 2)
+		size <<= 1;
+	free(list->key_slots);
+	list->key_slots = calloc(size, sizeof(u32));
+	list->key_slot_mask = size - 1;
+	for(size_t k = 0; k < list->key_count; ++k)
+	{
+		u32 i = list->key_hashes[k] & list->key_slot_mask;
+		while(list->key_slots[i])
+			i = (i + 1) & list->key_slot_mask;
+		list->key_slots[i] = k + 1;
+	}
+}
+
+static const char *intern_key(EntityList *list, const char *s, size_t n, u32 *hash)
+{
+	*hash = hash_string(s, n);
+	for(u32 i = *hash & list->key_slot_mask;; i = (i + 1) & list->key_slot_mask)
+	{
+		u32 slot = list->key_slots[i];
+		if(!slot)
 		{
-			case '{':
-				++node_depth;
-                assert(node_depth == PARSE_NODE_DEPTH_ENTITY);
-                buf_push(entities, (Entity) { 0 });
-                entity = &entities[buf_size(entities) - 1];
-			break;
-			case '}':
-				assert(node_depth != PARSE_NODE_DEPTH_ROOT);
-				--node_depth;
-			break;
-			case '(':
+			if((list->key_count + 1) * 2 > (size_t)list->key_slot_mask + 1)
 			{
-                fprintf(stderr, "No support for parsing brushes.\n");
-                exit(1);
-			} break;
-			case '"':
+				rehash_keys(list, list->key_count + 1);
+				return intern_key(list, s, n, hash);
+			}
+			const char *key = arena_strndup(&list->arena, s, n);
+			buf_push(list->keys, key);
+			buf_push(list->key_hashes, *hash);
+			list->key_slots[i] = ++list->key_count;
+			return key;
+		}
+		const char *key = list->keys[slot - 1];
+		if(list->key_hashes[slot - 1] == *hash && !strncmp(key, s, n) && !key[n])
+			return key;
+	}
+}
+
+static void build_entity_slots(Arena *a, Entity *e)
+{
+	e->slots = alloc_slots(a, e->keyvalue_count, &e->slot_mask);
+	for(size_t i = 0; i < e->keyvalue_count; ++i)
+	{
+		// Duplicate keys keep their order, so a lookup finds the first one like a linear scan would.
+		u32 j = e->keyvalues[i].key_hash & e->slot_mask;
+		while(e->slots[j])
+			j = (j + 1) & e->slot_mask;
+		e->slots[j] = i + 1;
+	}
+}
+
+static EntityGroup *find_group(EntityIndex *index, const char *value, bool insert)
+{
+	u32 hash = hash_string(value, strlen(value));
+	for(u32 i = hash & index->slot_mask;; i = (i + 1) & index->slot_mask)
+	{
+		u32 slot = index->slots[i];
+		if(!slot)
+		{
+			if(!insert)
+				return NULL;
+			EntityGroup *g = &index->groups[index->group_count];
+			*g = (EntityGroup) { .value = value, .hash = hash };
+			index->slots[i] = ++index->group_count;
+			return g;
+		}
+		EntityGroup *g = &index->groups[slot - 1];
+		if(g->hash == hash && !strcmp(g->value, value))
+			return g;
+	}
+}
+
+// Groups the entities by the value of key, entities without the key are left out.
+static void build_index(EntityList *list, EntityIndex *index, const char *key)
+{
+	size_t n = list->entity_count;
+	index->groups = arena_alloc(&list->arena, n * sizeof(EntityGroup));
+	index->group_count = 0;
+	index->slots = alloc_slots(&list->arena, n, &index->slot_mask);
+	u32 *group_of = malloc(n * sizeof(u32));
+	for(size_t i = 0; i < n; ++i)
+	{
+		const char *value = entity_key_by_value(&list->entities[i], key);
+		group_of[i] = UINT32_MAX;
+		if(!*value)
+			continue;
+		EntityGroup *g = find_group(index, value, true);
+		++g->count;
+		group_of[i] = g - index->groups;
+	}
+	u32 first = 0;
+	for(size_t i = 0; i < index->group_count; ++i)
+	{
+		index->groups[i].first = first;
+		first += index->groups[i].count;
+		index->groups[i].count = 0;
+	}
+	index->entities = arena_alloc(&list->arena, first * sizeof(u32));
+	for(size_t i = 0; i < n; ++i)
+	{
+		if(group_of[i] == UINT32_MAX)
+			continue;
+		EntityGroup *g = &index->groups[group_of[i]];
+		index->entities[g->first + g->count++] = i;
+	}
+	free(group_of);
+}
+
+void entity_list_begin(EntityList *list, size_t entity_count, size_t keyvalue_count, size_t string_size)
+{
+	memset(list, 0, sizeof(EntityList));
+	// The first block is sized so the records, strings and tables of most maps fit in it.
+	arena_init(&list->arena, string_size + entity_count * (sizeof(Entity) + 2 * sizeof(EntityGroup) + 64) +
+								 keyvalue_count * (sizeof(KeyValuePair) + sizeof(char *) + 64));
+	// The records are growable buffers until the list is complete.
+	if(entity_count)
+		buf_grow(list->entities, entity_count);
+	if(keyvalue_count)
+		buf_grow(list->keyvalues, keyvalue_count);
+	rehash_keys(list, 16);
+}
+
+void entity_list_add_entity(EntityList *list)
+{
+	// The pairs are placed once the list is complete, until then the array they are in can move.
+	buf_push(list->entities, ((Entity) { 0 }));
+	++list->entity_count;
+}
+
+void entity_list_add_pair(EntityList *list, const char *key, size_t key_length, char *value)
+{
+	KeyValuePair kvp = { .value = value };
+	kvp.key = intern_key(list, key, key_length, &kvp.key_hash);
+	buf_push(list->keyvalues, kvp);
+	++list->keyvalue_count;
+	++list->entities[list->entity_count - 1].keyvalue_count;
+}
+
+static void *move_to_arena(Arena *a, const void *data, size_t size)
+{
+	void *dst = arena_alloc(a, size);
+	if(size)
+		memcpy(dst, data, size);
+	return dst;
+}
+
+void entity_list_end(EntityList *list)
+{
+	Entity *entities = move_to_arena(&list->arena, list->entities, list->entity_count * sizeof(Entity));
+	buf_free(list->entities);
+	list->entities = entities;
+	KeyValuePair *keyvalues = move_to_arena(&list->arena, list->keyvalues, list->keyvalue_count * sizeof(KeyValuePair));
+	buf_free(list->keyvalues);
+	list->keyvalues = keyvalues;
+	const char **keys = move_to_arena(&list->arena, list->keys, list->key_count * sizeof(char *));
+	buf_free(list->keys);
+	list->keys = keys;
+	u32 *key_hashes = move_to_arena(&list->arena, list->key_hashes, list->key_count * sizeof(u32));
+	buf_free(list->key_hashes);
+	list->key_hashes = key_hashes;
+	u32 *key_slots = move_to_arena(&list->arena, list->key_slots, ((size_t)list->key_slot_mask + 1) * sizeof(u32));
+	free(list->key_slots);
+	list->key_slots = key_slots;
+
+	// Pairs are always added to the last entity, so every entity owns the range after the previous one.
+	size_t first = 0;
+	for(size_t i = 0; i < list->entity_count; ++i)
+	{
+		Entity *e = &list->entities[i];
+		e->keyvalues = &list->keyvalues[first];
+		first += e->keyvalue_count;
+		build_entity_slots(&list->arena, e);
+	}
+	build_index(list, &list->by_classname, "classname");
+	build_index(list, &list->by_targetname, "targetname");
+}
+
+// The entity text is walked once, the records grow as they are added.
+int parse_entities(EntityList *list, LumpData *lump, Writer *log)
+{
+	EntityTokenizer t;
+	entity_tokenizer_init(&t, lump->data, lump->count);
+	// Strings never take more space than the quoted text in the lump. The counts are rough guesses of a
+	// typical entity lump, pairs average around 32 bytes of text and entities a handful of pairs.
+	entity_list_begin(list, lump->count / 128 + 1, lump->count / 32 + 1, lump->count);
+
+	bool in_entity = false;
+	EntityToken token;
+	int result = 0;
+	while(!result && entity_next_token(&t, &token) != ENTITY_TOKEN_END)
+	{
+		switch(token.type)
+		{
+			case ENTITY_TOKEN_OPEN:
+				if(in_entity)
+				{
+					if(log)
+						writer_printf(log, "Line %zu: no support for parsing brushes.\n", token.line);
+					result = 1;
+					break;
+				}
+				entity_list_add_entity(list);
+				in_entity = true;
+				break;
+			case ENTITY_TOKEN_CLOSE:
+				if(!in_entity)
+				{
+					if(log)
+						writer_printf(log, "Line %zu: unexpected '}'.\n", token.line);
+					result = 1;
+					break;
+				}
+				in_entity = false;
+				break;
+			case ENTITY_TOKEN_STRING:
 			{
-				if(node_depth == PARSE_NODE_DEPTH_ENTITY)
+				EntityToken value;
+				if(!in_entity || entity_next_token(&t, &value) != ENTITY_TOKEN_STRING)
 				{
-                    char key[512];
-                    char value[512];
-					sscanf(line, "\"%511[^\"]\" \"%511[^\"]\"", key, value);
-					assert(entity);
-					buf_push(entity->keyvalues, (KeyValuePair) { 0 });
-					KeyValuePair *kvp = &entity->keyvalues[buf_size(entity->keyvalues) - 1];
-                    // Leaking memory, but fine for this particular instance.
-                    kvp->key = strdup(key);
-                    kvp->value = strdup(value);
+					if(log)
+						writer_printf(log, "Line %zu: expected a key value pair inside an entity.\n", token.line);
+					result = 1;
+					break;
 				}
-			} break;
+				char *v = arena_alloc_aligned(&list->arena, value.length + 1, 1);
+				memcpy(v, value.ptr, value.length);
+				v[value.length] = 0;
+				entity_list_add_pair(list, token.ptr, token.length, v);
+			}
+			break;
+			default:
+				if(log)
+					writer_printf(log, "Line %zu: unexpected character '%c'.\n", token.line, *token.ptr);
+				result = 1;
+				break;
 		}
 	}
-    return entities;
-}
\ No newline at end of file
+	entity_list_end(list);
+	return result;
+}
+
+void free_entities(EntityList *list)
+{
+	arena_free(&list->arena);
+	memset(list, 0, sizeof(EntityList));
+}
+
+const char *entity_key_by_value(Entity *ent, const char *key)
+{
+	u32 hash = hash_string(key, strlen(key));
+	for(u32 i = hash & ent->slot_mask; ent->slots[i]; i = (i + 1) & ent->slot_mask)
+	{
+		KeyValuePair *kvp = &ent->keyvalues[ent->slots[i] - 1];
+		if(kvp->key_hash == hash && !strcmp(kvp->key, key))
+			return kvp->value;
+	}
+	return "";
+}
+
+const char *entity_intern_key(EntityList *list, const char *key)
+{
+	u32 hash = hash_string(key, strlen(key));
+	for(u32 i = hash & list->key_slot_mask; list->key_slots[i]; i = (i + 1) & list->key_slot_mask)
+	{
+		u32 k = list->key_slots[i] - 1;
+		if(list->key_hashes[k] == hash && !strcmp(list->keys[k], key))
+			return list->keys[k];
+	}
+	return NULL;
+}
+
+const u32 *entity_index_find(EntityIndex *index, const char *value, size_t *count)
+{
+	EntityGroup *g = find_group(index, value, false);
+	*count = g ? g->count : 0;
+	return g ? &index->entities[g->first] : NULL;
+}
@@ -1,20 +1,103 @@
 #pragma once
+#include "lump.h"
+#include "arena.h"
+#include "writer.h"
 
 enum
 {
-	PARSE_NODE_DEPTH_ROOT,
-	PARSE_NODE_DEPTH_ENTITY,
-	PARSE_NODE_DEPTH_BRUSH
+	ENTITY_TOKEN_END,
+	ENTITY_TOKEN_OPEN,
+	ENTITY_TOKEN_CLOSE,
+	ENTITY_TOKEN_STRING,
+	ENTITY_TOKEN_ERROR
 };
 
+typedef struct
+{
+	int type;
+	const char *ptr; // for strings the text between the quotes, pointing into the lump
+	size_t length;
+	size_t line;
+} EntityToken;
+
+typedef struct
+{
+	const char *cur;
+	const char *end;
+	size_t line;
+} EntityTokenizer;
+
+void entity_tokenizer_init(EntityTokenizer *t, const char *data, size_t length);
+int entity_next_token(EntityTokenizer *t, EntityToken *token);
+
 typedef struct KeyValuePair_s
 {
-    // struct KeyValuePair_s *next;
-	char *key;
+	const char *key; // interned, equal keys share one string
 	char *value;
+	u32 key_hash;
 } KeyValuePair;
 
 typedef struct Entity_s
 {
 	KeyValuePair *keyvalues;
-} Entity;
\ No newline at end of file
+	size_t keyvalue_count;
+	u32 *slots; // open addressing table of keyvalue index + 1, probed by key hash
+	u32 slot_mask;
+} Entity;
+
+typedef struct
+{
+	const char *value;
+	u32 hash;
+	u32 first, count; // range in EntityIndex.entities
+} EntityGroup;
+
+// Entities grouped by the value of one key.
+typedef struct
+{
+	EntityGroup *groups;
+	size_t group_count;
+	u32 *slots; // group index + 1
+	u32 slot_mask;
+	u32 *entities; // entity indices, grouped and in file order within a group
+} EntityIndex;
+
+// Entities, their key/value records, strings and lookup tables all live in one arena and are freed together.
+typedef struct
+{
+	Entity *entities;
+	size_t entity_count;
+	KeyValuePair *keyvalues; // every pair, each entity references a range of it
+	size_t keyvalue_count;
+
+	const char **keys; // interned keys
+	u32 *key_hashes;
+	size_t key_count;
+	u32 *key_slots; // key index + 1
+	u32 key_slot_mask;
+
+	EntityIndex by_classname;
+	EntityIndex by_targetname;
+	Arena arena;
+} EntityList;
+
+// Builds a list from entities that were decoded elsewhere. Storage for entity_count entities and keyvalue_count
+// pairs is reserved up front and grown when more are added, string_size is a hint for the arena. Keys are copied,
+// values are referenced and have to outlive the list.
+void entity_list_begin(EntityList *list, size_t entity_count, size_t keyvalue_count, size_t string_size);
+void entity_list_add_entity(EntityList *list);
+// Adds a pair to the entity that was added last.
+void entity_list_add_pair(EntityList *list, const char *key, size_t key_length, char *value);
+// Builds the lookup tables, the list can't be added to afterwards.
+void entity_list_end(EntityList *list);
+
+// Malformed input is reported to log, which may be NULL, and the entities parsed up to that point are kept.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+int parse_entities(EntityList *list, LumpData *lump, Writer *log);
+void free_entities(EntityList *list);
+// Returns an empty string if the key is not set.
+const char *entity_key_by_value(Entity *ent, const char *key);
+// Returns the interned key or NULL if no entity has the key.
+const char *entity_intern_key(EntityList *list, const char *key);
+// Returns the indices of the entities with the given value, count is set to the number of entities.
+const u32 *entity_index_find(EntityIndex *index, const char *value, size_t *count);
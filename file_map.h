@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Read-only view of a whole file.
+
+typedef struct
+{
+	void *data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+} FileMap;
+
+static int file_map_open(FileMap *fm, const char *path)
+{
+	fm->data = NULL;
+	fm->size = 0;
+#ifdef _WIN32
+	fm->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(fm->file == INVALID_HANDLE_VALUE)
+		return 1;
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(fm->file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(fm->file);
+		return 1;
+	}
+	fm->mapping = CreateFileMappingA(fm->file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(!fm->mapping)
+	{
+		CloseHandle(fm->file);
+		return 1;
+	}
+	fm->data = MapViewOfFile(fm->mapping, FILE_MAP_READ, 0, 0, 0);
+	if(!fm->data)
+	{
+		CloseHandle(fm->mapping);
+		CloseHandle(fm->file);
+		return 1;
+	}
+	fm->size = (size_t)size.QuadPart;
+#else
+	fm->fd = open(path, O_RDONLY);
+	if(fm->fd == -1)
+		return 1;
+	struct stat st;
+	if(fstat(fm->fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fm->fd);
+		return 1;
+	}
+	void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fm->fd, 0);
+	if(data == MAP_FAILED)
+	{
+		close(fm->fd);
+		return 1;
+	}
+	fm->data = data;
+	fm->size = (size_t)st.st_size;
+#endif
+	return 0;
+}
+
+static int file_map_close(FileMap *fm)
+{
+	if(!fm->data)
+		return 1;
+#ifdef _WIN32
+	UnmapViewOfFile(fm->data);
+	CloseHandle(fm->mapping);
+	CloseHandle(fm->file);
+#else
+	munmap(fm->data, fm->size);
+	close(fm->fd);
+#endif
+	fm->data = NULL;
+	fm->size = 0;
+	return 0;
+}
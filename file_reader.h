@@ -0,0 +1,315 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stream.h"
+#include "thread.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef BSP_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+// Reads many ranges of a file with all of them in flight at once. On Linux this uses io_uring when it is
+// available at build and run time, otherwise the ranges are spread over a pool of threads doing positional reads.
+// Keeping requests in flight hides per-request latency on network storage.
+
+typedef struct
+{
+#ifdef _WIN32
+	HANDLE file;
+#else
+	int fd;
+#endif
+	int64_t size;
+} FileReader;
+
+#define FILE_READER_QUEUE_DEPTH 64
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int file_reader_open(FileReader *f, const char *path)
+{
+#ifdef _WIN32
+	f->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(f->file == INVALID_HANDLE_VALUE)
+		return 1;
+	LARGE_INTEGER size;
+	if(!GetFileSizeEx(f->file, &size))
+	{
+		CloseHandle(f->file);
+		return 1;
+	}
+	f->size = size.QuadPart;
+#else
+	f->fd = open(path, O_RDONLY);
+	if(f->fd == -1)
+		return 1;
+	struct stat st;
+	if(fstat(f->fd, &st) == -1)
+	{
+		close(f->fd);
+		return 1;
+	}
+	f->size = st.st_size;
+#endif
+	return 0;
+}
+
+static void file_reader_close(FileReader *f)
+{
+#ifdef _WIN32
+	CloseHandle(f->file);
+#else
+	close(f->fd);
+#endif
+}
+
+// Reads one range completely, retrying short reads.
+static bool file_reader_pread_(FileReader *f, StreamRange *r)
+{
+	size_t done = 0;
+	while(done < r->length)
+	{
+#ifdef _WIN32
+		OVERLAPPED ov = { 0 };
+		int64_t offset = r->offset + done;
+		ov.Offset = (DWORD)offset;
+		ov.OffsetHigh = (DWORD)(offset >> 32);
+		size_t left = r->length - done;
+		DWORD want = left > 0x40000000 ? 0x40000000 : (DWORD)left;
+		DWORD n = 0;
+		if(!ReadFile(f->file, (char *)r->ptr + done, want, &n, &ov) || n == 0)
+			return false;
+#else
+		ssize_t n = pread(f->fd, (char *)r->ptr + done, r->length - done, r->offset + done);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+#endif
+		done += n;
+	}
+	return true;
+}
+
+typedef struct
+{
+	FileReader *reader;
+	StreamRange *ranges;
+	bool failed;
+} FileReaderJob;
+
+static void file_reader_worker_(void *ctx, size_t index)
+{
+	FileReaderJob *job = ctx;
+	// Every range is read by one thread, a lost race on failed only ever sets it to true.
+	if(!file_reader_pread_(job->reader, &job->ranges[index]))
+		job->failed = true;
+}
+
+#ifdef BSP_HAVE_IO_URING
+
+typedef struct
+{
+	int fd;
+	unsigned entries;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+} IoRing;
+
+static void io_ring_free_(IoRing *r)
+{
+	if(r->sqes && r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	if(r->cq_ring && r->cq_ring != MAP_FAILED)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if(r->sq_ring && r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int io_ring_init_(IoRing *r, unsigned entries)
+{
+	memset(r, 0, sizeof(IoRing));
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if(r->fd < 0)
+		return 1; // not supported by the kernel or blocked by a sandbox
+	r->entries = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		io_ring_free_(r);
+		return 1;
+	}
+	char *sq = r->sq_ring;
+	r->sq_head = (unsigned *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + p.sq_off.array);
+	char *cq = r->cq_ring;
+	r->cq_head = (unsigned *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+}
+
+typedef struct
+{
+	struct iovec iov;
+	size_t done;
+} IoRequest;
+
+// Returns 0 if every range was read, 1 if a read failed and -1 if io_uring can't be used.
+static int file_reader_read_uring_(FileReader *f, StreamRange *ranges, size_t count)
+{
+	IoRing ring;
+	unsigned depth = count < FILE_READER_QUEUE_DEPTH ? (unsigned)count : FILE_READER_QUEUE_DEPTH;
+	if(io_ring_init_(&ring, depth))
+		return -1;
+	IoRequest *requests = calloc(count, sizeof(IoRequest));
+	// Ranges waiting to be submitted, short reads are queued again for the rest.
+	size_t *queue = malloc(count * sizeof(size_t));
+	size_t queued = 0;
+	size_t completed = 0;
+	for(size_t i = count; i > 0; --i)
+	{
+		// A read of zero bytes completes with 0, which would look like the end of the file.
+		if(ranges[i - 1].length == 0)
+			++completed;
+		else
+			queue[queued++] = i - 1;
+	}
+
+	size_t in_flight = 0;
+	size_t submitted = 0;
+	int status = 0;
+	while(completed < count && !status)
+	{
+		unsigned tail = *ring.sq_tail;
+		while(queued > 0 && in_flight < ring.entries)
+		{
+			size_t index = queue[--queued];
+			IoRequest *req = &requests[index];
+			StreamRange *r = &ranges[index];
+			req->iov.iov_base = (char *)r->ptr + req->done;
+			req->iov.iov_len = r->length - req->done;
+			unsigned slot = tail & *ring.sq_mask;
+			struct io_uring_sqe *sqe = &ring.sqes[slot];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = IORING_OP_READV;
+			sqe->fd = f->fd;
+			sqe->off = r->offset + req->done;
+			sqe->addr = (uintptr_t)&req->iov;
+			sqe->len = 1;
+			sqe->user_data = index;
+			ring.sq_array[slot] = slot;
+			++tail;
+			++in_flight;
+		}
+		__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+		// Entries the kernel didn't take on an earlier call are passed again.
+		unsigned pending = tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		long ret = syscall(__NR_io_uring_enter, ring.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			// Entries the kernel didn't take are withdrawn, so the drain below only waits for the ones it did.
+			unsigned sq_head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+			__atomic_store_n(ring.sq_tail, sq_head, __ATOMIC_RELEASE);
+			in_flight -= tail - sq_head;
+			// If nothing ever reached the kernel the thread pool can still take over.
+			status = submitted == 0 ? -1 : 1;
+			break;
+		}
+		if(ret > 0)
+			submitted += ret;
+		unsigned head = *ring.cq_head;
+		unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for(; head != cq_tail; ++head)
+		{
+			struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+			size_t index = (size_t)cqe->user_data;
+			int res = cqe->res;
+			--in_flight;
+			if(res == -EAGAIN || res == -EINTR)
+			{
+				queue[queued++] = index;
+			}
+			else if(res <= 0)
+			{
+				status = 1;
+			}
+			else
+			{
+				requests[index].done += res;
+				if(requests[index].done < ranges[index].length)
+					queue[queued++] = index;
+				else
+					++completed;
+			}
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	// The buffers must not be released while the kernel may still write to them.
+	while(in_flight > 0)
+	{
+		unsigned pending = *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		long ret = syscall(__NR_io_uring_enter, ring.fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			break;
+		unsigned head = *ring.cq_head;
+		unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		in_flight -= cq_tail - head;
+		__atomic_store_n(ring.cq_head, cq_tail, __ATOMIC_RELEASE);
+	}
+	free(queue);
+	free(requests);
+	io_ring_free_(&ring);
+	return status;
+}
+
+#endif
+
+// Reads every range completely, ranges may be read in any order. Without io_uring the ranges are read by
+// up to thread_count threads, the calling thread included.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int file_reader_read(FileReader *f, StreamRange *ranges, size_t count, size_t thread_count)
+{
+	if(count == 0)
+		return 0;
+#ifdef BSP_HAVE_IO_URING
+	int status = file_reader_read_uring_(f, ranges, count);
+	if(status >= 0)
+		return status;
+#endif
+	FileReaderJob job = { .reader = f, .ranges = ranges, .failed = false };
+	parallel_for(count, thread_count, file_reader_worker_, &job);
+	return job.failed ? 1 : 0;
+}
@@ -360,8 +360,53 @@ static const size_t lumpsizes[] = {
 	[LUMP_PATHCONNECTIONS] = 0
 };
 
+// Natural alignment of the largest scalar in each lump element, the structs above are packed.
+static const size_t lumpalignments[] = {
+	[LUMP_MATERIALS] = 4,
+	[LUMP_LIGHTBYTES] = 1,
+	[LUMP_LIGHTGRIDENTRIES] = 1,
+	[LUMP_LIGHTGRIDCOLORS] = 1,
+	[LUMP_PLANES] = 4,
+	[LUMP_BRUSHSIDES] = 4,
+	[LUMP_BRUSHES] = 2,
+	[LUMP_TRIANGLES] = 4,
+	[LUMP_DRAWVERTS] = 4,
+	[LUMP_DRAWINDICES] = 2,
+	[LUMP_CULLGROUPS] = 4,
+	[LUMP_CULLGROUPINDICES] = 1,
+	[LUMP_OBSOLETE_1] = 1,
+	[LUMP_OBSOLETE_2] = 1,
+	[LUMP_OBSOLETE_3] = 1,
+	[LUMP_OBSOLETE_4] = 1,
+	[LUMP_OBSOLETE_5] = 1,
+	[LUMP_PORTALVERTS] = 4,
+	[LUMP_OCCLUDERS] = 1,
+	[LUMP_OCCLUDERPLANES] = 1,
+	[LUMP_OCCLUDEREDGES] = 1,
+	[LUMP_OCCLUDERINDICES] = 1,
+	[LUMP_AABBTREES] = 4,
+	[LUMP_CELLS] = 4,
+	[LUMP_PORTALS] = 4,
+	[LUMP_NODES] = 4,
+	[LUMP_LEAFS] = 4,
+	[LUMP_LEAFBRUSHES] = 4,
+	[LUMP_LEAFSURFACES] = 4,
+	[LUMP_COLLISIONVERTS] = 4,
+	[LUMP_COLLISIONEDGES] = 4,
+	[LUMP_COLLISIONTRIS] = 4,
+	[LUMP_COLLISIONBORDERS] = 4,
+	[LUMP_COLLISIONPARTITIONS] = 4,
+	[LUMP_COLLISIONAABBS] = 4,
+	[LUMP_MODELS] = 4,
+	[LUMP_VISIBILITY] = 1,
+	[LUMP_ENTITIES] = 1,
+	[LUMP_PATHCONNECTIONS] = 1
+};
+
 typedef struct
 {
 	void *data;
 	size_t count;
+	bool mapped; // data points into the file mapping and is not owned
+	bool loaded;
 } LumpData;
\ No newline at end of file
@@ -21,6 +21,7 @@ typedef struct Stream_s
 	int (*name)(struct Stream_s *stream, char *buffer, size_t size);
 	int (*eof)(struct Stream_s *stream);
 	size_t (*read)(struct Stream_s *stream, void *ptr, size_t size, size_t nmemb);
+	size_t (*write)(struct Stream_s *stream, const void *ptr, size_t size, size_t nmemb); // NULL for read only streams
 } Stream;
 
 static size_t stream_read_buffer(Stream *s, void *ptr, size_t n)
@@ -28,8 +29,76 @@ static size_t stream_read_buffer(Stream *s, void *ptr, size_t n)
 	return s->read(s, ptr, n, 1);
 }
 
+static size_t stream_write_buffer(Stream *s, const void *ptr, size_t n)
+{
+	return s->write ? s->write(s, ptr, n, 1) : 0;
+}
+
 #define stream_read(s, ptr) stream_read_buffer(&(s), &(ptr), sizeof(ptr))
 
+typedef struct
+{
+	int64_t offset;
+	size_t length;
+	void *ptr;
+} StreamRange;
+
+#define STREAM_READV_MAX_GAP (64 * 1024)
+
+// Reads several ranges in one call. The ranges are sorted by offset in place and read in that order,
+// so neighbouring ranges are read back to back and gaps of up to STREAM_READV_MAX_GAP bytes are read
+// and dropped instead of seeking. Returns the number of ranges that were read completely.
+static size_t stream_readv(Stream *s, StreamRange *ranges, size_t count)
+{
+	for(size_t i = 1; i < count; ++i)
+	{
+		StreamRange r = ranges[i];
+		size_t j = i;
+		for(; j > 0 && ranges[j - 1].offset > r.offset; --j)
+			ranges[j] = ranges[j - 1];
+		ranges[j] = r;
+	}
+	size_t completed = 0;
+	int64_t position = -1;
+	for(size_t i = 0; i < count; ++i)
+	{
+		StreamRange *r = &ranges[i];
+		int64_t gap = r->offset - position;
+		if(position < 0 || gap < 0 || gap > STREAM_READV_MAX_GAP)
+		{
+			if(s->seek(s, r->offset, STREAM_SEEK_BEG))
+			{
+				position = -1;
+				continue;
+			}
+		}
+		else
+		{
+			uint8_t skip[4096];
+			while(gap > 0)
+			{
+				size_t n = gap < (int64_t)sizeof(skip) ? (size_t)gap : sizeof(skip);
+				if(s->read(s, skip, 1, n) != n)
+					break;
+				gap -= n;
+			}
+			if(gap > 0 && s->seek(s, r->offset, STREAM_SEEK_BEG))
+			{
+				position = -1;
+				continue;
+			}
+		}
+		if(r->length > 0 && s->read(s, r->ptr, r->length, 1) != 1)
+		{
+			position = -1;
+			continue;
+		}
+		position = r->offset + r->length;
+		++completed;
+	}
+	return completed;
+}
+
 static int stream_read_line(Stream *s, char *line, size_t max_line_length)
 {
 	size_t n = 0;
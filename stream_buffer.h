@@ -12,11 +12,15 @@ typedef struct
 static size_t stream_read_buffer_(struct Stream_s *stream, void *ptr, size_t size, size_t nmemb)
 {
 	StreamBuffer *sd = (StreamBuffer *)stream->ctx;
-	size_t nb = size * nmemb;
-	if(sd->offset + nb > sd->length)
+	if(size == 0 || sd->offset >= sd->length)
 	{
 		return 0; // EOF
 	}
+	// Like fread, reads as many whole elements as are left.
+	size_t available = (sd->length - sd->offset) / size;
+	if(nmemb > available)
+		nmemb = available;
+	size_t nb = size * nmemb;
 	memcpy(ptr, &sd->buffer[sd->offset], nb);
 	sd->offset += nb;
 	return nmemb;
@@ -82,7 +86,7 @@ static int init_stream_from_stream_buffer(Stream *s, StreamBuffer *sb)
 {	
 	s->ctx = sb;
 	s->read = stream_read_buffer_;
-	// s->write = stream_write_buffer_;
+	s->write = stream_write_buffer_;
 	s->eof = stream_eof_buffer_;
 	s->name = stream_name_buffer_;
 	s->tell = stream_tell_buffer_;
@@ -98,7 +102,7 @@ static int init_stream_from_buffer(Stream *s, StreamBuffer *sb, unsigned char *b
 	
 	s->ctx = sb;
 	s->read = stream_read_buffer_;
-	// s->write = stream_write_buffer_;
+	s->write = stream_write_buffer_;
 	s->eof = stream_eof_buffer_;
 	s->name = stream_name_buffer_;
 	s->tell = stream_tell_buffer_;
@@ -0,0 +1,128 @@
+#pragma once
+
+#include "stream.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Read buffering on top of another stream. The source is read in large blocks into a window,
+// stream_peek and stream_read_until hand out spans of that window without copying.
+
+typedef struct
+{
+	Stream *source;
+	unsigned char *data;
+	size_t capacity;
+	size_t offset; // read position in data
+	size_t length; // bytes in data
+	bool eof;
+} StreamBuffered;
+
+#define STREAM_BUFFERED_SIZE (64 * 1024)
+
+// capacity is the size of the window, 0 picks a default.
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int stream_buffered_init(StreamBuffered *b, Stream *source, size_t capacity)
+{
+	b->source = source;
+	b->capacity = capacity ? capacity : STREAM_BUFFERED_SIZE;
+	b->data = malloc(b->capacity);
+	b->offset = 0;
+	b->length = 0;
+	b->eof = false;
+	return b->data ? 0 : 1;
+}
+
+static void stream_buffered_free(StreamBuffered *b)
+{
+	free(b->data);
+	b->data = NULL;
+}
+
+// Moves the unread bytes to the front of the window and fills up the rest from the source.
+static void stream_buffered_fill_(StreamBuffered *b)
+{
+	if(b->offset > 0)
+	{
+		memmove(b->data, b->data + b->offset, b->length - b->offset);
+		b->length -= b->offset;
+		b->offset = 0;
+	}
+	if(b->eof || b->length == b->capacity)
+		return;
+	size_t want = b->capacity - b->length;
+	size_t n = b->source->read(b->source, b->data + b->length, 1, want);
+	b->length += n;
+	if(n < want)
+		b->eof = true;
+}
+
+// Returns up to n bytes at the read position without consuming them, n is limited by the window size.
+// The span stays valid until the next call on the stream.
+static size_t stream_peek(StreamBuffered *b, const void **ptr, size_t n)
+{
+	if(b->length - b->offset < n)
+		stream_buffered_fill_(b);
+	size_t available = b->length - b->offset;
+	*ptr = b->data + b->offset;
+	return n < available ? n : available;
+}
+
+// Consumes bytes that were returned by stream_peek.
+static void stream_skip(StreamBuffered *b, size_t n)
+{
+	b->offset += n;
+}
+
+// Consumes and returns the bytes up to and including delim. If delim doesn't show up within a full window
+// or before the end of the stream, the span holds everything that was buffered. Returns 0 at the end.
+// The span stays valid until the next call on the stream.
+static size_t stream_read_until(StreamBuffered *b, int delim, const char **span)
+{
+	size_t scanned = 0;
+	size_t n;
+	for(;;)
+	{
+		size_t available = b->length - b->offset;
+		const unsigned char *start = b->data + b->offset;
+		const unsigned char *p = memchr(start + scanned, delim, available - scanned);
+		if(p)
+		{
+			n = p - start + 1;
+			break;
+		}
+		scanned = available;
+		if(b->eof || available == b->capacity)
+		{
+			n = available;
+			break;
+		}
+		stream_buffered_fill_(b);
+	}
+	*span = (const char *)b->data + b->offset;
+	b->offset += n;
+	return n;
+}
+
+// Lines end at \n, \r is dropped. Returns false at the end of the stream.
+// Lines longer than max_line_length - 1 are truncated.
+static bool stream_buffered_read_line(StreamBuffered *b, char *line, size_t max_line_length)
+{
+	size_t n = 0;
+	const char *span;
+	size_t length;
+	bool any = false;
+	while((length = stream_read_until(b, '\n', &span)) > 0)
+	{
+		any = true;
+		bool eol = span[length - 1] == '\n';
+		for(size_t i = 0; i < length - eol; ++i)
+		{
+			if(span[i] != '\r' && n + 1 < max_line_length)
+				line[n++] = span[i];
+		}
+		if(eol)
+			break;
+	}
+	line[n] = 0;
+	return any;
+}
@@ -3,11 +3,13 @@
 #include "stream.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 typedef struct
 {
     char path[256];
 	FILE *fp;
+	bool owned; // opened by stream_open_file and closed with the stream
 } StreamFile;
 
 static size_t stream_read_(struct Stream_s *stream, void *ptr, size_t size, size_t nmemb)
@@ -65,6 +67,17 @@ static int stream_seek_(struct Stream_s *s, int64_t offset, int whence)
 	return 0;
 }
 
+static void stream_init_file_(Stream *s, StreamFile *sf)
+{
+	s->ctx = sf;
+	s->read = stream_read_;
+	s->write = stream_write_;
+	s->eof = stream_eof_;
+	s->name = stream_name_;
+	s->tell = stream_tell_;
+	s->seek = stream_seek_;
+}
+
 static int stream_open_file(Stream *s, const char *path, const char *mode)
 {
     FILE *fp = fopen(path, mode);
@@ -72,17 +85,22 @@ static int stream_open_file(Stream *s, const char *path, const char *mode)
         return 1;
     StreamFile *sf = malloc(sizeof(StreamFile));
     sf->fp = fp;
+    sf->owned = true;
     snprintf(sf->path, sizeof(sf->path), "%s", path);
-	s->ctx = sf;
-	s->read = stream_read_;
-	// s->write = stream_write_;
-	s->eof = stream_eof_;
-	s->name = stream_name_;
-	s->tell = stream_tell_;
-	s->seek = stream_seek_;
+	stream_init_file_(s, sf);
     return 0;
 }
 
+// Wraps a FILE that is already open, such as stdout or a pipe. Closing the stream flushes fp but leaves it open.
+static void stream_init_file(Stream *s, FILE *fp, const char *name)
+{
+    StreamFile *sf = malloc(sizeof(StreamFile));
+    sf->fp = fp;
+    sf->owned = false;
+    snprintf(sf->path, sizeof(sf->path), "%s", name);
+	stream_init_file_(s, sf);
+}
+
 static int stream_close_file(Stream *s)
 {
     if(!s->ctx)
@@ -90,8 +108,8 @@ static int stream_close_file(Stream *s)
         return 1;
     }
     StreamFile *sf = s->ctx;
-    fclose(sf->fp);
+    int status = sf->owned ? fclose(sf->fp) : fflush(sf->fp);
     free(sf);
     s->ctx = NULL;
-    return 0;
+    return status ? 1 : 0;
 }
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "stream.h"
+#include <stdlib.h>
+#include <string.h>
+#include <growable-buf/buf.h>
+
+// Read/write stream over a buffer that grows as it is written to.
+
+typedef struct
+{
+	unsigned char *data;
+	size_t offset;
+} StreamMemory;
+
+static size_t stream_read_memory_(struct Stream_s *stream, void *ptr, size_t size, size_t nmemb)
+{
+	StreamMemory *sm = (StreamMemory *)stream->ctx;
+	size_t length = buf_size(sm->data);
+	if(size == 0 || sm->offset >= length)
+		return 0;
+	size_t available = (length - sm->offset) / size;
+	if(nmemb > available)
+		nmemb = available;
+	memcpy(ptr, sm->data + sm->offset, size * nmemb);
+	sm->offset += size * nmemb;
+	return nmemb;
+}
+
+static size_t stream_write_memory_(struct Stream_s *stream, const void *ptr, size_t size, size_t nmemb)
+{
+	StreamMemory *sm = (StreamMemory *)stream->ctx;
+	size_t nb = size * nmemb;
+	size_t length = buf_size(sm->data);
+	if(sm->offset + nb > length)
+	{
+		size_t capacity = buf_capacity(sm->data);
+		if(sm->offset + nb > capacity)
+		{
+			size_t grow = capacity > nb ? capacity : nb;
+			buf_grow(sm->data, grow + (sm->offset > length ? sm->offset - length : 0));
+		}
+		// Writing past the end after a seek leaves zeros in between.
+		if(sm->offset > length)
+			memset(sm->data + length, 0, sm->offset - length);
+		buf_ptr(sm->data)->size = sm->offset + nb;
+	}
+	memcpy(sm->data + sm->offset, ptr, nb);
+	sm->offset += nb;
+	return nmemb;
+}
+
+static int stream_eof_memory_(struct Stream_s *stream)
+{
+	StreamMemory *sm = (StreamMemory *)stream->ctx;
+	return sm->offset >= buf_size(sm->data);
+}
+
+static int stream_name_memory_(struct Stream_s *s, char *buffer, size_t size)
+{
+	(void)s;
+	if(size > 0)
+		buffer[0] = 0;
+	return 0;
+}
+
+static int64_t stream_tell_memory_(struct Stream_s *s)
+{
+	StreamMemory *sm = (StreamMemory *)s->ctx;
+	return sm->offset;
+}
+
+static int stream_seek_memory_(struct Stream_s *s, int64_t offset, int whence)
+{
+	StreamMemory *sm = (StreamMemory *)s->ctx;
+	switch(whence)
+	{
+		case STREAM_SEEK_CUR: offset += sm->offset; break;
+		case STREAM_SEEK_END: offset += buf_size(sm->data); break;
+	}
+	if(offset < 0)
+		return 1;
+	sm->offset = offset;
+	return 0;
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int stream_open_memory(Stream *s)
+{
+	StreamMemory *sm = calloc(1, sizeof(StreamMemory));
+	if(!sm)
+		return 1;
+	s->ctx = sm;
+	s->read = stream_read_memory_;
+	s->write = stream_write_memory_;
+	s->eof = stream_eof_memory_;
+	s->name = stream_name_memory_;
+	s->tell = stream_tell_memory_;
+	s->seek = stream_seek_memory_;
+	return 0;
+}
+
+// Everything written so far, valid until the next write or until the stream is closed.
+static unsigned char *stream_memory_data(Stream *s, size_t *size)
+{
+	StreamMemory *sm = (StreamMemory *)s->ctx;
+	*size = buf_size(sm->data);
+	return sm->data;
+}
+
+static void stream_close_memory(Stream *s)
+{
+	StreamMemory *sm = (StreamMemory *)s->ctx;
+	if(!sm)
+		return;
+	buf_free(sm->data);
+	free(sm);
+	s->ctx = NULL;
+}
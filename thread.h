@@ -0,0 +1,185 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdlib.h>
+#include "process_stats.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+typedef HANDLE Thread;
+typedef CRITICAL_SECTION Mutex;
+#else
+#include <pthread.h>
+#include <unistd.h>
+typedef pthread_t Thread;
+typedef pthread_mutex_t Mutex;
+#endif
+
+typedef void (*ThreadFunction)(void *arg);
+
+typedef struct
+{
+	ThreadFunction fn;
+	void *arg;
+} ThreadStart;
+
+#ifdef _WIN32
+static DWORD WINAPI thread_start_(LPVOID arg)
+#else
+static void *thread_start_(void *arg)
+#endif
+{
+	ThreadStart start = *(ThreadStart *)arg;
+	free(arg);
+	start.fn(start.arg);
+	return 0;
+}
+
+/* This function returns zero if successful, or else it returns a non-zero value. */
+static int thread_create(Thread *t, ThreadFunction fn, void *arg)
+{
+	ThreadStart *start = malloc(sizeof(ThreadStart));
+	start->fn = fn;
+	start->arg = arg;
+#ifdef _WIN32
+	*t = CreateThread(NULL, 0, thread_start_, start, 0, NULL);
+	if(!*t)
+#else
+	if(pthread_create(t, NULL, thread_start_, start))
+#endif
+	{
+		free(start);
+		return 1;
+	}
+	return 0;
+}
+
+static void thread_join(Thread t)
+{
+#ifdef _WIN32
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+#else
+	pthread_join(t, NULL);
+#endif
+}
+
+static size_t thread_hardware_concurrency()
+{
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	return si.dwNumberOfProcessors > 0 ? si.dwNumberOfProcessors : 1;
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (size_t)n : 1;
+#endif
+}
+
+static void mutex_init(Mutex *m)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(m);
+#else
+	pthread_mutex_init(m, NULL);
+#endif
+}
+
+static void mutex_destroy(Mutex *m)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(m);
+#else
+	pthread_mutex_destroy(m);
+#endif
+}
+
+static void mutex_lock(Mutex *m)
+{
+#ifdef _WIN32
+	EnterCriticalSection(m);
+#else
+	pthread_mutex_lock(m);
+#endif
+}
+
+static void mutex_unlock(Mutex *m)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(m);
+#else
+	pthread_mutex_unlock(m);
+#endif
+}
+
+typedef void (*ParallelFunction)(void *ctx, size_t index);
+
+typedef struct
+{
+	ParallelFunction fn;
+	void *ctx;
+	size_t count;
+	size_t next;
+	double helper_cpu; // CPU seconds used by the threads started for the loop
+	Mutex mutex;
+} ParallelFor;
+
+static void parallel_for_worker_(void *arg)
+{
+	ParallelFor *pf = arg;
+	for(;;)
+	{
+		mutex_lock(&pf->mutex);
+		size_t index = pf->next++;
+		mutex_unlock(&pf->mutex);
+		if(index >= pf->count)
+			break;
+		pf->fn(pf->ctx, index);
+	}
+}
+
+static void parallel_for_helper_(void *arg)
+{
+	ParallelFor *pf = arg;
+	parallel_for_worker_(pf);
+	// The thread only ever ran this loop, so all of its CPU time belongs to it.
+	double cpu = thread_cpu_time();
+	mutex_lock(&pf->mutex);
+	pf->helper_cpu += cpu;
+	mutex_unlock(&pf->mutex);
+}
+
+// Same as parallel_for, returns the CPU seconds used by the threads it started, the calling thread isn't included.
+static double parallel_for_cpu(size_t count, size_t thread_count, ParallelFunction fn, void *ctx)
+{
+	if(thread_count > count)
+		thread_count = count;
+	if(thread_count <= 1)
+	{
+		for(size_t i = 0; i < count; ++i)
+			fn(ctx, i);
+		return 0.0;
+	}
+	ParallelFor pf = { .fn = fn, .ctx = ctx, .count = count, .next = 0 };
+	mutex_init(&pf.mutex);
+	Thread *threads = malloc((thread_count - 1) * sizeof(Thread));
+	size_t started = 0;
+	for(; started < thread_count - 1; ++started)
+	{
+		if(thread_create(&threads[started], parallel_for_helper_, &pf))
+			break;
+	}
+	parallel_for_worker_(&pf);
+	for(size_t i = 0; i < started; ++i)
+		thread_join(threads[i]);
+	free(threads);
+	mutex_destroy(&pf.mutex);
+	return pf.helper_cpu;
+}
+
+// Calls fn for every index in [0, count) spread over up to thread_count threads, the calling thread included.
+static void parallel_for(size_t count, size_t thread_count, ParallelFunction fn, void *ctx)
+{
+	parallel_for_cpu(count, thread_count, fn, ctx);
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <growable-buf/buf.h>
+#include "stream.h"
+
+enum
+{
+	WRITER_FLOAT_FIXED, // same as printf("%f")
+	WRITER_FLOAT_SHORTEST // shortest decimal that reads back as the same float
+};
+
+// Text output with a large append buffer, flushed to stream when it fills up.
+// Without a stream everything stays in memory.
+
+typedef struct
+{
+	char *data;
+	Stream *stream;
+	size_t flush_size;
+	int float_format;
+	bool error; // a flush to the stream failed
+} Writer;
+
+#define WRITER_FLUSH_SIZE (1 << 20)
+
+static void writer_init(Writer *w, Stream *stream, int float_format)
+{
+	w->data = NULL;
+	w->stream = stream;
+	w->flush_size = WRITER_FLUSH_SIZE;
+	w->float_format = float_format;
+	w->error = false;
+}
+
+static void writer_flush(Writer *w)
+{
+	if(w->stream && buf_size(w->data) > 0)
+	{
+		if(stream_write_buffer(w->stream, w->data, buf_size(w->data)) != 1)
+			w->error = true;
+		buf_clear(w->data);
+	}
+}
+
+static void writer_free(Writer *w)
+{
+	writer_flush(w);
+	buf_free(w->data);
+}
+
+// Reserves n bytes at the end of the buffer and returns a pointer to them.
+static char *writer_reserve_(Writer *w, size_t n)
+{
+	size_t size = buf_size(w->data);
+	size_t capacity = buf_capacity(w->data);
+	if(capacity - size < n)
+	{
+		size_t grow = capacity > n ? capacity : n;
+		if(grow < 4096)
+			grow = 4096;
+		buf_grow(w->data, grow);
+	}
+	buf_ptr(w->data)->size = size + n;
+	return w->data + size;
+}
+
+static void writer_commit_(Writer *w, size_t unused)
+{
+	buf_ptr(w->data)->size -= unused;
+	if(w->stream && buf_size(w->data) >= w->flush_size)
+		writer_flush(w);
+}
+
+static void writer_write(Writer *w, const void *ptr, size_t n)
+{
+	if(n == 0)
+		return;
+	memcpy(writer_reserve_(w, n), ptr, n);
+	writer_commit_(w, 0);
+}
+
+static void writer_string(Writer *w, const char *s)
+{
+	writer_write(w, s, strlen(s));
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+#define WRITER_PRINTF_FORMAT __attribute__((format(printf, 2, 3)))
+#else
+#define WRITER_PRINTF_FORMAT
+#endif
+
+// The format is checked like printf's by compilers that support it.
+static void writer_printf(Writer *w, const char *fmt, ...) WRITER_PRINTF_FORMAT;
+
+static void writer_printf(Writer *w, const char *fmt, ...)
+{
+	va_list va;
+	va_start(va, fmt);
+	int n = vsnprintf(NULL, 0, fmt, va);
+	va_end(va);
+	if(n <= 0)
+		return;
+	char *dst = writer_reserve_(w, n + 1);
+	va_start(va, fmt);
+	vsnprintf(dst, n + 1, fmt, va);
+	va_end(va);
+	writer_commit_(w, 1);
+}
+
+static size_t format_u64_(char *dst, uint64_t v, size_t min_digits)
+{
+	char tmp[24];
+	size_t n = 0;
+	do
+	{
+		tmp[n++] = '0' + (char)(v % 10);
+		v /= 10;
+	} while(v);
+	while(n < min_digits)
+		tmp[n++] = '0';
+	for(size_t i = 0; i < n; ++i)
+		dst[i] = tmp[n - i - 1];
+	return n;
+}
+
+static void writer_int(Writer *w, int64_t v)
+{
+	char *dst = writer_reserve_(w, 21);
+	size_t n = 0;
+	if(v < 0)
+		dst[n++] = '-';
+	n += format_u64_(dst + n, v < 0 ? (uint64_t)0 - (uint64_t)v : (uint64_t)v, 1);
+	writer_commit_(w, 21 - n);
+}
+
+static const double writer_pow10_[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+// Writes round(|f| * 10^decimals) with a decimal point inserted, the product is exact in double for floats.
+static size_t format_scaled_(char *dst, bool negative, uint64_t v, size_t decimals)
+{
+	size_t n = 0;
+	if(negative)
+		dst[n++] = '-';
+	uint64_t scale = (uint64_t)writer_pow10_[decimals];
+	n += format_u64_(dst + n, v / scale, 1);
+	if(decimals > 0)
+	{
+		dst[n++] = '.';
+		n += format_u64_(dst + n, v % scale, decimals);
+	}
+	return n;
+}
+
+static size_t format_float_(char *dst, size_t size, float f, int float_format)
+{
+	// Anything that doesn't fit the integer path goes through printf.
+	if(!isfinite(f) || fabsf(f) >= 1e9f)
+	{
+		return snprintf(dst, size, float_format == WRITER_FLOAT_FIXED ? "%f" : "%.9g", f);
+	}
+	bool negative = signbit(f) != 0;
+	double d = fabs((double)f);
+	if(float_format == WRITER_FLOAT_FIXED)
+	{
+		// nearbyint rounds half to even, like printf does on the exact binary value.
+		return format_scaled_(dst, negative, (uint64_t)nearbyint(d * 1e6), 6);
+	}
+	for(size_t decimals = 0; decimals < sizeof(writer_pow10_) / sizeof(writer_pow10_[0]); ++decimals)
+	{
+		double v = nearbyint(d * writer_pow10_[decimals]);
+		if((float)(v / writer_pow10_[decimals]) == (float)d)
+			return format_scaled_(dst, negative, (uint64_t)v, decimals);
+	}
+	return snprintf(dst, size, "%.9g", f);
+}
+
+static void writer_float(Writer *w, float f)
+{
+	char *dst = writer_reserve_(w, 64);
+	size_t n = format_float_(dst, 64, f, w->float_format);
+	writer_commit_(w, 64 - n);
+}